@@ -0,0 +1,558 @@
+/**
+* config.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Configuration files. Two formats are read and written:
+ *
+ *  - binary: a struct config_header followed by tagged fields,
+ *    see cpu_throttle.h.
+ *  - text: one "key = value" per line, '#' starts a comment.
+ *    Keys and units are those of the command line options.
+ *
+ * Settings missing from a file keep their current value and
+ * unknown tags or keys are skipped, so files stay readable across
+ * versions. Files holding the raw struct dump written by earlier
+ * versions are loaded and rewritten in the binary format. */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include "cpu_throttle.h"
+
+/* Size of struct throttle_settings as dumped by the first release.
+ * Every later field was appended, so any older dump is a prefix
+ * of the current struct. */
+#define CONFIG_LEGACY_SIZE (MAX_BUF_SIZE + (11 * sizeof(int)))
+
+/* significant digits needed to print any scaled int exactly */
+#define SETTING_DIGITS 10
+
+#define SETTING_INT_KEY(tag, name, field, scale, runtime) \
+	{ tag, name, SETTING_INT, \
+		offsetof(struct throttle_settings, field), scale, NULL, NULL, runtime }
+
+/* an int key where -1 leaves the value to the hardware */
+#define SETTING_UNSET_KEY(tag, name, field, scale, runtime) \
+	{ tag, name, SETTING_INT, \
+		offsetof(struct throttle_settings, field), scale, NULL, NULL, runtime, 1 }
+
+#define SETTING_STRING_KEY(tag, name, field) \
+	{ tag, name, SETTING_STRING, \
+		offsetof(struct throttle_settings, field), 1, NULL, NULL, 0 }
+
+static const struct setting_key keys[] = {
+	SETTING_STRING_KEY(1, "log", log_path),
+	SETTING_INT_KEY(2, "logging", logging_enabled, 1, 0),
+	SETTING_INT_KEY(3, "verbose", verbose, 1, 1),
+	SETTING_INT_KEY(4, "hysteresis", hysteresis, C_TO_MC(1), 1),
+	SETTING_INT_KEY(5, "reset-threshold", hysteresis_reset_threshold, 1, 1),
+	SETTING_UNSET_KEY(6, "minimum-fan-speed", fan_min_speed, 1, 1),
+	SETTING_INT_KEY(7, "fan-step", fan_scaling_step, 1, 1),
+	SETTING_INT_KEY(8, "temp", cpu_target_temperature, C_TO_MC(1), 1),
+	SETTING_UNSET_KEY(9, "max-freq", cpu_max_freq, MHZ_TO_KHZ(1), 1),
+	SETTING_INT_KEY(10, "cpu-step", cpu_scaling_step, MHZ_TO_KHZ(1), 1),
+	SETTING_INT_KEY(11, "interval", polling_interval, MS_TO_US(1), 1),
+	{ 12, "controller", SETTING_INT,
+		offsetof(struct throttle_settings, controller), 1,
+		controller_lookup, controller_name, 1 },
+	SETTING_INT_KEY(13, "pid-kp", pid_kp, MHZ_TO_KHZ(1), 1),
+	SETTING_INT_KEY(14, "pid-ki", pid_ki, MHZ_TO_KHZ(1), 1),
+	SETTING_INT_KEY(15, "pid-kd", pid_kd, MHZ_TO_KHZ(1), 1),
+	{ 16, "log-level", SETTING_INT,
+		offsetof(struct throttle_settings, log_level), 1,
+		log_level_lookup, log_level_name, 1 },
+	SETTING_STRING_KEY(17, "telemetry", telemetry_path),
+	SETTING_STRING_KEY(18, "metrics-socket", metrics_path),
+	SETTING_STRING_KEY(19, "control-socket", control_path),
+	SETTING_INT_KEY(20, "predict-horizon", predict_horizon, 1, 1),
+	SETTING_INT_KEY(21, "predict-alpha", predict_alpha, 1, 1),
+	SETTING_INT_KEY(22, "predict-beta", predict_beta, 1, 1),
+	SETTING_INT_KEY(23, "load-threshold", load_threshold, 1, 1),
+	SETTING_STRING_KEY(24, "rapl", rapl_packages),
+	SETTING_INT_KEY(25, "turbo-gating", turbo_gating, 1, 1),
+	SETTING_INT_KEY(26, "turbo-off", turbo_off_offset, C_TO_MC(1), 1),
+	SETTING_INT_KEY(27, "turbo-on", turbo_on_margin, C_TO_MC(1), 1),
+	SETTING_INT_KEY(28, "epp", epp, 1, 0),
+	SETTING_INT_KEY(29, "idle-injection", idle_injection, 1, 1),
+	SETTING_INT_KEY(30, "event-wakeups", event_wakeups, 1, 0),
+	SETTING_INT_KEY(31, "max-interval", max_polling_interval, MS_TO_US(1), 1),
+	{ 32, "throttle-first", SETTING_INT,
+		offsetof(struct throttle_settings, throttle_first), 1,
+		throttle_first_lookup, throttle_first_name, 1 },
+};
+#define NUM_SETTING_KEYS ((int)(sizeof(keys) / sizeof(keys[0])))
+
+/* Returns the i-th setting key, NULL past the last one. */
+const struct setting_key *setting_key_at(int i)
+{
+	return ((i >= 0) && (i < NUM_SETTING_KEYS)) ? &keys[i] : NULL;
+}
+
+/* Returns the setting key called name, NULL if there is none. */
+const struct setting_key *setting_key_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_SETTING_KEYS; i++) {
+		if (!strcmp(keys[i].name, name))
+			return &keys[i];
+	}
+	return NULL;
+}
+
+/* Returns the setting key with tag, NULL if there is none. */
+static const struct setting_key *setting_key_tagged(int tag)
+{
+	int i;
+
+	for (i = 0; i < NUM_SETTING_KEYS; i++) {
+		if (keys[i].tag == tag)
+			return &keys[i];
+	}
+	return NULL;
+}
+
+/* Returns the value of key in s. */
+static void *setting_field(const struct throttle_settings *s,
+		const struct setting_key *key)
+{
+	return (char *)s + key->offset;
+}
+
+/* Format the value of key in s into buf, in the units it is set in. */
+void setting_format(char *buf, size_t size,
+		const struct throttle_settings *s, const struct setting_key *key)
+{
+	const char *name;
+	int value;
+
+	if (key->type == SETTING_STRING) {
+		snprintf(buf, size, "%s", (char *)setting_field(s, key));
+		return;
+	}
+
+	value = *(int *)setting_field(s, key);
+
+	/* -1 is left for the hardware to decide and is not scaled */
+	if (key->name_of && (name = key->name_of(value)))
+		snprintf(buf, size, "%s", name);
+	else if ((key->scale == 1) || (key->unset && (value == -1)))
+		snprintf(buf, size, "%d", value);
+	else
+		snprintf(buf, size, "%.*g", SETTING_DIGITS, (double)value / key->scale);
+}
+
+/* Set key in s to the value given as text, in the units of
+ * the matching command line option.
+ *
+ * @return: 0 if succesful, -1 if the value is not valid. */
+int setting_parse(struct throttle_settings *s,
+		const struct setting_key *key, const char *text)
+{
+	double value;
+	char *end;
+	int parsed;
+
+	if (key->type == SETTING_STRING) {
+		if (strlen(text) >= MAX_BUF_SIZE)
+			return -1;
+
+		strcpy(setting_field(s, key), text);
+		return 0;
+	}
+
+	if (key->lookup) {
+		if ((parsed = key->lookup(text)) == -1)
+			return -1;
+	}
+	else {
+		errno = 0;
+		value = strtod(text, &end) * key->scale;
+
+		if (errno || (end == text) || *end ||
+				(value > INT_MAX) || (value < INT_MIN))
+			return -1;
+
+		parsed = (int)((value < 0) ? value - 0.5 : value + 0.5);
+
+		/* see setting_format */
+		if (key->unset && !strcmp(text, "-1"))
+			parsed = -1;
+	}
+
+	*(int *)setting_field(s, key) = parsed;
+	return 0;
+}
+
+/* Bitwise crc32 (IEEE), the files are too small to need a table. */
+static uint32_t config_crc32(const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+/* Load the fields of a binary file of len bytes into target.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int config_parse_binary(const unsigned char *buf, size_t len,
+		struct throttle_settings *target)
+{
+	const struct setting_key *key;
+	struct config_header header;
+	struct config_field field;
+	const unsigned char *payload;
+	size_t pos = 0, size;
+	int32_t value;
+
+	memcpy(&header, buf, sizeof(header));
+
+	if ((header.header_size < sizeof(header)) ||
+			(header.header_size > len) ||
+			(header.payload_size > len - header.header_size)) {
+		LOGE("Config file %s is truncated.\n", config_file_path);
+		return -1;
+	}
+
+	payload = buf + header.header_size;
+
+	if (config_crc32(payload, header.payload_size) != header.checksum) {
+		LOGE("Config file %s is corrupt, checksum mismatch.\n",
+				config_file_path);
+		return -1;
+	}
+
+	if (header.version > CONFIG_VERSION) {
+		LOGW("\tConfig file %s is version %d, newer fields are ignored.\n",
+				config_file_path, header.version);
+	}
+
+	while (pos + sizeof(field) <= header.payload_size) {
+		memcpy(&field, payload + pos, sizeof(field));
+		pos += sizeof(field);
+
+		if (field.length > header.payload_size - pos) {
+			LOGE("Config file %s has a truncated field.\n", config_file_path);
+			return -1;
+		}
+
+		/* written by a newer version, skip it */
+		if (!(key = setting_key_tagged(field.tag))) {
+			pos += field.length;
+			continue;
+		}
+
+		if (key->type == SETTING_STRING) {
+			size = (field.length < MAX_BUF_SIZE) ?
+				field.length : MAX_BUF_SIZE - 1;
+			memcpy(setting_field(target, key), payload + pos, size);
+			((char *)setting_field(target, key))[size] = '\0';
+		}
+		else if (field.length == sizeof(value)) {
+			memcpy(&value, payload + pos, sizeof(value));
+			*(int *)setting_field(target, key) = value;
+		}
+		else {
+			LOGW("\tIgnoring malformed %s in %s.\n", key->name, config_file_path);
+		}
+		pos += field.length;
+	}
+	return 0;
+}
+
+/* Load the "key = value" lines of a text file into target. The
+ * buffer is modified.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int config_parse_text(char *buf, struct throttle_settings *target)
+{
+	const struct setting_key *key;
+	char *line, *next, *name, *value, *end;
+	int number = 0;
+
+	for (line = buf; line; line = next) {
+		number++;
+
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+
+		/* drop comments and surrounding whitespace */
+		if ((end = strchr(line, '#')))
+			*end = '\0';
+		while ((*line == ' ') || (*line == '\t'))
+			line++;
+		end = line + strlen(line);
+		while ((end > line) && ((end[-1] == ' ') ||
+				(end[-1] == '\t') || (end[-1] == '\r')))
+			*--end = '\0';
+
+		if (!*line)
+			continue;
+
+		if (!(value = strchr(line, '='))) {
+			LOGE("%s:%d: expected key = value.\n", config_file_path, number);
+			return -1;
+		}
+
+		/* split and trim the key and the value */
+		for (end = value; (end > line) && ((end[-1] == ' ') ||
+				(end[-1] == '\t')); end--)
+			;
+		*end = '\0';
+		name = line;
+
+		value++;
+		while ((*value == ' ') || (*value == '\t'))
+			value++;
+
+		if (!(key = setting_key_find(name))) {
+			LOGW("\t%s:%d: ignoring unknown key %s.\n",
+					config_file_path, number, name);
+			continue;
+		}
+
+		if (setting_parse(target, key, value) == -1) {
+			LOGE("%s:%d: invalid value %s for %s.\n",
+					config_file_path, number, value, name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write s to path in format, through a temporary file renamed
+ * over path so a crash never leaves a partial file behind.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int config_save(const char *path, const struct throttle_settings *s,
+		int format)
+{
+	const struct setting_key *key;
+	struct config_header header;
+	struct config_field field;
+	char tmp_path[MAX_BUF_SIZE + 8];
+	char value[MAX_BUF_SIZE];
+	char *buf = NULL;
+	size_t len = 0;
+	int32_t number;
+	FILE *out;
+	int i, fd, rc = 0;
+
+	if (!(out = open_memstream(&buf, &len)))
+		return -1;
+
+	if (format == CONFIG_TEXT) {
+		fprintf(out, "# cpu_throttle configuration\n");
+		for (i = 0; i < NUM_SETTING_KEYS; i++) {
+			setting_format(value, sizeof(value), s, &keys[i]);
+			fprintf(out, "%s = %s\n", keys[i].name, value);
+		}
+	}
+	else {
+		/* the header is filled in once the payload is known */
+		memset(&header, 0, sizeof(header));
+		fwrite(&header, sizeof(header), 1, out);
+
+		for (i = 0; i < NUM_SETTING_KEYS; i++) {
+			key = &keys[i];
+			field.tag = key->tag;
+
+			if (key->type == SETTING_STRING) {
+				field.length = strlen(setting_field(s, key));
+				fwrite(&field, sizeof(field), 1, out);
+				fwrite(setting_field(s, key), field.length, 1, out);
+			}
+			else {
+				number = *(int *)setting_field(s, key);
+				field.length = sizeof(number);
+				fwrite(&field, sizeof(field), 1, out);
+				fwrite(&number, sizeof(number), 1, out);
+			}
+		}
+	}
+
+	if (fclose(out) == EOF) {
+		free(buf);
+		return -1;
+	}
+
+	if (format != CONFIG_TEXT) {
+		header.magic = CONFIG_MAGIC;
+		header.version = CONFIG_VERSION;
+		header.header_size = sizeof(header);
+		header.payload_size = len - sizeof(header);
+		header.checksum = config_crc32((unsigned char *)buf + sizeof(header),
+				header.payload_size);
+		memcpy(buf, &header, sizeof(header));
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	if ((fd = open(tmp_path, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC,
+				S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1) {
+		perror("open");
+		LOGE("Failed to open config file %s for writing.\n", tmp_path);
+		free(buf);
+		return -1;
+	}
+
+	if ((write(fd, buf, len) != (ssize_t)len) || (fsync(fd) == -1)) {
+		perror("write");
+		LOGE("Failed to write to config file at %s.\n", tmp_path);
+		rc = -1;
+	}
+	close(fd);
+	free(buf);
+
+	if ((rc == -1) || (rename(tmp_path, path) == -1)) {
+		LOGE("Failed to replace config file %s.\n", path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read the configuration specified by the user into target.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int read_configuration_file(struct throttle_settings *target)
+{
+	struct throttle_settings loaded;
+	struct stat stat_buf;
+	unsigned char *buf;
+	size_t len = 0;
+	ssize_t rc;
+	int fd;
+
+	// Do nothing if there's no config file specified.
+	if (config_file_path == NULL) {
+		return 0;
+	}
+
+	/* check if the file exists at that path */
+	if (stat(config_file_path, &stat_buf) == -1) {
+		return 0;
+	}
+
+	// we found the node
+	LOGI("\tFound config file at %s.\n", config_file_path);
+
+	if (stat_buf.st_size > CONFIG_MAX_SIZE) {
+		LOGE("Config file %s is too large.\n", config_file_path);
+		return -1;
+	}
+
+	/* open the file */
+	if ((fd = open(config_file_path, O_RDONLY | O_CLOEXEC)) == -1) {
+		perror("open");
+		LOGE("Failed to open config file %s for reading.\n", config_file_path);
+		return -1;
+	}
+
+	/* room for a terminator, so text can be parsed in place */
+	if (!(buf = calloc(1, stat_buf.st_size + 1))) {
+		close(fd);
+		return -1;
+	}
+
+	/* read the whole file, a short read is not the end of it */
+	while (len < (size_t)stat_buf.st_size) {
+		rc = read(fd, buf + len, stat_buf.st_size - len);
+
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			LOGE("Failed to read config file at %s.\n", config_file_path);
+			break;
+		}
+		if (rc == 0)
+			break;
+		len += rc;
+	}
+	close(fd);
+
+	if (len != (size_t)stat_buf.st_size) {
+		LOGE("Config file %s is truncated.\n", config_file_path);
+		free(buf);
+		return -1;
+	}
+
+	/* target is only changed if the whole file loads */
+	memcpy(&loaded, target, sizeof(loaded));
+
+	if ((len >= sizeof(struct config_header)) &&
+			(*(uint32_t *)buf == CONFIG_MAGIC)) {
+		rc = config_parse_binary(buf, len, &loaded);
+	}
+	else if (memchr(buf, '\0', len)) {
+		/* only the raw struct dump holds nul bytes */
+		if ((len < CONFIG_LEGACY_SIZE) ||
+				(len > sizeof(struct throttle_settings))) {
+			LOGE("Config file %s is in an unknown format.\n",
+					config_file_path);
+			rc = -1;
+		}
+		else {
+			LOGI("\tMigrating config file %s to the versioned format.\n",
+					config_file_path);
+			memcpy(&loaded, buf, len);
+
+			/* the hardware is not read yet, so the values are
+			 * kept as they are and clamped by validate_settings */
+			terminate_settings(&loaded);
+
+			if (config_save(config_file_path, &loaded, CONFIG_BINARY) == -1)
+				LOGW("\tCould not rewrite %s, it will be migrated "
+						"again next time.\n", config_file_path);
+			rc = 0;
+		}
+	}
+	else {
+		rc = config_parse_text((char *)buf, &loaded);
+	}
+	free(buf);
+
+	if (rc == 0)
+		memcpy(target, &loaded, sizeof(loaded));
+
+	return rc;
+}
+
+/* Write to the configuration specified by the user.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int write_configuration_file()
+{
+	// Do nothing if no config was specified.
+	if (config_file_path == NULL) {
+		return 0;
+	}
+
+	return config_save(config_file_path, settings, config_format);
+}
@@ -0,0 +1,298 @@
+/**
+* control.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Line based control socket. Every command is one line:
+ *
+ *   set KEY VALUE   change one setting
+ *   get KEY         print one setting
+ *   show            print every setting
+ *
+ * and is answered with one line, "ok ..." or "error: ...". A change
+ * is made on a private copy of the settings which is then published
+ * whole, so a tick always runs with one consistent snapshot. */
+
+/* accept4 needs the feature macros set by cpu_throttle.h */
+#include "cpu_throttle.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* A connected client */
+struct control_client {
+	int fd;
+
+	/* partial command read so far */
+	char line[MAX_BUF_SIZE];
+	size_t line_len;
+};
+
+static int listen_fd = -1;
+static char socket_path[MAX_BUF_SIZE];
+
+static struct control_client clients[CONTROL_MAX_CLIENTS];
+
+/* Returns the key called name if it can be changed
+ * while running, NULL otherwise. */
+static const struct setting_key *control_find_key(const char *name)
+{
+	const struct setting_key *key = setting_key_find(name);
+
+	return (key && key->runtime) ? key : NULL;
+}
+
+/* Change key to the value given as text on a copy of the settings
+ * and publish it. Replies with the value in effect afterwards, which
+ * may have been clamped.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int control_set(const struct setting_key *key, const char *text,
+		char *reply, size_t size)
+{
+	struct throttle_settings *candidate;
+	char current[MAX_BUF_SIZE];
+
+	if (!(candidate = copy_settings())) {
+		snprintf(reply, size, "error: out of memory\n");
+		return -1;
+	}
+
+	if (setting_parse(candidate, key, text) == -1) {
+		snprintf(reply, size, "error: invalid %s %s\n", key->name, text);
+		free(candidate);
+		return -1;
+	}
+
+	publish_settings(candidate);
+
+	LOGI("Control socket set %s to %s.\n", key->name, text);
+
+	setting_format(current, sizeof(current), settings, key);
+	snprintf(reply, size, "ok %s\n", current);
+
+	return 0;
+}
+
+/* Run the command in line and write the reply to out. */
+static void control_command(char *line, FILE *out)
+{
+	const struct setting_key *key;
+	char *command, *name, *value, *saveptr;
+	char buf[MAX_BUF_SIZE];
+	int i;
+
+	command = strtok_r(line, " \t\r", &saveptr);
+	name = strtok_r(NULL, " \t\r", &saveptr);
+	value = strtok_r(NULL, " \t\r", &saveptr);
+
+	if (!command) {
+		return;
+	}
+	else if (!strcmp(command, "show")) {
+		fprintf(out, "ok\n");
+		for (i = 0; (key = setting_key_at(i)); i++) {
+			if (!key->runtime)
+				continue;
+			setting_format(buf, sizeof(buf), settings, key);
+			fprintf(out, "%s %s\n", key->name, buf);
+		}
+		/* blank line ends a multi line reply */
+		fprintf(out, "\n");
+	}
+	else if ((strcmp(command, "get") && strcmp(command, "set")) || !name) {
+		fprintf(out, "error: usage: set KEY VALUE | get KEY | show\n");
+	}
+	else if (!(key = control_find_key(name))) {
+		fprintf(out, "error: unknown key %s\n", name);
+	}
+	else if (!strcmp(command, "get")) {
+		setting_format(buf, sizeof(buf), settings, key);
+		fprintf(out, "ok %s\n", buf);
+	}
+	else if (!value) {
+		fprintf(out, "error: missing value for %s\n", name);
+	}
+	else {
+		control_set(key, value, buf, sizeof(buf));
+		fputs(buf, out);
+	}
+}
+
+/* Drop a client and free its slot. */
+static void control_disconnect(struct control_client *client)
+{
+	engine_remove_fd(client->fd);
+	close(client->fd);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+/* Returns the client connected on fd. */
+static struct control_client *control_find(int fd)
+{
+	int i;
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (clients[i].fd == fd)
+			return &clients[i];
+	}
+	return NULL;
+}
+
+/* Event loop callback for a connected client: run every complete
+ * line received and send the replies back. Replies are short, a
+ * client which cannot take them at once is dropped. */
+static void control_client_ready(int fd, uint32_t events)
+{
+	struct control_client *client;
+	char *reply = NULL, *start, *end;
+	size_t reply_len = 0;
+	FILE *out;
+	ssize_t rc;
+
+	if (!(client = control_find(fd)))
+		return;
+
+	rc = read(fd, client->line + client->line_len,
+			sizeof(client->line) - client->line_len - 1);
+
+	if (rc <= 0) {
+		if ((rc == -1) && (errno == EAGAIN))
+			return;
+		control_disconnect(client);
+		return;
+	}
+	client->line_len += rc;
+	client->line[client->line_len] = '\0';
+
+	if (!(out = open_memstream(&reply, &reply_len))) {
+		control_disconnect(client);
+		return;
+	}
+
+	for (start = client->line; (end = strchr(start, '\n')); start = end + 1) {
+		*end = '\0';
+		control_command(start, out);
+	}
+	fclose(out);
+
+	/* keep what is left of an unfinished line */
+	client->line_len -= start - client->line;
+	memmove(client->line, start, client->line_len);
+
+	if ((client->line_len == sizeof(client->line) - 1) ||
+			(write(fd, reply, reply_len) != (ssize_t)reply_len))
+		control_disconnect(client);
+
+	free(reply);
+}
+
+/* Event loop callback for the listening socket. */
+static void control_accept(int fd, uint32_t events)
+{
+	struct control_client *client;
+	int client_fd;
+
+	if ((client_fd = accept4(fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		return;
+
+	if (!(client = control_find(-1))) {
+		close(client_fd);
+		return;
+	}
+
+	client->fd = client_fd;
+
+	if (engine_add_fd(client_fd, EPOLLIN, control_client_ready) == -1) {
+		close(client_fd);
+		client->fd = -1;
+	}
+}
+
+/* Accept settings changes on the unix socket at path, served
+ * from the event loop. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int control_open(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int i, rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("Control socket path %s is too long.\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+			| SOCK_CLOEXEC, 0)) == -1) {
+		LOGE("Could not create the control socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* a socket left behind by an earlier run */
+	unlink(path);
+
+	/* anyone who can connect can retune the hardware, so the
+	 * socket is created private rather than made so after bind */
+	mask = umask(S_IRWXG | S_IRWXO);
+	rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+
+	if ((rc == -1) || (chmod(path, S_IRUSR | S_IWUSR) == -1) ||
+			(listen(listen_fd, CONTROL_MAX_CLIENTS) == -1) ||
+			(engine_add_fd(listen_fd, EPOLLIN, control_accept) == -1)) {
+		LOGE("Could not listen on %s: %s\n", path, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	strncpy(socket_path, path, MAX_BUF_SIZE - 1);
+	return 0;
+}
+
+/* Stop listening and remove the control socket. */
+void control_close(void)
+{
+	int i;
+
+	if (listen_fd == -1)
+		return;
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (clients[i].fd != -1)
+			control_disconnect(&clients[i]);
+	}
+
+	engine_remove_fd(listen_fd);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_path);
+}
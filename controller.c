@@ -0,0 +1,343 @@
+/**
+* controller.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <math.h>
+#include "cpu_throttle.h"
+
+struct fan_state fan_state;
+const struct controller * controller;
+
+/* Step the ceiling of policy by a quarter, half or full
+ * cpu_scaling_step depending on where the temperature sits
+ * relative to the hysteresis band and on its trend. */
+static void legacy_throttle_policy(struct cpu_policy *policy)
+{
+	int curr_temp = policy->control_temp;
+
+	if (curr_temp == -1) {
+		if (settings->verbose) {
+			LOGE("\t[policy%d] Could not read "
+				"cpu temperature.\n", policy->id);
+		}
+		return;
+	}
+
+	/*case 1: temp is in hysteresis range of target */
+	if ((curr_temp >= hysteresis_lower_limit)
+			&& (curr_temp <= hysteresis_upper_limit)) {
+
+		if (settings->verbose) {
+			LOGI("\t[policy%d] Current temperature is %dC.\n", policy->id, MC_TO_C(policy->curr_temp));
+		}
+
+		/*subcase 1: If temp is between lower and target temp */
+		if (curr_temp <= settings->cpu_target_temperature) {
+			/* adjust the processor speed by a quarter step */
+			increase_max_freq(policy, ceil((float)settings->cpu_scaling_step/4.0));
+		}
+		/*subcase 2: If temp is between target temp and upper range */
+		else {
+			/* update the hysteresis counter */
+			policy->intervals_in_hysteresis += 1;
+
+			/* check if we've reached the reset threshold */
+			if (policy->intervals_in_hysteresis == settings->hysteresis_reset_threshold) {
+
+				/* reset the hysteresis counter */
+				policy->intervals_in_hysteresis = 0;
+
+				/* reset the speed to the settings->cpu_max_freq */
+				increase_max_freq(policy, cpuinfo_max_freq);
+			}
+		}
+	}
+	/*case 2: temp is below the (lower) hysteresis range of target */
+	else if (curr_temp < hysteresis_lower_limit) {
+
+		/* reset hysteresis counter */
+		policy->intervals_in_hysteresis = 0;
+
+		/* increase the processor speed by half a step */
+		increase_max_freq(policy, ceil((float)settings->cpu_scaling_step/2.0));
+	}
+	/*case 3: temp is beyond the (upper) hysteresis range of target */
+	else {
+		/* reset hysteresis counter */
+		policy->intervals_in_hysteresis = 0;
+
+		/* check if the temperature has dropped significantly
+		 * since the last time we read the temps .*/
+		int temp_difference = policy->prev_temp - curr_temp;
+
+		/* if our temperature didn't change, decrease the core max frequency */
+		if (temp_difference == 0) {
+			/* adjust the processor speed by a quarter step */
+			decrease_max_freq(policy, ceil((float)settings->cpu_scaling_step/4.0));
+		}
+		/* if our current temp is lower than the previous one */
+		else if (temp_difference > 0) {
+			/* decrease the processor speed by half a step */
+			decrease_max_freq(policy, ceil((float)settings->cpu_scaling_step/2.0));
+		}
+		/* if our current temp is worse than the previous one */
+		else {
+			/* decrease the processor speed by a step */
+			decrease_max_freq(policy, settings->cpu_scaling_step);
+		}
+		policy->prev_temp = curr_temp;
+	}
+}
+
+/* Step the fan speed by a quarter, half or full fan_scaling_step
+ * in the same way as the cpu ceiling. */
+static void legacy_throttle_fan(struct fan_state *state)
+{
+	int curr_temp = state->control_temp;
+
+	if (curr_temp == -1) {
+		if (settings->verbose) {
+			LOGE("\tCould not read cpu die temperature.\n");
+		}
+		return;
+	}
+
+	/*case 1: temp is in hysteresis range of target */
+	if ((curr_temp >= hysteresis_lower_limit)
+			&& (curr_temp <= hysteresis_upper_limit)) {
+
+		/*subcase 1: If temp is between lower and target temp */
+		if (curr_temp <= settings->cpu_target_temperature) {
+			/* decrease the fan speed by a quarter step */
+			decrease_fan_speed(ceil((float)settings->fan_scaling_step/4.0));
+		}
+		/*subcase 2: If temp is between target temp and upper range */
+		else {
+			/* increase the fan speed by a quarter step */
+			increase_fan_speed(ceil((float)settings->fan_scaling_step/4.0));
+		}
+	}
+	/*case 2: temp is below the (lower) hysteresis range of target */
+	else if (curr_temp < hysteresis_lower_limit) {
+		/* decrease the fan speed by half a step */
+		decrease_fan_speed(ceil((float)settings->fan_scaling_step/2.0));
+	}
+	/*case 3: temp is beyond the (upper) hysteresis range of target */
+	else {
+		/* check if the temperature has dropped significantly
+		 * since the last time we read the temps .*/
+		int temp_difference = state->prev_temp - curr_temp;
+
+		/* if our temperature didn't change, move it a step */
+		if (temp_difference == 0) {
+			/* inrease the fan speed by a quarter step */
+			increase_fan_speed(ceil((float)settings->fan_scaling_step/4.0));
+		}
+		/* if our current temp is lower than the previous one */
+		else if (temp_difference > 0) {
+			/* increase the fan speed by half a step */
+			increase_fan_speed(ceil((float)settings->fan_scaling_step/2.0));
+		}
+		/* if our current temp is worse than the previous one */
+		else {
+			/* increase the fan speed by a step */
+			increase_fan_speed(settings->fan_scaling_step);
+		}
+		state->prev_temp = curr_temp;
+	}
+}
+
+/* Run one discrete PID step for a policy. The ceiling is pulled
+ * below cpu_max_freq by the proportional, integral and derivative
+ * terms of the distance above the target temperature. The
+ * derivative is taken on the measured temperature, so changing the
+ * target on reload does not kick the output. The gains are given
+ * for the widest frequency range and scaled to that of the policy. */
+static void pid_throttle_policy(struct cpu_policy *policy)
+{
+	double dt, error, rate = 0.0, integral, limit, correction;
+	int curr_temp = policy->control_temp;
+	int freq, max_freq = policy_max_freq(policy);
+
+	if (curr_temp == -1) {
+		if (settings->verbose) {
+			LOGE("\t[policy%d] Could not read "
+				"cpu temperature.\n", policy->id);
+		}
+		return;
+	}
+
+	if (settings->verbose) {
+		LOGI("\t[policy%d] Current temperature is %dC.\n", policy->id, MC_TO_C(policy->curr_temp));
+	}
+
+	/* work in seconds and degrees, the gains are in KHz */
+	dt = (double)tick_interval / 1000000.0;
+	error = (double)(curr_temp - settings->cpu_target_temperature) / 1000.0;
+
+	if (policy->pid_prev_temp != -1) {
+		rate = (double)(curr_temp - policy->pid_prev_temp) / 1000.0 / dt;
+	}
+	policy->pid_prev_temp = curr_temp;
+
+	integral = policy->pid_integral + (error * dt);
+
+	/* the integral term alone never needs to cover more
+	 * than the whole frequency range */
+	if (settings->pid_ki > 0) {
+		limit = (double)(settings->cpu_max_freq - cpuinfo_min_freq)
+			/ settings->pid_ki;
+
+		if (integral > limit)
+			integral = limit;
+		else if (integral < -limit)
+			integral = -limit;
+	}
+
+	correction = (settings->pid_kp * error) + (settings->pid_ki * integral)
+		+ (settings->pid_kd * rate);
+	freq = max_freq - policy_freq_step(policy, (int)correction);
+
+	/* anti-windup: stop integrating while the output is saturated
+	 * and the error would only drive it further into the limit */
+	if (((freq >= max_freq) && (error < 0)) ||
+			((freq <= policy->hw_min_freq) && (error > 0))) {
+		integral = policy->pid_integral;
+	}
+	policy->pid_integral = integral;
+
+	/* whole MHz only, so small corrections do not cause a write
+	 * every interval. set_max_freq clamps to the allowed range. */
+	set_max_freq(policy, MHZ_TO_KHZ(KHZ_TO_MHZ(freq)));
+}
+
+/* Find where temp sits relative to the hysteresis band.
+ *
+ * @return: an enum temp_band value. */
+int temperature_band(int temp)
+{
+	if (temp == -1)
+		return BAND_UNKNOWN;
+	if (temp < hysteresis_lower_limit)
+		return BAND_BELOW;
+	if (temp <= settings->cpu_target_temperature)
+		return BAND_LOWER;
+	if (temp <= hysteresis_upper_limit)
+		return BAND_UPPER;
+	return BAND_ABOVE;
+}
+
+/* Control laws which can be selected with --controller,
+ * indexed by enum controller_mode. */
+static const struct controller controllers[NUM_CONTROLLERS] = {
+	[CONTROLLER_LEGACY] = {
+		.name = "legacy",
+		.throttle_policy = legacy_throttle_policy,
+		.throttle_fan = legacy_throttle_fan,
+	},
+	[CONTROLLER_PID] = {
+		.name = "pid",
+		.throttle_policy = pid_throttle_policy,
+		/* the fan keeps the ladder, it has no frequency model */
+		.throttle_fan = legacy_throttle_fan,
+	},
+};
+
+/* Find the controller called name.
+ *
+ * @return: its enum controller_mode value, -1 if there is none. */
+int controller_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_CONTROLLERS; i++) {
+		if (!strcmp(controllers[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+/* Returns the name of controller mode, NULL if there is none. */
+const char *controller_name(int mode)
+{
+	if ((mode < 0) || (mode >= NUM_CONTROLLERS))
+		return NULL;
+
+	return controllers[mode].name;
+}
+
+/* Orders in which the cpu classes can be throttled,
+ * indexed by enum throttle_first. */
+static const char *const throttle_first_names[NUM_THROTTLE_FIRST] = {
+	[THROTTLE_FIRST_NONE] = "none",
+	[THROTTLE_FIRST_EFFICIENCY] = "e-cores",
+	[THROTTLE_FIRST_PERFORMANCE] = "p-cores",
+};
+
+/* Find the throttle_first policy called name.
+ *
+ * @return: its enum throttle_first value, -1 if there is none. */
+int throttle_first_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_THROTTLE_FIRST; i++) {
+		if (!strcmp(throttle_first_names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+/* Returns the name of throttle_first policy first, NULL if there is none. */
+const char *throttle_first_name(int first)
+{
+	if ((first < 0) || (first >= NUM_THROTTLE_FIRST))
+		return NULL;
+
+	return throttle_first_names[first];
+}
+
+/* Forget the control state carried between intervals for policy. */
+void controller_reset(struct cpu_policy *policy)
+{
+	policy->prev_temp = 0;
+	policy->intervals_in_hysteresis = 0;
+	policy->pid_integral = 0.0;
+	policy->pid_prev_temp = -1;
+}
+
+/* Make mode the controller used by the engine. The state of every
+ * policy is reset when the controller changes. */
+void controller_select(int mode)
+{
+	int i;
+
+	if ((mode < 0) || (mode >= NUM_CONTROLLERS))
+		mode = CONTROLLER_LEGACY;
+
+	if (controller == &controllers[mode])
+		return;
+
+	controller = &controllers[mode];
+
+	for (i = 0; i < num_policies; i++) {
+		controller_reset(&cpu_policies[i]);
+	}
+	memset(&fan_state, 0, sizeof(fan_state));
+}
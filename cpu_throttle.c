@@ -22,58 +22,43 @@
 
 int main(int argc, char *argv[])
 {
-	/* initialise the sigaction struct */
-	struct sigaction sa;
-
 	/* loop variables */
-	int i, rc;
+	int i;
 
-	/* Read sysfs interfaces and populate the throttle_settings
-	 * buffer with basic defaults. */
+	/* populate the throttle_settings buffer with basic defaults */
 	initialise_settings();
 
 	/* parse the command line */
 	parse_commmand_line(argc, argv);
 
-	/* initialise the sigaction struct */
-	sa.sa_handler = handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
-
-	/*define the pthreads array */
-	pthread_t pthreads_arr[settings.num_cores+1];
-
-	/* set up signal handlers */
-	if (sigaction(SIGINT, &sa, NULL) == -1) {
-		perror("sigaction");
-	}
-	if (sigaction(SIGTERM, &sa, NULL) == -1) {
-		perror("sigaction");
-	}
-	if (sigaction(SIGHUP, &sa, NULL) == -1) {
-		perror("sigaction");
-	}
-
 	/* print statements to stderr for now */
 	log_file = stderr;
 
 	if (write_config) {
 		/* write to configuration file if one was passed */
-		LOGI("Saving configuration...\n", getpid());
+		LOGI("Saving configuration...\n");
 		write_configuration_file();
 		return 0;
 	}
 	else {
 		/* read a configuration file if one was passed */
-		read_configuration_file();
+		read_configuration_file(settings);
 	}
 
+	/* find the hwmon devices and cpu scaling limits */
+	initialise_hardware();
+
 	/* validate the settings read */
 	validate_settings();
 
+	/* resolve and open the sysfs nodes used while throttling */
+	if (open_sysfs_nodes() == -1) {
+		LOGW("\tSome sysfs nodes could not be opened.\n");
+	}
+
 	/* open the log file */
-	if (settings.logging_enabled) {
-		if (!(log_file = fopen(settings.log_path, "a+"))) {
+	if (settings->logging_enabled) {
+		if (!(log_file = fopen(settings->log_path, "a+"))) {
 
 			perror("fopen");
 			fprintf(stderr, "Could not open log file\n");
@@ -83,111 +68,142 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	LOGI("Firing up...\n", getpid());
-	LOGI("\n",getpid());
+	/* hand logging over to the writer thread, so the control
+	 * loop never blocks on the log file */
+	if (log_start() == -1) {
+		LOGW("Logging synchronously.\n");
+	}
 
-	LOGI("\tFound cpu core temp hwmon node at %d.\n",
-			getpid(), sysfs_coretemp_hwmon_node);
+	LOGI("Firing up...\n");
+	LOGI("\n");
 
-	/* check if the sysfs fan control node exist */
-	if (sysfs_fanctrl_hwmon_subnode == -1) {
+	for (i = 0; i < num_temp_hwmons; i++) {
+		LOGI("\tFound %s hwmon device at %s.\n",
+				temp_hwmons[i].name, temp_hwmons[i].path);
+	}
+
+	/* check if the sysfs fan control nodes exist */
+	if (!num_fans) {
 		LOGW("\tCould not find fan control hwmon directory."
-				" Working without it.\n", getpid());
+				" Working without it.\n");
 	}
-	else {
-		LOGI("\tFound fan-control sysfs interface at node %d.\n",
-				getpid(), sysfs_fanctrl_hwmon_subnode);
+
+	for (i = 0; i < num_fans; i++) {
+		LOGI("\tFound %s fan control at %s/pwm%d.\n",
+				fans[i].hwmon.name, fans[i].hwmon.path,
+				fans[i].channel);
 	}
 
 	LOGI("\tSuccessfully read cpu scaling limits.\n"
-		"\t\t\tmax_freq:%dMHz min_freq:%dMHz\n", getpid(),
+		"\t\t\tmax_freq:%dMHz min_freq:%dMHz\n",
 			KHZ_TO_MHZ(cpuinfo_max_freq),
 			KHZ_TO_MHZ(cpuinfo_min_freq));
 
 	/* print some information about the values we set */
-	LOGI("\n",getpid());
+	LOGI("\n");
+
+	LOGI("\tSet polling interval to %dms.\n", US_TO_MS(settings->polling_interval));
+
+	LOGI("\tSet maximum scaling freq to %dMHz.\n", KHZ_TO_MHZ(settings->cpu_max_freq));
+
+	LOGI("\tSet cpu scaling step to %dMHz.\n", KHZ_TO_MHZ(settings->cpu_scaling_step));
 
-	LOGI("\tSet polling interval to %dms.\n",
-			getpid(), US_TO_MS(settings.polling_interval));
+	LOGI("\tSet cpu target temperature to %dC.\n", MC_TO_C(settings->cpu_target_temperature));
 
-	LOGI("\tSet maximum scaling freq to %dMHz.\n",
-			getpid(), KHZ_TO_MHZ(settings.cpu_max_freq));
+	LOGI("\tUsing the %s controller.\n", controller->name);
 
-	LOGI("\tSet cpu scaling step to %dMHz.\n",
-			getpid(), KHZ_TO_MHZ(settings.cpu_scaling_step));
+	if (settings->controller == CONTROLLER_PID) {
+		LOGI("\tSet pid gains to kp:%dMHz ki:%dMHz kd:%dMHz.\n", KHZ_TO_MHZ(settings->pid_kp),
+				KHZ_TO_MHZ(settings->pid_ki),
+				KHZ_TO_MHZ(settings->pid_kd));
+	}
 
-	LOGI("\tSet cpu target temperature to %dC.\n",
-			getpid(), MC_TO_C(settings.cpu_target_temperature));
+	LOGI("\tFound %d cpus covered by %d temperature sensors.\n", num_cpus, num_sensors);
 
-	LOGI("\tSet cpus to throttle to %d.\n", getpid(), settings.num_cores);
+	LOGI("\tGrouped them into %d cpufreq policies.\n", num_policies);
 
-	LOGI("\n",getpid());
+	LOGI("\n");
 
 	LOGI("\tSet hysteresis to %dC."
-			" Temp range: %dC <= %dC <= %dC \n",
-			getpid(), MC_TO_C(settings.hysteresis),
+			" Temp range: %dC <= %dC <= %dC \n", MC_TO_C(settings->hysteresis),
 			MC_TO_C(hysteresis_lower_limit),
-			MC_TO_C(settings.cpu_target_temperature),
+			MC_TO_C(settings->cpu_target_temperature),
 			MC_TO_C(hysteresis_upper_limit));
 
-	LOGI("\tSet hysteresis threshold to %d intervals.\n",
-			getpid(), settings.hysteresis_reset_threshold);
-
-	LOGI("\n",getpid());
-
-	if (sysfs_fanctrl_hwmon_subnode != -1) {
+	LOGI("\tSet hysteresis threshold to %d intervals.\n", settings->hysteresis_reset_threshold);
 
-		LOGI("\n",getpid());
+	LOGI("\n");
 
-		LOGI("\tSet fan scaling step to %d.\n",
-				getpid(), settings.fan_scaling_step);
+	if (num_fans) {
 
-		LOGI("\tSet fan minimum speed to %d.\n",
-				getpid(), settings.fan_min_speed);
+		LOGI("\n");
 
-		LOGI("\tSuccessfully read fan speed limits.\n"
-			"\t\tspeed_max: %d\t speed_min: %d\n", getpid(),
-				fan_hw_max_speed, fan_hw_min_speed);
-		LOGI("\n",getpid());
+		LOGI("\tSet fan scaling step to %d.\n", settings->fan_scaling_step);
 	}
 
-	/* start the scaling/throttling threads */
-	LOGI("Done reading/setting throttling parameters. "
-			"Starting throttling threads...\n", getpid());
+	for (i = 0; i < num_fans; i++) {
 
-	/* use a fixed memory area for the values
-	 * needed by pthread */
-	int core[settings.num_cores];
+		LOGI("\t[fan%d] Set fan minimum speed to %d.\n", i, fans[i].min_speed);
 
-	/* start the worker threads */
-	for (i = 0; i < settings.num_cores; i++) {
+		LOGI("\t[fan%d] Successfully read fan speed limits.\n"
+			"\t\tspeed_max: %d\t speed_min: %d\n", i,
+				fans[i].hw_max_speed, fans[i].hw_min_speed);
+		LOGI("\n");
+	}
+
+	if (settings->telemetry_path[0]) {
+		if (telemetry_open(settings->telemetry_path) == -1) {
+			LOGW("\tTelemetry is disabled.\n");
+		}
+		else {
+			LOGI("\tPublishing telemetry to %s.\n",
+					settings->telemetry_path);
+		}
+	}
 
-		LOGI("Starting thread for cpu%d...\n", getpid(), i);
+	/* set up the event loop */
+	if (engine_init() == -1) {
+		LOGE("Failed to set up the event loop.\n");
+		exit(EXIT_FAILURE);
+	}
 
-		core[i] = i;
+	if (settings->metrics_path[0]) {
+		if (metrics_open(settings->metrics_path) == -1) {
+			LOGW("\tMetrics are disabled.\n");
+		}
+		else {
+			LOGI("\tServing metrics on %s.\n", settings->metrics_path);
+		}
+	}
 
-		rc = pthread_create(&(pthreads_arr[i]),
-				NULL, cpu_worker, &(core[i]));
-		if (rc) {
-			LOGE("Failed to start thread for cpu%d...\n",
-				getpid(), core[i]);
-			exit(EXIT_FAILURE);
+	if (settings->control_path[0]) {
+		if (control_open(settings->control_path) == -1) {
+			LOGW("\tRuntime control is disabled.\n");
+		}
+		else {
+			LOGI("\tAccepting settings changes on %s.\n",
+					settings->control_path);
 		}
 	}
 
-	/* start the fan worker */
-	rc = pthread_create(&(pthreads_arr[i]), NULL, fan_worker, NULL);
-	if (rc) {
-		LOGE("Failed to start fan worker thread.\n", getpid());
+	if (settings->event_wakeups && (wakeup_open() <= 0)) {
+		LOGW("\tNo temperature alarms or trip points found, polling continuously.\n");
 	}
 
-	/* wait for the worker threads to finish */
-	for (i = 0; i <= settings.num_cores; i++) {
-		LOGI("[worker%d] Waiting for thread...\n", getpid(), i);
-		int rc = pthread_join(pthreads_arr[i], NULL);
-		if (rc) {
-			LOGE("[worker%d] Failed to join thread.\n", getpid(), i);
-		}
+	LOGI("Done reading/setting throttling parameters. "
+			"Starting throttling...\n");
+
+	/* run the control loop until we are told to stop */
+	if (engine_run() == -1) {
+		LOGE("Event loop failed.\n");
+		return EXIT_FAILURE;
 	}
+
+	wakeup_close();
+	control_close();
+	metrics_close();
+	telemetry_close();
+	close_sysfs_nodes();
+	log_stop();
 	return 0;
 }
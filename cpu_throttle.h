@@ -31,11 +31,109 @@
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
 #define MAX_BUF_SIZE 255
 #define MIN_BUF_SIZE 32
 
+/* enough room for a formatted int, sign and newline */
+#define INT_BUF_SIZE 16
+
+/* and for a formatted long long */
+#define INT64_BUF_SIZE 24
+
+/* upper bound on the number of logical cpus handled */
+#define MAX_CPUS 1024
+
+/* sysfs locations, relative to sysfs_root */
+#define HWMON_DIR "/sys/class/hwmon"
+#define CPU_DIR "/sys/devices/system/cpu"
+#define CPUFREQ_DIR CPU_DIR "/cpufreq"
+#define SCALING_DIR CPU_DIR "/cpu%d/cpufreq/%s"
+#define POLICY_DIR CPUFREQ_DIR "/policy%d/%s"
+#define POWERCAP_DIR "/sys/class/powercap"
+#define THERMAL_DIR "/sys/class/thermal"
+
+/* cpus of the efficiency cores of Intel hybrid parts, as
+ * listed by their own PMU */
+#define ATOM_CPUS_PATH "/sys/devices/cpu_atom/cpus"
+
+/* most packages whose power can be capped */
+#define RAPL_MAX_PACKAGES 64
+
+/* lowest power limit set, in percent of the original
+ * one, unless the firmware gives a minimum */
+#define RAPL_MIN_SHARE 25
+
+/* energy performance preferences a policy can be stepped
+ * through, starting with the one it had */
+#define EPP_MAX_GRADES 8
+
+/* most entries in the frequency table of a policy */
+#define PSTATE_MAX_FREQS 256
+
+/* frequency step of intel_pstate, which lists no table, in KHz,
+ * and the finest step derived from the range of a policy */
+#define INTEL_PSTATE_STEP MHZ_TO_KHZ(100)
+#define INTEL_PSTATE_MIN_STEP MHZ_TO_KHZ(25)
+
+/* intervals idle injection takes from none to max_state */
+#define IDLE_STEPS 10
+
+/* interval the timer is kept at while sleeping on alarms, in
+ * case one is missed, in uS */
+#define WAKEUP_BACKSTOP_INTERVAL MS_TO_US(10000)
+
+/* consecutive stable ticks after which an adaptive interval
+ * is doubled, and the rise in mC per second which brings it
+ * straight back to the polling interval */
+#define ADAPTIVE_STABLE_TICKS 10
+#define ADAPTIVE_RISE_RATE C_TO_MC(2)
+
+/* range of pwm values used by hwmon fan drivers */
+#define PWM_MIN 0
+#define PWM_MAX 255
+
+/* highest temp*_input index probed on a hwmon device */
+#define MAX_HWMON_INPUTS 64
+
+/* descriptors other modules can add to the event loop */
+#define ENGINE_MAX_SOURCES 16
+
+/* clients served at once by the metrics listener */
+#define METRICS_MAX_CLIENTS 8
+
+/* room for /proc/stat, about a hundred bytes per cpu */
+#define LOAD_BUF_SIZE (MAX_CPUS * 128)
+
+/* furthest ahead the temperature can be predicted, in intervals */
+#define PREDICT_MAX_HORIZON 100
+
+/* clients connected at once to the control socket */
+#define CONTROL_MAX_CLIENTS 4
+
+/* number of intervals after which actuator shadows
+ * are re-read from sysfs */
+#define ACTUATOR_RESYNC_INTERVAL 20
+
+/* identifies a telemetry file and its layout */
+#define TELEMETRY_MAGIC 0x54505443
+#define TELEMETRY_VERSION 1
+
+/* where telemetry readers look by default */
+#define TELEMETRY_PATH "/dev/shm/cpu_throttle"
+
+/* ticks kept in the telemetry ring */
+#define TELEMETRY_RECORDS 256
+
+/* identifies a binary configuration file and its layout */
+#define CONFIG_MAGIC 0x46435443
+#define CONFIG_VERSION 1
+
+/* largest configuration file read, in bytes */
+#define CONFIG_MAX_SIZE 65536
+
 #define C_TO_MC(x) (x*1000)
 #define MC_TO_C(x) (x/1000)
 #define MS_TO_US(x) (x*1000)
@@ -43,43 +141,563 @@
 #define MHZ_TO_KHZ(x) (x*1000)
 #define KHZ_TO_MHZ(x) (x/1000)
 
-#define LOGE(...) fprintf(log_file, "[%d] E: " __VA_ARGS__)
-#define LOGI(...) fprintf(log_file, "[%d] I: " __VA_ARGS__)
-#define LOGW(...) fprintf(log_file, "[%d] W: " __VA_ARGS__)
+/* size of a formatted log message, longer ones are cut short */
+#define LOG_MSG_SIZE 256
+
+/* messages buffered per thread, must be a power of two */
+#define LOG_RING_SIZE 256
+
+/* threads which can log through their own ring */
+#define LOG_MAX_THREADS 8
+
+/* messages a single call site may log per second */
+#define LOG_RATELIMIT_BURST 100
+
+/* Log a message at level, rate limited per call site. The
+ * message is queued for the writer thread once it is running. */
+#define LOG_AT(level, ...) do { \
+		static struct log_site log_site_; \
+		log_write(&log_site_, level, __VA_ARGS__); \
+	} while (0)
+
+#define LOGE(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOGI(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGW(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
 
 /* forward declaration of struct */
 struct throttle_settings;
 
+/* Severity of a log message, messages above
+ * settings.log_level are discarded. */
+enum log_level {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+};
+
+/* Rate limiting state of one logging call site. */
+struct log_site {
+	/* second of the current window on the monotonic clock */
+	long window;
+
+	/* messages logged and suppressed in the current window */
+	int count;
+	int suppressed;
+};
+
+/* A sysfs attribute which is kept open between accesses.
+ * Reads and writes go through pread/pwrite at offset 0, so
+ * no path formatting or stdio buffering happens per access. */
+struct sysfs_node {
+	/* path the node was resolved from, used to reopen it */
+	char path[MAX_BUF_SIZE];
+
+	/* open descriptor, or -1 if the node went stale */
+	int fd;
+
+	/* open(2) flags, O_RDONLY or O_RDWR */
+	int flags;
+};
+
+/* A writable sysfs node together with a shadow copy of the
+ * value it holds. Writes which would not change the value are
+ * skipped and the node is only re-read now and then. */
+struct actuator {
+	struct sysfs_node node;
+
+	/* last value written or read, -1 if unknown */
+	int value;
+
+	/* number of reads served from the shadow since
+	 * the value was last read from sysfs */
+	int intervals_since_sync;
+
+	/* nothing is written, the value is only kept in the shadow
+	 * for another actuator to apply, see rapl_apply */
+	int virtual;
+};
+
+/* The long term power limit of a package, through the powercap
+ * interface of the intel_rapl driver. Limits are kept as long long
+ * as firmware may report an unlimited one of several kW. */
+struct rapl_zone {
+	/* package the zone caps */
+	int package;
+
+	/* constraint_0_power_limit_uw, and the limit it was
+	 * last written or read with, in uW, -1 if unknown */
+	struct sysfs_node node;
+	long long limit;
+
+	/* limit found at startup, restored on exit and never
+	 * exceeded, and the lowest limit we set, in uW */
+	long long orig_limit;
+	long long min_limit;
+};
+
+/* A thermal cooling device which forces idle time onto the
+ * cpus, such as intel_powerclamp. */
+struct idle_device {
+	/* N of cooling_deviceN, and its type */
+	int index;
+	char type[MIN_BUF_SIZE];
+
+	/* cur_state, from 0 to max_state */
+	struct actuator state;
+	int max_state;
+
+	/* state found when it was opened, restored on exit
+	 * if the daemon wrote cur_state since */
+	int orig_state;
+	int written;
+};
+
+/* A hwmon temperature alarm the engine can sleep on. */
+struct wakeup_alarm {
+	/* tempN_max, and its value at startup */
+	struct actuator max;
+	int orig_max;
+
+	/* tempN_max_alarm, watched for notifications */
+	struct sysfs_node alarm;
+};
+
+/* A passive trip point of a thermal zone the engine can
+ * sleep on. Crossings are reported over netlink. */
+struct wakeup_trip {
+	/* N of thermal_zoneN */
+	int zone;
+
+	/* trip_point_M_temp, and its value at startup */
+	struct actuator temp;
+	int orig_temp;
+};
+
+/* The energy performance preference of a policy, stepped
+ * from the one found at startup towards "power". */
+struct epp_policy {
+	/* energy_performance_preference */
+	struct sysfs_node node;
+
+	/* preferences in order, the original one first */
+	char grades[EPP_MAX_GRADES][MIN_BUF_SIZE];
+	int num_grades;
+
+	/* index of the preference last written, -1 if unknown */
+	int grade;
+};
+
+/* What a known hwmon driver is used for */
+enum hwmon_type {
+	HWMON_CPU_TEMP,
+	HWMON_FAN,
+};
+
+/* A hwmon device found under the hwmon class directory. */
+struct hwmon_device {
+	/* path of the hwmonN directory */
+	char path[MAX_BUF_SIZE];
+
+	/* driver name, e.g. coretemp */
+	char name[MIN_BUF_SIZE];
+
+	/* N in hwmonN */
+	int index;
+};
+
+/* A temperature input of a hwmon device, either covering
+ * one physical core or a whole package. */
+struct temp_sensor {
+	struct sysfs_node node;
+
+	/* physical package the sensor belongs to */
+	int package;
+
+	/* physical core id, -1 for a package sensor */
+	int core_id;
+
+	/* temperature sampled this interval, -1 if unreadable */
+	int curr_temp;
+
+	/* Holt filter state: smoothed temperature in mC and its
+	 * rate of change in mC per interval. Only valid if filtered. */
+	double level;
+	double trend;
+	int filtered;
+
+	/* temperature expected predict_horizon intervals
+	 * ahead, -1 if unreadable */
+	int pred_temp;
+};
+
+/* Where a logical cpu sits and which sensor covers it. */
+struct cpu_info {
+	/* physical_package_id, -1 if the cpu is offline */
+	int package;
+
+	/* topology/core_id, shared by SMT siblings */
+	int core_id;
+
+	/* index into temp_sensors, -1 if none covers it */
+	int sensor;
+
+	/* busy and total time from /proc/stat at the last
+	 * sample, in USER_HZ */
+	unsigned long long busy_time;
+	unsigned long long total_time;
+
+	/* share of the last interval spent busy in percent,
+	 * -1 if not known */
+	int util;
+};
+
+/* A cpufreq policy: a group of cpus sharing one frequency
+ * ceiling, along with the control state carried between
+ * intervals. One decision is made per policy per interval. */
+struct cpu_policy {
+	/* N in cpufreq/policyN */
+	int id;
+
+	/* logical cpus sharing this policy */
+	int * cpus;
+	int num_cpus;
+
+	/* scaling_max_freq of the policy */
+	struct actuator max_freq;
+
+	/* backend the ceiling is applied through, one of
+	 * enum policy_owner. Unless it is scaling_max_freq, the
+	 * ceiling is only kept in max_freq as a shadow. */
+	int owner;
+
+	/* frequencies the policy can run at in KHz, ascending,
+	 * NULL if they are not known */
+	int * freqs;
+	int num_freqs;
+
+	/* cpuinfo_min_freq and cpuinfo_max_freq of the policy,
+	 * in KHz, which differ between cpu classes on hybrid parts */
+	int hw_min_freq;
+	int hw_max_freq;
+
+	/* cpu_capacity of its first cpu, -1 if not known, and the
+	 * class the policy belongs to, one of enum cpu_class */
+	int capacity;
+	int cpu_class;
+
+	/* temperature of the hottest member cpu this
+	 * interval, -1 if unreadable */
+	int curr_temp;
+
+	/* temperature the controller acts on: curr_temp, or the
+	 * hottest predicted one if prediction is enabled */
+	int control_temp;
+
+	/* utilisation of the busiest member cpu in percent,
+	 * -1 if not known */
+	int util;
+
+	/* temperature when we last throttled */
+	int prev_temp;
+
+	/* count the number of intervals spent in hysteresis */
+	int intervals_in_hysteresis;
+
+	/* change made to the ceiling this interval, in KHz */
+	int freq_step;
+
+	/* accumulated error of the pid controller, in degree-seconds */
+	double pid_integral;
+
+	/* temperature seen by the pid controller last interval,
+	 * -1 if there is none yet */
+	int pid_prev_temp;
+};
+
+/* A pwm fan channel of a hwmon device which we drive
+ * in manual mode while running. */
+struct fan_control {
+	/* hwmonN directory and driver name */
+	struct hwmon_device hwmon;
+
+	/* N in pwmN */
+	int channel;
+
+	/* pwmN and pwmN_enable */
+	struct actuator pwm;
+	struct sysfs_node pwm_enable;
+
+	/* pwmN_enable when we started, restored on exit */
+	int orig_enable;
+
+	/* speed range supported by the hardware */
+	int hw_min_speed;
+	int hw_max_speed;
+
+	/* minimum speed used when adjusting temperature,
+	 * settings.fan_min_speed clamped to the hardware range */
+	int min_speed;
+};
+
+/* Fan control state carried between intervals. */
+struct fan_state {
+	/* die temperature sampled this interval, -1 if unreadable */
+	int curr_temp;
+
+	/* temperature the controller acts on, see cpu_policy */
+	int control_temp;
+
+	/* die temperature when we last sped up the fan */
+	int prev_temp;
+};
+
+/* Backends the ceiling of a policy can be applied through */
+enum policy_owner {
+	POLICY_OWNER_SCALING,
+	POLICY_OWNER_RAPL,
+	POLICY_OWNER_EPP,
+};
+
+/* Kind of cores a policy covers on a hybrid part. Without
+ * a difference in capacity every policy is a performance one. */
+enum cpu_class {
+	CPU_CLASS_PERFORMANCE,
+	CPU_CLASS_EFFICIENCY,
+};
+
+/* Which cpu class is throttled first on hybrid parts. The other
+ * class keeps its ceiling until the preferred one is at its floor,
+ * and gets it back first. */
+enum throttle_first {
+	THROTTLE_FIRST_NONE,
+	THROTTLE_FIRST_EFFICIENCY,
+	THROTTLE_FIRST_PERFORMANCE,
+	NUM_THROTTLE_FIRST,
+};
+
+/* Control laws the engine can run with */
+enum controller_mode {
+	CONTROLLER_LEGACY,
+	CONTROLLER_PID,
+	NUM_CONTROLLERS,
+};
+
+/* A control law, deciding the speed ceiling of every policy
+ * and the fan speed from the temperatures sampled each interval. */
+struct controller {
+	/* name used to select it on the command line */
+	const char *name;
+
+	/* run one step for a policy, based on the hottest
+	 * member temperature sampled for this interval */
+	void (*throttle_policy)(struct cpu_policy *policy);
+
+	/* run one fan step, based on the die temperature
+	 * sampled into state for this interval */
+	void (*throttle_fan)(struct fan_state *state);
+};
+
+/* Where a temperature sits relative to the hysteresis band */
+enum temp_band {
+	BAND_UNKNOWN = -1,
+	BAND_BELOW,
+	BAND_LOWER,
+	BAND_UPPER,
+	BAND_ABOVE,
+};
+
+/* Start of the telemetry file. The records follow it. Every field
+ * is fixed width so readers built separately agree on the layout. */
+struct telemetry_header {
+	uint32_t magic;
+	uint32_t version;
+
+	/* size of a record including its arrays, and how
+	 * many records the ring holds */
+	uint32_t record_size;
+	uint32_t num_records;
+
+	/* length of the arrays in every record */
+	uint32_t num_sensors;
+	uint32_t num_policies;
+	uint32_t num_fans;
+	uint32_t polling_interval;
+
+	/* ticks published so far. The latest record is at
+	 * index (ticks - 1) % num_records. */
+	uint64_t ticks;
+};
+
+/* State of one policy in a telemetry record */
+struct telemetry_policy {
+	int32_t id;
+
+	/* hottest member temperature in mC, -1 if unreadable */
+	int32_t temp;
+
+	/* scaling_max_freq after this tick, in KHz */
+	int32_t max_freq;
+
+	/* enum temp_band of temp */
+	int32_t band;
+
+	/* change made to max_freq this tick, in KHz */
+	int32_t step;
+};
+
+/* One tick of telemetry. It is followed by num_sensors int32_t
+ * temperatures in mC, num_policies struct telemetry_policy and
+ * num_fans int32_t pwm values. The sequence number is odd while
+ * the record is being written, readers retry if it changed. */
+struct telemetry_record {
+	uint32_t seq;
+	uint32_t reserved;
+
+	/* tick number, starting at 1 */
+	uint64_t tick;
+
+	/* monotonic time of the tick, in nS */
+	int64_t time;
+};
+
+/* How a configuration file is written. Either is read. */
+enum config_format {
+	CONFIG_BINARY,
+	CONFIG_TEXT,
+};
+
+/* Header of a binary configuration file. It is followed by
+ * payload_size bytes of fields, each a struct config_field and
+ * its value. Integers are stored as int32_t, strings without
+ * their terminator. Fields with an unknown tag are skipped. */
+struct config_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t payload_size;
+
+	/* crc32 of the payload */
+	uint32_t checksum;
+};
+
+struct config_field {
+	uint16_t tag;
+	uint16_t length;
+};
+
+/* Kinds of value held by a setting */
+enum setting_type {
+	SETTING_INT,
+	SETTING_STRING,
+};
+
+/* A setting which can be saved, loaded and changed by name */
+struct setting_key {
+	/* tag in binary files, never reused once released */
+	int tag;
+
+	/* name in text files and on the control socket, the
+	 * same as the command line option */
+	const char *name;
+
+	int type;
+
+	/* where the value lives in struct throttle_settings */
+	size_t offset;
+
+	/* what the value given is multiplied by to get the stored
+	 * value, so keys use the same units as the command line */
+	int scale;
+
+	/* for settings holding an enum, converts names to values
+	 * and back. NULL for plain numbers. */
+	int (*lookup)(const char *name);
+	const char *(*name_of)(int value);
+
+	/* true if the setting can be changed while running */
+	int runtime;
+
+	/* true if -1 leaves the value to the hardware. It is
+	 * stored and shown as -1 whatever the scale. */
+	int unset;
+};
+
 /*==== GLOBALS ===== */
-FILE * log_file;
+extern FILE * log_file;
 
 /* termination signal */
-int termination_signaled;
+extern int termination_signaled;
 
-/* struct to store runtime settings */
-struct throttle_settings settings;
+/* current runtime settings. Once the loop runs the snapshot is
+ * never changed in place, publish_settings swaps in a new one. */
+extern struct throttle_settings * settings;
 
 /* config file */
-char * config_file_path;
-int write_config;
+extern char * config_file_path;
+extern int write_config;
 
-/* hwmon sysfs interface info */
-int sysfs_coretemp_hwmon_node;
-int sysfs_fanctrl_hwmon_node;
-int sysfs_fanctrl_hwmon_subnode;
+/* enum config_format used when writing the config file */
+extern int config_format;
+
+/* prefix prepended to every sysfs path, empty for the real tree */
+extern char sysfs_root[MAX_BUF_SIZE];
+
+/* read and write syscalls issued on sysfs nodes, for
+ * the simulator and the benchmarks */
+extern unsigned long sysfs_reads;
+extern unsigned long sysfs_writes;
+
+/* sysfs reads and writes which failed */
+extern unsigned long sysfs_read_errors;
+extern unsigned long sysfs_write_errors;
 
 /* values calculated from hysteresis range */
-int hysteresis_upper_limit;
-int hysteresis_lower_limit;
+extern int hysteresis_upper_limit;
+extern int hysteresis_lower_limit;
 
-/* fan speed information read from sysfs */
-int fan_hw_min_speed;
-int fan_hw_max_speed;
+/* time the current tick covers, in uS, as measured since the last
+ * one. It differs from the polling interval while the interval
+ * adapts, after missed intervals, or when the engine sleeps. */
+extern int tick_interval;
 
 /* CPU scaling frequency information read from sysfs.
  * These values are in KHz. */
-int cpuinfo_min_freq;
-int cpuinfo_max_freq;
+extern int cpuinfo_min_freq;
+extern int cpuinfo_max_freq;
+
+/* coretemp/k10temp devices, one per package */
+extern struct hwmon_device * temp_hwmons;
+extern int num_temp_hwmons;
+
+/* temperature sensors found at startup */
+extern struct temp_sensor * temp_sensors;
+extern int num_sensors;
+
+/* topology of every logical cpu, indexed by cpu number */
+extern struct cpu_info * cpu_topology;
+extern int num_cpus;
+
+/* cpufreq policies covering the online cpus */
+extern struct cpu_policy * cpu_policies;
+extern int num_policies;
+
+/* RAPL zones the ceilings of some packages are applied through */
+extern struct rapl_zone * rapl_zones;
+extern int num_rapl_zones;
+
+/* cooling devices idle time is injected through */
+extern struct idle_device * idle_devices;
+extern int num_idle_devices;
+
+/* fan control state */
+extern struct fan_state fan_state;
+
+/* control law selected by settings.controller */
+extern const struct controller * controller;
+
+/* fans driven by the daemon, one per fan control device */
+extern struct fan_control * fans;
+extern int num_fans;
 
 struct throttle_settings {
 	/* logging */
@@ -119,13 +737,109 @@ struct throttle_settings {
 	 *  again in uS */
 	int polling_interval;
 
-	/* the number of cores to scale. In most cases 1 is
-	 * sufficent since all cores are usually share
-	 *  frequency limits. */
+	/* No longer used, cpus are discovered at startup.
+	 * Kept so existing configuration files still load. */
 	int num_cores;
 
+	/* control law, one of enum controller_mode */
+	int controller;
+
+	/* pid gains, in KHz. The ceiling is lowered by pid_kp for
+	 * every degree above target, by pid_ki for every degree-second
+	 * accumulated above target and by pid_kd for every degree per
+	 * second the temperature is rising. */
+	int pid_kp;
+	int pid_ki;
+	int pid_kd;
+
+	/* most verbose enum log_level written to the log */
+	int log_level;
+
+	/* file the telemetry ring is mapped from,
+	 * telemetry is off if empty */
+	char telemetry_path[MAX_BUF_SIZE];
+
+	/* unix socket metrics are served on, off if empty */
+	char metrics_path[MAX_BUF_SIZE];
+
+	/* unix socket accepting settings changes, off if empty */
+	char control_path[MAX_BUF_SIZE];
+
+	/* act on the temperature expected this many intervals
+	 * ahead, from a Holt filter of every sensor. 0 disables
+	 * prediction. The filter weights the newest sample by
+	 * predict_alpha and the newest slope by predict_beta, in
+	 * percent. */
+	int predict_horizon;
+	int predict_alpha;
+	int predict_beta;
+
+	/* only move the ceiling of policies whose busiest cpu was
+	 * at least this busy last interval, in percent. Lowering an
+	 * idle ceiling sheds no heat, raising it gains nothing. 0
+	 * moves every ceiling. */
+	int load_threshold;
+
+	/* packages, in cpu list format, whose ceiling is applied
+	 * as a RAPL power limit instead of scaling_max_freq. Empty
+	 * if none. */
+	char rapl_packages[MAX_BUF_SIZE];
+
+	/* turn turbo off before cutting any ceiling, once the
+	 * temperature is turbo_off_offset above the target, and back
+	 * on once it is turbo_on_margin below the hysteresis band.
+	 * Both in mC. */
+	int turbo_gating;
+	int turbo_off_offset;
+	int turbo_on_margin;
+
+	/* apply ceilings through energy_performance_preference and
+	 * intel_pstate/max_perf_pct instead of scaling_max_freq, on
+	 * policies which have it */
+	int epp;
+
+	/* inject idle time through thermal cooling devices once
+	 * every ceiling is at cpuinfo_min_freq */
+	int idle_injection;
+
+	/* stop polling while cool and unthrottled, and sleep until
+	 * a temperature alarm or trip point fires */
+	int event_wakeups;
+
+	/* longest interval, in uS, the polling interval may be stretched
+	 * to while the temperature is stable, 0 to keep it fixed */
+	int max_polling_interval;
+
+	/* cpu class throttled first on hybrid parts, one of
+	 * enum throttle_first */
+	int throttle_first;
+
 };
 
+/* Format a message at level and queue it on the ring of the
+ * calling thread, or write it out directly if the writer thread
+ * is not running. Never blocks once the writer is running: a
+ * message is dropped and counted if the ring is full. */
+void log_write(struct log_site *site, int level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Find the log level called name.
+ *
+ * @return: its enum log_level value, -1 if there is none. */
+int log_level_lookup(const char *name);
+
+/* Returns the name of log level, NULL if there is none. */
+const char *log_level_name(int level);
+
+/* Start the writer thread draining the rings to log_file.
+ * The rings are flushed when the process exits.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int log_start(void);
+
+/* Stop the writer thread and write out whatever is queued. */
+void log_stop(void);
+
 /* Read the file at filename and returns the integer
  * value in the file.
  *
@@ -141,23 +855,290 @@ int read_integer(const char* filename);
  * @return: 0 if succesful, -1 otherwise. */
 int write_integer(const char* filename, int value);
 
-/* Reset the maximum frequency on cpu core to the
+/* Parse a decimal integer from the first len bytes of buf.
+ * Leading whitespace and a sign are accepted, parsing stops
+ * at the first non-digit character.
+ *
+ * @return: 0 if succesful, -1 if no digits were found. */
+int parse_integer(const char *buf, size_t len, int *value);
+
+/* As parse_integer, for values which may not fit in an int.
+ *
+ * @return: 0 if succesful, -1 if no digits were found. */
+int parse_integer64(const char *buf, size_t len, long long *value);
+
+/* Format value as a decimal string into buf, which must
+ * be at least INT_BUF_SIZE bytes long. No terminator is added.
+ *
+ * @return: the number of characters written. */
+int format_integer(char *buf, int value);
+
+/* Resolve the node at path and keep it open for later
+ * reads and writes. flags is O_RDONLY or O_RDWR.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_open(struct sysfs_node *node, const char *path, int flags);
+
+/* Read the integer value held by node. A descriptor that went
+ * stale (e.g. the cpu was hotplugged) is reopened once.
+ *
+ * @prereq: Assumes that integer is non-negative.
+ *
+ * @return: integer value read if succesful, -1 otherwise. */
+int sysfs_node_read(struct sysfs_node *node);
+
+/* Read up to len bytes held by node into buf as they are, for
+ * files holding more than one value.
+ *
+ * @return: the number of bytes read if succesful, -1 otherwise. */
+ssize_t sysfs_node_read_buf(struct sysfs_node *node, char *buf, size_t len);
+
+/* Read the integer value held by node, for values which
+ * may not fit in an int.
+ *
+ * @return: integer value read if succesful, -1 otherwise. */
+long long sysfs_node_read64(struct sysfs_node *node);
+
+/* Write value to node as a newline terminated string, not an
+ * integer. A descriptor that went stale is reopened once.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write(struct sysfs_node *node, int value);
+
+/* As sysfs_node_write, for values which may not fit in an int.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write64(struct sysfs_node *node, long long value);
+
+/* Write the string value to node, newline terminated.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write_str(struct sysfs_node *node, const char *value);
+
+/* Close the descriptor held by node. */
+void sysfs_node_close(struct sysfs_node *node);
+
+/* Open the node backing act and seed the shadow value from it.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int actuator_open(struct actuator *act, const char *path);
+
+/* Return the value last written to act. The shadow is re-read from
+ * sysfs every ACTUATOR_RESYNC_INTERVAL calls, or right away if it is
+ * not known, and anything written behind our back is adopted.
+ *
+ * @return: the current value if known, -1 otherwise. */
+int actuator_get(struct actuator *act);
+
+/* Write value to act unless the shadow says it is already set.
+ *
+ * @return: 0 if succesful or nothing had to be written, -1 otherwise. */
+int actuator_set(struct actuator *act, int value);
+
+/* Write value to act unconditionally and update the shadow.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int actuator_reset(struct actuator *act, int value);
+
+/* Parse a cpu list such as "0 1 2 3" (related_cpus) or
+ * "0-3,8-11" (cpulist format) into cpus, which has room
+ * for max_cpus entries.
+ *
+ * @return: the number of cpus parsed. */
+int parse_cpu_list(const char *buf, int *cpus, int max_cpus);
+
+/* Walk the hwmon class directory and match every device by its
+ * driver name. cpu temperature devices (coretemp, k10temp,
+ * zenpower) go to temp_hwmons, one per package on multi-socket
+ * systems, and the first pwm channel of every fan control device
+ * (nct6775, it87, asus_fan, thinkpad) goes to fans.
+ *
+ * @return: the number of devices used, -1 on error. */
+int discover_hwmons(void);
+
+/* Free the devices found by discover_hwmons. */
+void free_hwmons(void);
+
+/* Find the online cpus, their physical core and package, and
+ * the temperature sensor which covers each one. Every package
+ * gets the sensors of its own hwmon device.
+ *
+ * @return: the number of cpus found, -1 on error. */
+int discover_cpu_topology(void);
+
+/* Free the tables built by discover_cpu_topology. */
+void free_cpu_topology(void);
+
+/* Group the online cpus by the cpufreq policy they
+ * share, so each policy is written once per interval. Falls
+ * back to one policy per cpu if no policy directories exist.
+ *
+ * @return: the number of policies found, -1 on error. */
+int discover_cpu_policies(void);
+
+/* Free the policies found by discover_cpu_policies. */
+void free_cpu_policies(void);
+
+/* Open /proc/stat below sysfs_root for load_sample. Must be
+ * called after the topology and the policies are known.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int load_open(void);
+
+/* Work out how busy every cpu and policy was since the last
+ * sample from the time counters in /proc/stat. */
+void load_sample(void);
+
+/* Close the descriptor opened by load_open. */
+void load_close(void);
+
+/* Find the RAPL zone of every package in settings->rapl_packages
+ * and hand the ceilings of their policies over to it. The real
+ * scaling_max_freq of those policies is opened up to the maximum.
+ * Must be called after the policies are known.
+ *
+ * @return: the number of zones used, -1 on error. */
+int rapl_open(void);
+
+/* Turn the ceilings of the policies of every zone into a power
+ * limit. Called once per tick after the controller ran. */
+void rapl_apply(void);
+
+/* Write the power limits found at startup back. */
+void rapl_restore(void);
+
+/* Hand the ceilings of every policy with an energy performance
+ * preference, and not already under RAPL, over to it. Must be
+ * called after the policies are known.
+ *
+ * @return: the number of policies handed over, -1 on error. */
+int epp_open(void);
+
+/* Turn the ceilings of the policies handed over into a preference
+ * and a global performance limit. Called once per tick after the
+ * controller ran. */
+void epp_apply(void);
+
+/* Write the preferences and the performance limit found at
+ * startup back. */
+void epp_restore(void);
+
+/* Restore the preferences and close their nodes. */
+void epp_close(void);
+
+/* Returns the grade of policy, the index into its preferences
+ * written last, -1 if it is not steered through its preference. */
+int epp_grade(int policy);
+
+/* Find every thermal cooling device which injects idle time,
+ * by its type.
+ *
+ * @return: the number of devices found, -1 on error. */
+int idle_open(void);
+
+/* Inject more idle time while temp is above the hysteresis band and
+ * at_floor says every ceiling is already at its minimum, and take it
+ * back once temp is below the band. The devices are opened when the
+ * stage is turned on and handed back when it is turned off.
+ *
+ * @return: 1 if idle time is being injected, 0 otherwise. */
+int idle_update(int temp, int at_floor);
+
+/* Returns the highest idle injection state, in percent of
+ * max_state, -1 if there are no devices. */
+int idle_state(void);
+
+/* Write the states found when the devices were opened back,
+ * on the devices the daemon has written to. */
+void idle_restore(void);
+
+/* Restore every device and close its node. */
+void idle_close(void);
+
+/* Find the global turbo switch, intel_pstate's no_turbo or the
+ * boost attribute of acpi-cpufreq and amd-pstate.
+ *
+ * @return: 0 if succesful, -1 if there is none. */
+int turbo_open(void);
+
+/* Returns 1 if turbo is on, 0 if it is off, -1 if unknown. */
+int turbo_state(void);
+
+/* Returns true if turbo is off because the daemon turned it off. */
+int turbo_gated(void);
+
+/* Turn turbo off once temp passes turbo_off_offset above the target
+ * and back on once it is turbo_on_margin below the hysteresis band.
+ * Only turbo the daemon turned off is turned back on, right away
+ * if gating is turned off.
+ *
+ * @return: 1 if turbo was turned off this interval, 0 otherwise. */
+int turbo_update(int temp);
+
+/* Turn turbo back on if the daemon turned it off. */
+void turbo_restore(void);
+
+/* Restore turbo and close its node. */
+void turbo_close(void);
+
+/* Restore the power limits and close the zones. */
+void rapl_close(void);
+
+/* Format a path below sysfs_root into buf, so the daemon can
+ * be pointed at a copy of the sysfs tree.
+ *
+ * @return: the length of the path, as for snprintf. */
+int sysfs_path(char *buf, size_t size, const char *fmt, ...);
+
+/* Open the temperature, frequency and fan nodes used by the
+ * workers. Must be called after the settings are validated.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int open_sysfs_nodes(void);
+
+/* Close every node opened by open_sysfs_nodes. */
+void close_sysfs_nodes(void);
+
+/* Reset the maximum frequency of policy to the
  * maximum defined in sysfs
  *
  * @return: 0 if succesful, -1 otherwise. */
-int reset_max_freq(int core);
+int reset_max_freq(struct cpu_policy *policy);
 
-/* Decrease the maximum frequency on cpu core by step
+/* Returns the highest ceiling policy may be given, the configured
+ * maximum snapped down to its frequency table.
+ *
+ * @return: the ceiling in KHz. */
+int policy_max_freq(const struct cpu_policy *policy);
+
+/* Returns where freq sits in the frequency range of policy,
+ * from 0 at its minimum to 1 at its maximum. */
+double policy_freq_ratio(const struct cpu_policy *policy, int freq);
+
+/* Returns step, given for the widest frequency range of all the
+ * cpus, scaled to the frequency range of policy. */
+int policy_freq_step(const struct cpu_policy *policy, int step);
+
+/* Decrease the maximum frequency of policy by step, moving at least
+ * one entry down its frequency table if it has one.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int decrease_max_freq(int core, int step);
+int decrease_max_freq(struct cpu_policy *policy, int step);
 
-/* Increase the maximum frequency on cpu core by step
+/* Increase the maximum frequency of policy by step, moving at least
+ * one entry up its frequency table if it has one.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int increase_max_freq(int core, int step);
+int increase_max_freq(struct cpu_policy *policy, int step);
 
 
+/* Set the maximum frequency of policy to freq, clamped to
+ * the range between cpuinfo_min_freq and the configured maximum,
+ * and snapped to the nearest entry of its frequency table.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int set_max_freq(struct cpu_policy *policy, int freq);
+
 /* Reset the fan speed to the
  * (user defined) minimum fan speed.
  *
@@ -174,36 +1155,192 @@ int increase_fan_speed(int step);
  * @return: 0 if succesful, -1 otherwise. */
 int decrease_fan_speed(int step);
 
-/* Worker function which does the actual throttling.
- * Is intended to be run as a pthread. */
-void * cpu_worker(void* worker_num);
+/* Find the controller called name.
+ *
+ * @return: its enum controller_mode value, -1 if there is none. */
+int controller_lookup(const char *name);
+
+/* Returns the name of controller mode, NULL if there is none. */
+const char *controller_name(int mode);
+
+/* Find the throttle_first policy called name.
+ *
+ * @return: its enum throttle_first value, -1 if there is none. */
+int throttle_first_lookup(const char *name);
 
-/* Worker function which does the actual throttling.
- * Is intended to be run as a pthread. */
-void * fan_worker(void* worker_num);
+/* Returns the name of throttle_first policy first, NULL if there is none. */
+const char *throttle_first_name(int first);
+
+/* Find where temp sits relative to the hysteresis band.
+ *
+ * @return: an enum temp_band value. */
+int temperature_band(int temp);
+
+/* Forget the control state carried between intervals for policy. */
+void controller_reset(struct cpu_policy *policy);
+
+/* Make mode the controller used by the engine. The state of every
+ * policy is reset when the controller changes. */
+void controller_select(int mode);
+
+/* Create the telemetry file at path, sized for the sensors,
+ * policies and fans found, and map it.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int telemetry_open(const char *path);
+
+/* Publish the state of this tick into the next record of the
+ * ring. Does nothing if telemetry is not open. */
+void telemetry_publish(void);
+
+/* Unmap and remove the telemetry file. */
+void telemetry_close(void);
+
+/* Listen for metrics scrapes on the unix socket at path, served
+ * from the event loop. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int metrics_open(const char *path);
+
+/* Account for a tick which took elapsed nS. Does nothing
+ * if metrics are not being served. */
+void metrics_tick(long long elapsed);
+
+/* Stop listening and remove the socket. */
+void metrics_close(void);
+
+/* Accept settings changes on the unix socket at path, served
+ * from the event loop. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int control_open(const char *path);
+
+/* Stop listening and remove the control socket. */
+void control_close(void);
+
+/* Find the alarms and trip points the engine can sleep on, and
+ * subscribe to thermal events. Must be called after engine_init.
+ *
+ * @return: the number of alarms and trip points found. */
+int wakeup_open(void);
+
+/* Program every alarm and trip point at temp, in mC.
+ *
+ * @return: 0 if at least one is set and none has fired yet,
+ * -1 otherwise. */
+int wakeup_arm(int temp);
+
+/* Put every alarm and trip point back where it was found. */
+void wakeup_disarm(void);
+
+/* Disarm and close everything opened by wakeup_open. */
+void wakeup_close(void);
+
+/* Set up the control state, the interval timer and the
+ * signalfd used by the event loop. Signals handled by the
+ * loop are blocked in the calling thread.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_init(void);
+
+/* Forget the state carried from one tick to the next. */
+void engine_reset(void);
+
+/* Sample every sensor, then make all throttling
+ * decisions for this interval in one pass. */
+void engine_tick(void);
+
+/* Returns the interval until the next tick, in uS. */
+int engine_interval(void);
+
+/* Resume polling after sleeping on alarms, starting with a tick
+ * right away. Does nothing if the engine is not sleeping. */
+void engine_wake(void);
+
+/* Watch fd for events, calling callback from the loop whenever
+ * some are pending. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_add_fd(int fd, uint32_t events,
+		void (*callback)(int fd, uint32_t events));
+
+/* Change the events fd added with engine_add_fd is watched for.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_modify_fd(int fd, uint32_t events);
+
+/* Stop watching fd. The caller still owns and closes it. */
+void engine_remove_fd(int fd);
+
+/* Wait on the interval timer and signals, running a tick on
+ * every expiry, until a termination signal is received.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_run(void);
 
 /* Helper function to parse command line arguments from main */
 void parse_commmand_line(int argc, char *argv[]);
 
-/* Signal handler function to handle termination
- * signals and reset hardware settings to original. */
+/* Handle a termination or reload signal delivered through the
+ * event loop, resetting hardware settings to original on exit. */
 void handler(int signal);
 
-/* Read the configuration specified by the user.
+/* Read the configuration specified by the user into target.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int read_configuration_file();
+int read_configuration_file(struct throttle_settings *target);
 
 /* Write to the configuration specified by the user.
  *
  * @return: 0 if succesful, -1 otherwise. */
 int write_configuration_file();
 
+/* Returns the i-th setting key, NULL past the last one. */
+const struct setting_key *setting_key_at(int i);
+
+/* Returns the setting key called name, NULL if there is none. */
+const struct setting_key *setting_key_find(const char *name);
+
+/* Format the value of key in s into buf, in the units it is set in. */
+void setting_format(char *buf, size_t size,
+		const struct throttle_settings *s, const struct setting_key *key);
+
+/* Set key in s to the value given as text, in the units of
+ * the matching command line option.
+ *
+ * @return: 0 if succesful, -1 if the value is not valid. */
+int setting_parse(struct throttle_settings *s,
+		const struct setting_key *key, const char *text);
+
+/* Clamp the values in candidate to what the hardware and
+ * the controllers can work with. */
+void sanitise_settings(struct throttle_settings *candidate);
+
+/* Terminate the string fields of candidate, which may have been
+ * loaded from a raw dump. Needs no hardware information. */
+void terminate_settings(struct throttle_settings *candidate);
+
+/* Make a private copy of the current settings, to be
+ * changed and handed to publish_settings.
+ *
+ * @return: the copy, NULL if out of memory. */
+struct throttle_settings *copy_settings(void);
+
+/* Validate candidate and make it the current settings with a
+ * single pointer swap, so a tick never sees half an update. The
+ * state derived from the settings is recomputed straight after.
+ * Takes ownership of candidate. */
+void publish_settings(struct throttle_settings *candidate);
+
 /* Verifies taht settings input are valid */
 void validate_settings();
 
-/* Read sysfs interfaces and populate the
- * throttle_settings buffer with basic defaults. */
+/* Populate the throttle_settings buffer with basic defaults. */
 void initialise_settings();
 
+/* Find the hwmon devices and read the cpu scaling limits
+ * below sysfs_root. Must be called after the command line
+ * is parsed. */
+void initialise_hardware();
+
 #endif /* CPU_THROTTLE_H */
@@ -0,0 +1,734 @@
+/**
+* engine.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "cpu_throttle.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_USEC 1000LL
+
+int tick_interval;
+
+/* descriptors watched by the event loop */
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+
+/* interval the timer is currently armed with, in uS */
+static int armed_interval;
+
+/* true while polling is stopped and the engine sleeps on alarms */
+static int sleeping;
+
+/* hottest temperature acted on in the last tick, -1 if unknown */
+static int tick_temp = -1;
+
+/* interval stretched while the temperature is stable, in uS, 0
+ * until the first tick, and the stable ticks counted towards the
+ * next stretch */
+static int adaptive_interval;
+static int stable_ticks;
+
+/* start of the last tick run by the event loop, in nS, and the
+ * time measured since then for the next one, in uS, 0 if unknown */
+static long long last_tick;
+static int measured_interval;
+
+/* descriptors added by other modules, with their callbacks */
+static struct engine_source {
+	int fd;
+	void (*callback)(int fd, uint32_t events);
+} sources[ENGINE_MAX_SOURCES];
+
+/* Monotonic time in nS. */
+static long long engine_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * NSEC_PER_SEC) + now.tv_nsec;
+}
+
+/* Returns the interval until the next tick, in uS. */
+int engine_interval(void)
+{
+	if (sleeping)
+		return WAKEUP_BACKSTOP_INTERVAL;
+
+	/* a reload may have moved either bound */
+	if ((adaptive_interval < settings->polling_interval) ||
+			(settings->max_polling_interval <= settings->polling_interval))
+		return settings->polling_interval;
+
+	if (adaptive_interval > settings->max_polling_interval)
+		return settings->max_polling_interval;
+
+	return adaptive_interval;
+}
+
+/* Measure the time since the last tick run by the event loop,
+ * for the one about to run. It is longer than the armed interval
+ * after missed expirations or a sleep, and shorter right after the
+ * timer is re-armed. */
+static void engine_measure(void)
+{
+	long long now = engine_now();
+	long long elapsed = (now - last_tick) / NSEC_PER_USEC;
+
+	measured_interval = 0;
+	if ((last_tick > 0) && (elapsed > 0))
+		measured_interval = (elapsed > INT_MAX) ? INT_MAX : (int)elapsed;
+
+	last_tick = now;
+}
+
+/* Arm the timer to fire every polling interval, with the first
+ * expiry aligned to a multiple of the interval on the monotonic
+ * clock so ticks do not drift.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int engine_arm_timer(void)
+{
+	struct itimerspec spec;
+	struct timespec now;
+	long long interval, next;
+
+	interval = engine_interval() * NSEC_PER_USEC;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next = (now.tv_sec * NSEC_PER_SEC) + now.tv_nsec;
+	next = ((next / interval) + 1) * interval;
+
+	spec.it_value.tv_sec = next / NSEC_PER_SEC;
+	spec.it_value.tv_nsec = next % NSEC_PER_SEC;
+	spec.it_interval.tv_sec = interval / NSEC_PER_SEC;
+	spec.it_interval.tv_nsec = interval % NSEC_PER_SEC;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	armed_interval = engine_interval();
+	return 0;
+}
+
+/* Add fd to the epoll set, or change what it is watched for
+ * if op is EPOLL_CTL_MOD.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int engine_watch(int fd, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+/* Watch fd for events, calling callback from the loop whenever
+ * some are pending. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_add_fd(int fd, uint32_t events,
+		void (*callback)(int fd, uint32_t events))
+{
+	int i;
+
+	for (i = 0; i < ENGINE_MAX_SOURCES; i++) {
+		if (sources[i].callback)
+			continue;
+
+		if (engine_watch(fd, EPOLL_CTL_ADD, events) == -1)
+			return -1;
+
+		sources[i].fd = fd;
+		sources[i].callback = callback;
+		return 0;
+	}
+	LOGE("Too many descriptors in the event loop.\n");
+	return -1;
+}
+
+/* Change the events fd added with engine_add_fd is watched for.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_modify_fd(int fd, uint32_t events)
+{
+	return engine_watch(fd, EPOLL_CTL_MOD, events);
+}
+
+/* Stop watching fd. The caller still owns and closes it. */
+void engine_remove_fd(int fd)
+{
+	int i;
+
+	for (i = 0; i < ENGINE_MAX_SOURCES; i++) {
+		if (sources[i].callback && (sources[i].fd == fd)) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			sources[i].callback = NULL;
+			return;
+		}
+	}
+}
+
+/* Pass events on fd to the module which added it. */
+static void engine_dispatch(int fd, uint32_t events)
+{
+	int i;
+
+	for (i = 0; i < ENGINE_MAX_SOURCES; i++) {
+		if (sources[i].callback && (sources[i].fd == fd)) {
+			sources[i].callback(fd, events);
+			return;
+		}
+	}
+}
+
+/* Feed the temperature sampled this interval into the Holt filter
+ * of sensor and predict where it will be predict_horizon intervals
+ * ahead. The level follows the samples, the trend follows the change
+ * of the level, which rejects most of the one degree quantisation
+ * noise of the sensors. */
+static void engine_predict(struct temp_sensor *sensor)
+{
+	double alpha, beta, level;
+
+	if (sensor->curr_temp == -1) {
+		/* start over once the sensor is back */
+		sensor->filtered = 0;
+		sensor->pred_temp = -1;
+		return;
+	}
+
+	if (!sensor->filtered) {
+		sensor->level = sensor->curr_temp;
+		sensor->trend = 0.0;
+		sensor->filtered = 1;
+	}
+	else {
+		alpha = settings->predict_alpha / 100.0;
+		beta = settings->predict_beta / 100.0;
+
+		level = (alpha * sensor->curr_temp) +
+			((1.0 - alpha) * (sensor->level + sensor->trend));
+		sensor->trend = (beta * (level - sensor->level)) +
+			((1.0 - beta) * sensor->trend);
+		sensor->level = level;
+	}
+
+	sensor->pred_temp = (int)(sensor->level +
+			(settings->predict_horizon * sensor->trend));
+
+	/* a falling trend must not predict an unreadable sensor */
+	if (sensor->pred_temp < 0)
+		sensor->pred_temp = 0;
+}
+
+/* Forget the state carried from one tick to the next. */
+void engine_reset(void)
+{
+	memset(&fan_state, 0, sizeof(fan_state));
+	sleeping = 0;
+	tick_temp = -1;
+	adaptive_interval = 0;
+	stable_ticks = 0;
+	last_tick = 0;
+	measured_interval = 0;
+}
+
+/* Set up the control state, the interval timer and the
+ * signalfd used by the event loop. Signals handled by the
+ * loop are blocked in the calling thread.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_init(void)
+{
+	sigset_t mask;
+	int i;
+
+	engine_reset();
+
+	if (num_fans) {
+		/* enable manual fan control */
+		for (i = 0; i < num_fans; i++) {
+			sysfs_node_write(&fans[i].pwm_enable, 1);
+		}
+	}
+	else {
+		LOGW("\tNo fan control interface detetected. "
+			"Disabling fan control.\n");
+	}
+
+	/* route termination and reload signals through the loop */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		perror("sigprocmask");
+		return -1;
+	}
+
+	if ((signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+		perror("signalfd");
+		return -1;
+	}
+
+	if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	if ((engine_watch(signal_fd, EPOLL_CTL_ADD, EPOLLIN) == -1) ||
+			(engine_watch(timer_fd, EPOLL_CTL_ADD, EPOLLIN) == -1))
+		return -1;
+
+	return engine_arm_timer();
+}
+
+/* Returns true if policy is idle enough to leave its ceiling alone. */
+static int engine_policy_idle(struct cpu_policy *policy)
+{
+	return (settings->load_threshold > 0) && (policy->util != -1) &&
+		(policy->util < settings->load_threshold);
+}
+
+/* Returns true if the ceiling of every busy policy is already
+ * at its cpuinfo_min_freq, so only idle injection is left. */
+static int engine_at_floor(void)
+{
+	int i;
+
+	for (i = 0; i < num_policies; i++) {
+		if (!engine_policy_idle(&cpu_policies[i]) &&
+				(cpu_policies[i].max_freq.value > cpu_policies[i].hw_min_freq))
+			return 0;
+	}
+	return 1;
+}
+
+/* Find the cpu class throttled first this tick, and whether it
+ * may not be raised because a busy policy of the other class is
+ * still below its ceiling.
+ *
+ * @return: an enum cpu_class value, -1 if the classes are treated
+ * alike, as they are on parts with a single cpu class. */
+static int engine_class_holds(int *hold_raise)
+{
+	struct cpu_policy *policy;
+	int i, preferred, classes = 0;
+
+	*hold_raise = 0;
+
+	if (settings->throttle_first == THROTTLE_FIRST_NONE)
+		return -1;
+
+	preferred = (settings->throttle_first == THROTTLE_FIRST_EFFICIENCY) ?
+		CPU_CLASS_EFFICIENCY : CPU_CLASS_PERFORMANCE;
+
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+		classes |= 1 << policy->cpu_class;
+
+		if (engine_policy_idle(policy) || (policy->max_freq.value == -1))
+			continue;
+
+		if ((policy->cpu_class != preferred) &&
+				(policy->max_freq.value < policy_max_freq(policy)))
+			*hold_raise = 1;
+	}
+
+	if (classes != ((1 << CPU_CLASS_PERFORMANCE) | (1 << CPU_CLASS_EFFICIENCY))) {
+		*hold_raise = 0;
+		return -1;
+	}
+	return preferred;
+}
+
+/* Run the controller for policy, holding its ceiling where the
+ * other cpu class goes first. hold_cut is set while a policy of the
+ * preferred class was cut this tick, hold_raise as returned by
+ * engine_class_holds. A cut is never held once the policy is above
+ * the hysteresis band. The controller runs against the shadow, so
+ * its state keeps up, and only a move which is allowed is written. */
+static void engine_throttle_policy(struct cpu_policy *policy,
+		int preferred, int hold_cut, int hold_raise)
+{
+	int held_virtual, freq, new_freq;
+
+	hold_cut = hold_cut && (policy->cpu_class != preferred) &&
+		(temperature_band(policy->control_temp) != BAND_ABOVE);
+	hold_raise = hold_raise && (policy->cpu_class == preferred);
+
+	if ((!hold_cut && !hold_raise) || (policy->max_freq.value == -1)) {
+		controller->throttle_policy(policy);
+		return;
+	}
+
+	freq = policy->max_freq.value;
+	held_virtual = policy->max_freq.virtual;
+
+	policy->max_freq.virtual = 1;
+	controller->throttle_policy(policy);
+	new_freq = policy->max_freq.value;
+
+	policy->max_freq.virtual = held_virtual;
+	policy->max_freq.value = freq;
+
+	if (((new_freq < freq) && hold_cut) || ((new_freq > freq) && hold_raise)) {
+		if (settings->verbose) {
+			LOGI("\t[policy%d] Step held back, the %s go first.\n",
+					policy->id, throttle_first_name(settings->throttle_first));
+		}
+		return;
+	}
+	actuator_set(&policy->max_freq, new_freq);
+}
+
+/* Returns true if the hottest temperature temp is below the
+ * hysteresis band and nothing is left to undo, so there is no
+ * need to poll until it warms up again. */
+static int engine_quiet(int temp)
+{
+	int i;
+
+	if ((temp == -1) || (temp >= hysteresis_lower_limit))
+		return 0;
+
+	for (i = 0; i < num_policies; i++) {
+		if (cpu_policies[i].max_freq.value < policy_max_freq(&cpu_policies[i]))
+			return 0;
+	}
+
+	for (i = 0; i < num_fans; i++) {
+		if (fans[i].pwm.value > fans[i].min_speed)
+			return 0;
+	}
+
+	return (idle_state() <= 0) && !turbo_gated();
+}
+
+/* Adapt the interval to how the hottest temperature temp moves.
+ * Outside the hysteresis band, unless quiet below it, or when rising
+ * faster than ADAPTIVE_RISE_RATE, the engine goes straight back to
+ * the polling interval. After ADAPTIVE_STABLE_TICKS stable ticks
+ * the interval is doubled, up to max_polling_interval. */
+static void engine_adapt(int temp, int prev_temp)
+{
+	int interval = engine_interval();
+	double rate = 0.0;
+
+	if (settings->max_polling_interval <= settings->polling_interval) {
+		adaptive_interval = settings->polling_interval;
+		stable_ticks = 0;
+		return;
+	}
+
+	if ((temp != -1) && (prev_temp != -1))
+		rate = (temp - prev_temp) / ((double)tick_interval / 1000000.0);
+
+	if ((temp == -1) || (rate > ADAPTIVE_RISE_RATE) ||
+			(temp > hysteresis_upper_limit) ||
+			((temp < hysteresis_lower_limit) && !engine_quiet(temp))) {
+		if ((interval != settings->polling_interval) && settings->verbose) {
+			LOGI("\tPolling every %dms.\n", US_TO_MS(settings->polling_interval));
+		}
+		adaptive_interval = settings->polling_interval;
+		stable_ticks = 0;
+		return;
+	}
+
+	if ((++stable_ticks < ADAPTIVE_STABLE_TICKS) ||
+			(interval >= settings->max_polling_interval))
+		return;
+
+	adaptive_interval = interval * 2;
+	stable_ticks = 0;
+
+	if (settings->verbose) {
+		LOGI("\tPolling every %dms.\n", US_TO_MS(engine_interval()));
+	}
+}
+
+/* Sample every sensor, then make all throttling
+ * decisions for this interval in one pass. */
+void engine_tick(void)
+{
+	struct temp_sensor *sensor;
+	struct cpu_policy *policy;
+	int i, j, temp, freq, any_temp = -1, any_pred = -1, turbo_cut, idle_held;
+	int preferred, pass, hold_cut, hold_raise;
+	int predict = (settings->predict_horizon > 0);
+	int fan_enabled = (num_fans > 0);
+	long long start = engine_now();
+
+	/* the time since the last tick, as measured by the event
+	 * loop or otherwise as it was scheduled */
+	tick_interval = measured_interval ? measured_interval : engine_interval();
+	measured_interval = 0;
+
+	/* read all the temperatures first so every decision is based
+	 * on the same instant. SMT siblings share a sensor, so each
+	 * one is only read once. */
+	fan_state.curr_temp = -1;
+	fan_state.control_temp = -1;
+
+	for (i = 0; i < num_sensors; i++) {
+		sensor = &temp_sensors[i];
+		sensor->curr_temp = sysfs_node_read(&sensor->node);
+
+		/* keep the filters running even with prediction off,
+		 * so turning it on acts on a settled estimate */
+		engine_predict(sensor);
+		if (!predict)
+			sensor->pred_temp = sensor->curr_temp;
+
+		/* the fan follows the hottest package */
+		if (sensor->core_id == -1) {
+			if (sensor->curr_temp > fan_state.curr_temp)
+				fan_state.curr_temp = sensor->curr_temp;
+			if (sensor->pred_temp > fan_state.control_temp)
+				fan_state.control_temp = sensor->pred_temp;
+		}
+
+		if (sensor->curr_temp > any_temp)
+			any_temp = sensor->curr_temp;
+		if (sensor->pred_temp > any_pred)
+			any_pred = sensor->pred_temp;
+	}
+
+	/* no package sensors, use the hottest core */
+	if (fan_state.curr_temp == -1) {
+		fan_state.curr_temp = any_temp;
+		fan_state.control_temp = any_pred;
+	}
+
+	if (settings->load_threshold > 0)
+		load_sample();
+
+	/* turbo is the first stage, give turning it off an
+	 * interval to work before any ceiling is cut */
+	turbo_cut = turbo_update(any_pred);
+
+	/* idle injection is the last stage, above the frequency
+	 * floor, and is taken back before any ceiling is raised */
+	idle_held = idle_update(any_pred, engine_at_floor());
+
+	/* each policy follows its hottest member core */
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+		policy->curr_temp = -1;
+		policy->control_temp = -1;
+
+		for (j = 0; j < policy->num_cpus; j++) {
+			if ((temp = cpu_topology[policy->cpus[j]].sensor) == -1)
+				continue;
+
+			sensor = &temp_sensors[temp];
+			if (sensor->curr_temp > policy->curr_temp)
+				policy->curr_temp = sensor->curr_temp;
+			if (sensor->pred_temp > policy->control_temp)
+				policy->control_temp = sensor->pred_temp;
+		}
+	}
+
+	/* on hybrid parts one cpu class may go first. It runs in the
+	 * first pass, so the other class knows if it was cut. */
+	preferred = engine_class_holds(&hold_raise);
+	hold_cut = 0;
+
+	for (pass = 0; pass < 2; pass++) {
+
+		/* never hold a cut while it is too hot */
+		if (temperature_band(any_pred) == BAND_ABOVE)
+			hold_cut = 0;
+
+		for (i = 0; i < num_policies; i++) {
+			policy = &cpu_policies[i];
+
+			if (pass != (((preferred == -1) ||
+					(policy->cpu_class == preferred)) ? 0 : 1))
+				continue;
+
+			freq = policy->max_freq.value;
+
+			/* hold the ceilings while turbo going off takes effect
+			 * or idle time is injected, and leave idle ceilings
+			 * alone, the heat and the headroom both belong to the
+			 * busy policies */
+			if (turbo_cut || idle_held || engine_policy_idle(policy)) {
+				policy->freq_step = 0;
+				continue;
+			}
+
+			engine_throttle_policy(policy, preferred,
+					(pass == 1) && hold_cut, hold_raise);
+
+			/* remember what the controller decided, for telemetry */
+			policy->freq_step = ((freq == -1) || (policy->max_freq.value == -1))
+				? 0 : policy->max_freq.value - freq;
+
+			if (policy->freq_step < 0)
+				hold_cut = 1;
+		}
+	}
+
+	/* ceilings of packages under RAPL become power limits */
+	rapl_apply();
+
+	/* and those of HWP policies energy preferences */
+	epp_apply();
+
+	if (fan_enabled) {
+		controller->throttle_fan(&fan_state);
+	}
+
+	engine_adapt(any_pred, tick_temp);
+	tick_temp = any_pred;
+
+	telemetry_publish();
+	metrics_tick(engine_now() - start);
+}
+
+/* After a tick, stop polling and sleep on the alarms if the
+ * engine is quiet, or go back to polling if it no longer is. */
+static void engine_settle(void)
+{
+	int quiet = settings->event_wakeups && engine_quiet(tick_temp);
+
+	if (sleeping && !quiet) {
+		wakeup_disarm();
+		sleeping = 0;
+	}
+	else if (!sleeping && quiet) {
+		if (wakeup_arm(hysteresis_lower_limit) == -1) {
+			wakeup_disarm();
+			return;
+		}
+
+		if (settings->verbose) {
+			LOGI("\tSleeping until %dC.\n", MC_TO_C(hysteresis_lower_limit));
+		}
+		sleeping = 1;
+	}
+}
+
+/* Resume polling after sleeping on alarms, starting with a tick
+ * right away. Does nothing if the engine is not sleeping. */
+void engine_wake(void)
+{
+	int i;
+
+	if (!sleeping)
+		return;
+
+	wakeup_disarm();
+	sleeping = 0;
+
+	if (settings->verbose) {
+		LOGI("\tWoken up by a temperature alarm.\n");
+	}
+
+	/* nothing was controlled during the sleep, so neither the
+	 * rate nor the error accumulated over it mean anything */
+	for (i = 0; i < num_policies; i++) {
+		cpu_policies[i].pid_integral = 0.0;
+		cpu_policies[i].pid_prev_temp = -1;
+	}
+
+	engine_measure();
+	engine_tick();
+	engine_arm_timer();
+}
+
+/* Wait on the interval timer and signals, running a tick on
+ * every expiry, until a termination signal is received.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int engine_run(void)
+{
+	struct epoll_event events[ENGINE_MAX_SOURCES + 2];
+	struct signalfd_siginfo info;
+	uint64_t expirations;
+	int i, n;
+
+	while (!termination_signaled) {
+
+		n = epoll_wait(epoll_fd, events, ENGINE_MAX_SOURCES + 2, -1);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (i = 0; (i < n) && !termination_signaled; i++) {
+
+			if (events[i].data.fd == signal_fd) {
+				if (read(signal_fd, &info, sizeof(info))
+						!= sizeof(info))
+					continue;
+
+				handler(info.ssi_signo);
+			}
+			else if (events[i].data.fd == timer_fd) {
+				if (read(timer_fd, &expirations,
+						sizeof(expirations)) != sizeof(expirations))
+					continue;
+
+				if ((expirations > 1) && settings->verbose) {
+					LOGW("\tMissed %d interval(s).\n",
+							(int)(expirations - 1));
+				}
+
+				engine_measure();
+				engine_tick();
+				engine_settle();
+			}
+			else {
+				engine_dispatch(events[i].data.fd, events[i].events);
+			}
+		}
+
+		/* a reload or the control socket may have
+		 * changed the interval */
+		if (!termination_signaled &&
+				(armed_interval != engine_interval()))
+			engine_arm_timer();
+	}
+	return 0;
+}
@@ -0,0 +1,273 @@
+/**
+* epp.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Energy performance preference backend. With HWP the hardware
+ * picks frequencies itself and a clamped scaling_max_freq fights
+ * it. Instead, the ceiling the controller decides for a policy is
+ * kept in memory and turned into a graded response: first the
+ * energy_performance_preference of the policy is stepped from the
+ * one it had towards "power", then intel_pstate/max_perf_pct is
+ * lowered for the whole system if the driver has it. */
+
+#include <fcntl.h>
+#include "cpu_throttle.h"
+
+/* preference of every policy, indexed like cpu_policies. Policies
+ * which are not steered have no grades. */
+static struct epp_policy *epp_policies;
+static int num_epp_policies;
+
+/* intel_pstate/max_perf_pct, and its value at startup and lower
+ * bound, -1 if there is none */
+static struct actuator max_perf = { .node = { .fd = -1 }, .value = -1 };
+static int max_perf_orig = -1;
+static int min_perf = -1;
+
+/* Read the whole file at filename into buf, without the newline,
+ * quietly. Not counted as sysfs traffic, as the files may be missing.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int epp_read(const char *filename, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len <= 0)
+		return -1;
+
+	if (buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/* Build the grades of epp from the preference it has and the space
+ * separated list of available ones, which runs from "performance"
+ * to "power": the original preference, then every one listed after
+ * it, or every one below "performance" if it is not listed. */
+static void epp_grades(struct epp_policy *epp, const char *orig, char *available)
+{
+	char *token, *saveptr;
+
+	snprintf(epp->grades[0], MIN_BUF_SIZE, "%s", orig);
+	epp->num_grades = 1;
+
+	for (token = strtok_r(available, " ", &saveptr); token;
+			token = strtok_r(NULL, " ", &saveptr)) {
+
+		/* start over below the original preference */
+		if (!strcmp(token, orig)) {
+			epp->num_grades = 1;
+			continue;
+		}
+
+		if (!strcmp(token, "default") || !strcmp(token, "performance") ||
+				(epp->num_grades == EPP_MAX_GRADES))
+			continue;
+
+		snprintf(epp->grades[epp->num_grades++], MIN_BUF_SIZE, "%s", token);
+	}
+}
+
+/* Hand the ceilings of every policy with an energy performance
+ * preference, and not already under RAPL, over to it. Must be
+ * called after the policies are known.
+ *
+ * @return: the number of policies handed over, -1 on error. */
+int epp_open(void)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	char orig[MIN_BUF_SIZE], available[MAX_BUF_SIZE];
+	struct cpu_policy *policy;
+	struct epp_policy *epp;
+	int i, count = 0;
+
+	if (!(epp_policies = calloc(num_policies, sizeof(struct epp_policy))))
+		return -1;
+	num_epp_policies = num_policies;
+
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+		epp = &epp_policies[i];
+		epp->node.fd = -1;
+		epp->grade = -1;
+
+		/* RAPL already applies this ceiling */
+		if (policy->owner != POLICY_OWNER_SCALING)
+			continue;
+
+		sysfs_path(filename, sizeof(filename), POLICY_DIR, policy->id,
+				"energy_performance_available_preferences");
+		if (epp_read(filename, available, sizeof(available)) == -1)
+			continue;
+
+		sysfs_path(filename, sizeof(filename), POLICY_DIR, policy->id,
+				"energy_performance_preference");
+		if ((epp_read(filename, orig, sizeof(orig)) == -1) ||
+				(sysfs_node_open(&epp->node, filename, O_RDWR) == -1))
+			continue;
+
+		epp_grades(epp, orig, available);
+		epp->grade = 0;
+
+		actuator_reset(&policy->max_freq, policy->hw_max_freq);
+		policy->max_freq.virtual = 1;
+		policy->owner = POLICY_OWNER_EPP;
+		count++;
+	}
+
+	/* max_perf_pct limits every cpu, so it is only used if
+	 * every policy is steered through its preference */
+	sysfs_path(filename, sizeof(filename), CPU_DIR "/intel_pstate/max_perf_pct");
+	if ((count > 0) && (count < num_policies) && (access(filename, W_OK) == 0)) {
+		LOGW("\tNot every policy is steered through its energy preference, leaving max_perf_pct alone.\n");
+	}
+	else if ((count > 0) && (access(filename, W_OK) == 0) &&
+			(actuator_open(&max_perf, filename) == 0)) {
+		max_perf_orig = max_perf.value;
+
+		sysfs_path(filename, sizeof(filename),
+				CPU_DIR "/intel_pstate/min_perf_pct");
+		if (epp_read(filename, orig, sizeof(orig)) == 0)
+			min_perf = atoi(orig);
+		if ((min_perf <= 0) || (min_perf > max_perf_orig))
+			min_perf = max_perf_orig / 4;
+	}
+
+	return count;
+}
+
+/* Turn the ceilings of the policies handed over into a preference
+ * and a global performance limit. The position of a ceiling in the
+ * frequency range picks the grade. With max_perf_pct, which is only
+ * opened if every policy is handed over, the preferences take the
+ * upper half of the range and the performance limit the lower half,
+ * shared by every policy through the lowest ceiling. */
+void epp_apply(void)
+{
+	struct cpu_policy *policy;
+	struct epp_policy *epp;
+	double ratio, lowest = 1.0, split;
+	int i, grade, pct;
+
+	if (!num_epp_policies)
+		return;
+
+	split = (max_perf_orig != -1) ? 0.5 : 0.0;
+
+	for (i = 0; i < num_epp_policies; i++) {
+		policy = &cpu_policies[i];
+		epp = &epp_policies[i];
+
+		if ((policy->owner != POLICY_OWNER_EPP) || (epp->grade == -1))
+			continue;
+
+		ratio = policy_freq_ratio(policy, policy->max_freq.value);
+
+		if (ratio < lowest)
+			lowest = ratio;
+
+		/* the original preference at the top of the range,
+		 * the last one at the split */
+		grade = (ratio <= split) ? epp->num_grades - 1 :
+			(int)((1.0 - ratio) / (1.0 - split) * epp->num_grades);
+		if (grade >= epp->num_grades)
+			grade = epp->num_grades - 1;
+
+		if (grade == epp->grade)
+			continue;
+
+		if (settings->verbose) {
+			LOGI("\t[policy%d] Setting energy preference to %s.\n",
+					policy->id, epp->grades[grade]);
+		}
+
+		if (sysfs_node_write_str(&epp->node, epp->grades[grade]) == 0)
+			epp->grade = grade;
+	}
+
+	if (max_perf_orig == -1)
+		return;
+
+	/* below the split the limit falls towards min_perf */
+	pct = (lowest >= split) ? max_perf_orig : min_perf +
+		(int)((max_perf_orig - min_perf) * lowest / split);
+
+	if ((pct != max_perf.value) && settings->verbose) {
+		LOGI("\tSetting max_perf_pct to %d.\n", pct);
+	}
+	actuator_set(&max_perf, pct);
+}
+
+/* Returns the grade of policy, the index into its preferences
+ * written last, -1 if it is not steered through its preference. */
+int epp_grade(int policy)
+{
+	if ((policy < 0) || (policy >= num_epp_policies))
+		return -1;
+
+	return epp_policies[policy].grade;
+}
+
+/* Write the preferences and the performance limit found at
+ * startup back. */
+void epp_restore(void)
+{
+	struct epp_policy *epp;
+	int i;
+
+	for (i = 0; i < num_epp_policies; i++) {
+		epp = &epp_policies[i];
+
+		if ((epp->grade > 0) &&
+				(sysfs_node_write_str(&epp->node, epp->grades[0]) == 0))
+			epp->grade = 0;
+	}
+
+	if (max_perf_orig != -1)
+		actuator_set(&max_perf, max_perf_orig);
+}
+
+/* Restore the preferences and close their nodes. */
+void epp_close(void)
+{
+	int i;
+
+	epp_restore();
+
+	for (i = 0; i < num_epp_policies; i++) {
+		sysfs_node_close(&epp_policies[i].node);
+	}
+	free(epp_policies);
+	epp_policies = NULL;
+	num_epp_policies = 0;
+
+	sysfs_node_close(&max_perf.node);
+	max_perf.value = -1;
+	max_perf_orig = -1;
+	min_perf = -1;
+}
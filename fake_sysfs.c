@@ -0,0 +1,334 @@
+/**
+* fake_sysfs.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/* nftw needs the feature macros set by cpu_throttle.h */
+#include "fake_sysfs.h"
+#include <ftw.h>
+#include <stdarg.h>
+
+char fake_root[MAX_BUF_SIZE];
+int fake_num_cpus;
+struct fake_package * fake_packages;
+int fake_num_packages;
+char (*fake_policy_paths)[FAKE_PATH_SIZE];
+char (*fake_epp_paths)[FAKE_PATH_SIZE];
+int fake_num_policies;
+char fake_no_turbo_path[FAKE_PATH_SIZE];
+char fake_max_perf_path[FAKE_PATH_SIZE];
+char fake_idle_path[FAKE_PATH_SIZE];
+char fake_fan_path[FAKE_PATH_SIZE];
+int fake_hybrid;
+
+/* Write a formatted string to the file at fake_root/path,
+ * creating every directory on the way.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int fake_write(const char *path, const char *fmt, ...)
+{
+	char filename[FAKE_PATH_SIZE];
+	va_list args;
+	FILE *file;
+	char *slash;
+
+	snprintf(filename, sizeof(filename), "%s%s", fake_root, path);
+
+	/* create the parent directories */
+	for (slash = filename + strlen(fake_root) + 1;
+			(slash = strchr(slash, '/')); slash++) {
+		*slash = '\0';
+		mkdir(filename, 0755);
+		*slash = '/';
+	}
+
+	if (!(file = fopen(filename, "w"))) {
+		perror("fopen");
+		return -1;
+	}
+
+	va_start(args, fmt);
+	vfprintf(file, fmt, args);
+	va_end(args);
+
+	fclose(file);
+	return 0;
+}
+
+/* time every fake cpu spent busy and idle, in USER_HZ */
+static double fake_busy_time, fake_idle_time;
+
+/* Account seconds of time at load, from 0 to 1, to every cpu of
+ * the tree and rewrite /proc/stat with the new counters.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int fake_sysfs_load(double load, double seconds)
+{
+	char filename[FAKE_PATH_SIZE];
+	unsigned long long busy, idle;
+	FILE *file;
+	int cpu;
+
+	fake_busy_time += load * seconds * 100.0;
+	fake_idle_time += (1.0 - load) * seconds * 100.0;
+
+	busy = fake_busy_time;
+	idle = fake_idle_time;
+
+	snprintf(filename, sizeof(filename), "%s/proc/stat", fake_root);
+	if (!(file = fopen(filename, "w")))
+		return -1;
+
+	fprintf(file, "cpu  %llu 0 0 %llu 0 0 0 0 0 0\n",
+			busy * fake_num_cpus, idle * fake_num_cpus);
+	for (cpu = 0; cpu < fake_num_cpus; cpu++) {
+		fprintf(file, "cpu%d %llu 0 0 %llu 0 0 0 0 0 0\n", cpu, busy, idle);
+	}
+	fprintf(file, "intr 0\nctxt 0\n");
+
+	fclose(file);
+	return 0;
+}
+
+/* Returns the highest frequency of the cpus of package pkg, in KHz. */
+int fake_package_max_freq(int pkg)
+{
+	return (fake_hybrid && (pkg & 1)) ? FAKE_E_MAX_FREQ : FAKE_MAX_FREQ;
+}
+
+/* Pick the directory to create the tree in, preferring tmpfs. */
+static const char *fake_tmpdir(void)
+{
+	struct stat stat_buf;
+
+	if (getenv("TMPDIR"))
+		return getenv("TMPDIR");
+
+	if (stat("/dev/shm", &stat_buf) != -1)
+		return "/dev/shm";
+
+	return "/tmp";
+}
+
+/* Build a sysfs-shaped tree in a temporary directory, on tmpfs
+ * unless TMPDIR says otherwise, and point sysfs_root at it. The
+ * cpus are spread evenly over packages, each with a coretemp device
+ * and either one cpufreq policy or one per cpu, and a RAPL zone.
+ * An asus_fan device cools all of them.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int fake_sysfs_create(int cpus, int packages, int per_cpu_policies)
+{
+	char path[MAX_BUF_SIZE];
+	int cpus_per_package = cpus / packages;
+	int cpu, core, pkg, policy, rc = 0;
+
+	snprintf(fake_root, sizeof(fake_root), "%s/throttle_fake.XXXXXX",
+			fake_tmpdir());
+	if (!mkdtemp(fake_root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	strncpy(sysfs_root, fake_root, MAX_BUF_SIZE - 1);
+
+	fake_num_packages = packages;
+	fake_packages = calloc(packages, sizeof(struct fake_package));
+	fake_num_policies = per_cpu_policies ? cpus : packages;
+	fake_policy_paths = calloc(fake_num_policies, sizeof(*fake_policy_paths));
+	fake_epp_paths = calloc(fake_num_policies, sizeof(*fake_epp_paths));
+
+	if (!fake_packages || !fake_policy_paths || !fake_epp_paths)
+		return -1;
+
+	rc |= fake_write(CPU_DIR "/online", "0-%d\n", cpus - 1);
+
+	rc |= fake_write(CPU_DIR "/intel_pstate/no_turbo", "0\n");
+	snprintf(fake_no_turbo_path, sizeof(fake_no_turbo_path), "%s%s",
+			fake_root, CPU_DIR "/intel_pstate/no_turbo");
+
+	rc |= fake_write(CPU_DIR "/intel_pstate/min_perf_pct", "%d\n",
+			FAKE_MIN_PERF_PCT);
+	rc |= fake_write(CPU_DIR "/intel_pstate/max_perf_pct", "100\n");
+	snprintf(fake_max_perf_path, sizeof(fake_max_perf_path), "%s%s",
+			fake_root, CPU_DIR "/intel_pstate/max_perf_pct");
+
+	/* only the second cooling device injects idle time */
+	rc |= fake_write(THERMAL_DIR "/cooling_device0/type", "Processor\n");
+	rc |= fake_write(THERMAL_DIR "/cooling_device0/max_state", "3\n");
+	rc |= fake_write(THERMAL_DIR "/cooling_device0/cur_state", "0\n");
+
+	rc |= fake_write(THERMAL_DIR "/cooling_device1/type", "intel_powerclamp\n");
+	rc |= fake_write(THERMAL_DIR "/cooling_device1/max_state", "%d\n",
+			FAKE_IDLE_MAX_STATE);
+	rc |= fake_write(THERMAL_DIR "/cooling_device1/cur_state", "-1\n");
+	snprintf(fake_idle_path, sizeof(fake_idle_path), "%s%s",
+			fake_root, THERMAL_DIR "/cooling_device1/cur_state");
+
+	fake_num_cpus = cpus;
+	fake_busy_time = 0.0;
+	fake_idle_time = 0.0;
+	rc |= fake_write("/proc/stat", "");
+	rc |= fake_sysfs_load(0.0, 0.0);
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		pkg = cpu / cpus_per_package;
+
+		snprintf(path, sizeof(path), CPU_DIR "/cpu%d/topology/", cpu);
+		rc |= fake_write(strcat(path, "physical_package_id"), "%d\n", pkg);
+
+		snprintf(path, sizeof(path), CPU_DIR "/cpu%d/topology/", cpu);
+		rc |= fake_write(strcat(path, "core_id"), "%d\n",
+				cpu % cpus_per_package);
+
+		snprintf(path, sizeof(path), SCALING_DIR, cpu, "cpuinfo_min_freq");
+		rc |= fake_write(path, "%d\n", FAKE_MIN_FREQ);
+		snprintf(path, sizeof(path), SCALING_DIR, cpu, "cpuinfo_max_freq");
+		rc |= fake_write(path, "%d\n", fake_package_max_freq(pkg));
+
+		if (fake_hybrid) {
+			snprintf(path, sizeof(path), CPU_DIR "/cpu%d/cpu_capacity", cpu);
+			rc |= fake_write(path, "%d\n", (pkg & 1) ?
+					FAKE_E_CAPACITY : FAKE_P_CAPACITY);
+		}
+	}
+
+	/* policies are named after their first cpu */
+	for (policy = 0; policy < fake_num_policies; policy++) {
+		cpu = per_cpu_policies ? policy : policy * cpus_per_package;
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu, "related_cpus");
+		if (per_cpu_policies)
+			rc |= fake_write(path, "%d\n", cpu);
+		else
+			rc |= fake_write(path, "%d-%d\n", cpu,
+					cpu + cpus_per_package - 1);
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu, "cpuinfo_min_freq");
+		rc |= fake_write(path, "%d\n", FAKE_MIN_FREQ);
+		snprintf(path, sizeof(path), POLICY_DIR, cpu, "cpuinfo_max_freq");
+		rc |= fake_write(path, "%d\n",
+				fake_package_max_freq(cpu / cpus_per_package));
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu, "scaling_max_freq");
+		rc |= fake_write(path, "%d\n",
+				fake_package_max_freq(cpu / cpus_per_package));
+		snprintf(fake_policy_paths[policy], sizeof(fake_policy_paths[policy]),
+				"%s%s", fake_root, path);
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu, "scaling_driver");
+		rc |= fake_write(path, "intel_pstate\n");
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu,
+				"energy_performance_available_preferences");
+		rc |= fake_write(path, "default performance balance_performance "
+				"balance_power power \n");
+
+		snprintf(path, sizeof(path), POLICY_DIR, cpu,
+				"energy_performance_preference");
+		rc |= fake_write(path, "balance_performance\n");
+		snprintf(fake_epp_paths[policy], sizeof(fake_epp_paths[policy]),
+				"%s%s", fake_root, path);
+	}
+
+	for (pkg = 0; pkg < packages; pkg++) {
+		fake_packages[pkg].num_cores = cpus_per_package;
+		fake_packages[pkg].temp_paths = calloc(cpus_per_package + 1,
+				sizeof(*fake_packages[pkg].temp_paths));
+
+		if (!fake_packages[pkg].temp_paths)
+			return -1;
+
+		/* temp1 covers the package, temp2 onwards the cores */
+		snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/name", pkg);
+		rc |= fake_write(path, "coretemp\n");
+
+		for (core = 0; core <= cpus_per_package; core++) {
+			snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/temp%d_label",
+					pkg, core + 1);
+
+			if (core == 0)
+				rc |= fake_write(path, "Package id %d\n", pkg);
+			else
+				rc |= fake_write(path, "Core %d\n", core - 1);
+
+			snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/temp%d_input",
+					pkg, core + 1);
+			rc |= fake_write(path, "%d\n", C_TO_MC(25));
+			snprintf(fake_packages[pkg].temp_paths[core],
+					sizeof(fake_packages[pkg].temp_paths[core]),
+					"%s%s", fake_root, path);
+		}
+	}
+
+	for (pkg = 0; pkg < packages; pkg++) {
+		snprintf(path, sizeof(path), POWERCAP_DIR "/intel-rapl:%d/", pkg);
+		rc |= fake_write(strcat(path, "name"), "package-%d\n", pkg);
+
+		snprintf(path, sizeof(path), POWERCAP_DIR "/intel-rapl:%d/", pkg);
+		rc |= fake_write(strcat(path, "constraint_0_max_power_uw"),
+				"%d\n", FAKE_POWER_LIMIT);
+
+		snprintf(path, sizeof(path), POWERCAP_DIR "/intel-rapl:%d/", pkg);
+		rc |= fake_write(strcat(path, "constraint_0_power_limit_uw"),
+				"%d\n", FAKE_POWER_LIMIT);
+		snprintf(fake_packages[pkg].rapl_path,
+				sizeof(fake_packages[pkg].rapl_path), "%s%s", fake_root, path);
+	}
+
+	snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/", packages);
+	rc |= fake_write(strcat(path, "name"), "asus_fan\n");
+
+	snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/", packages);
+	rc |= fake_write(strcat(path, "pwm1_enable"), "2\n");
+
+	snprintf(path, sizeof(path), HWMON_DIR "/hwmon%d/", packages);
+	rc |= fake_write(strcat(path, "pwm1"), "%d\n", PWM_MIN);
+	snprintf(fake_fan_path, sizeof(fake_fan_path), "%s%s", fake_root, path);
+
+	return rc;
+}
+
+/* nftw callback removing every entry of the tree */
+static int fake_remove(const char *path, const struct stat *sb,
+		int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Remove the tree built by fake_sysfs_create. */
+void fake_sysfs_destroy(void)
+{
+	int i;
+
+	if (fake_root[0])
+		nftw(fake_root, fake_remove, 16, FTW_DEPTH | FTW_PHYS);
+	fake_root[0] = '\0';
+
+	for (i = 0; i < fake_num_packages; i++) {
+		free(fake_packages[i].temp_paths);
+	}
+	free(fake_packages);
+	free(fake_policy_paths);
+	free(fake_epp_paths);
+
+	fake_packages = NULL;
+	fake_policy_paths = NULL;
+	fake_epp_paths = NULL;
+	fake_num_packages = 0;
+	fake_num_policies = 0;
+}
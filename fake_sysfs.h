@@ -0,0 +1,123 @@
+/**
+* fake_sysfs.h
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef FAKE_SYSFS_H
+#define FAKE_SYSFS_H
+
+#include "cpu_throttle.h"
+
+/* frequency range of the fake cpus, in KHz */
+#define FAKE_MIN_FREQ 800000
+#define FAKE_MAX_FREQ 3000000
+
+/* highest frequency of the efficiency cores of a hybrid tree, in KHz */
+#define FAKE_E_MAX_FREQ 2000000
+
+/* cpu_capacity of the performance and efficiency cores of a hybrid tree */
+#define FAKE_P_CAPACITY 1024
+#define FAKE_E_CAPACITY 512
+
+/* highest frequency of the fake cpus with turbo off, in KHz */
+#define FAKE_BASE_FREQ 2200000
+
+/* lower bound of intel_pstate/max_perf_pct of the fake cpus */
+#define FAKE_MIN_PERF_PCT 27
+
+/* max_state of the fake intel_powerclamp device, the
+ * highest share of idle time it forces in percent */
+#define FAKE_IDLE_MAX_STATE 50
+
+/* power limit of every fake RAPL zone, in uW */
+#define FAKE_POWER_LIMIT 50000000
+
+/* room for a path below the temporary root */
+#define FAKE_PATH_SIZE (2 * MAX_BUF_SIZE)
+
+/* The files of a fake package which the harness drives. */
+struct fake_package {
+	/* temp*_input of the package, then of every core */
+	char (*temp_paths)[FAKE_PATH_SIZE];
+	int num_cores;
+
+	/* constraint_0_power_limit_uw of its RAPL zone */
+	char rapl_path[FAKE_PATH_SIZE];
+};
+
+/*==== GLOBALS ===== */
+
+/* temporary directory holding the tree */
+extern char fake_root[MAX_BUF_SIZE];
+
+/* cpus of the tree */
+extern int fake_num_cpus;
+
+/* packages of the tree */
+extern struct fake_package * fake_packages;
+extern int fake_num_packages;
+
+/* scaling_max_freq of every policy, in policy id order */
+extern char (*fake_policy_paths)[FAKE_PATH_SIZE];
+
+/* energy_performance_preference of every policy, in the same order */
+extern char (*fake_epp_paths)[FAKE_PATH_SIZE];
+extern int fake_num_policies;
+
+/* intel_pstate/no_turbo */
+extern char fake_no_turbo_path[FAKE_PATH_SIZE];
+
+/* intel_pstate/max_perf_pct */
+extern char fake_max_perf_path[FAKE_PATH_SIZE];
+
+/* cur_state of the intel_powerclamp cooling device */
+extern char fake_idle_path[FAKE_PATH_SIZE];
+
+/* pwm node of the fan */
+extern char fake_fan_path[FAKE_PATH_SIZE];
+
+/* set before fake_sysfs_create to make every odd package
+ * one of efficiency cores */
+extern int fake_hybrid;
+
+/* Returns the highest frequency of the cpus of package pkg, in KHz. */
+int fake_package_max_freq(int pkg);
+
+/* Build a sysfs-shaped tree in a temporary directory, on tmpfs
+ * unless TMPDIR says otherwise, and point sysfs_root at it. The
+ * cpus are spread evenly over packages, each with a coretemp device
+ * and either one cpufreq policy or one per cpu, and a RAPL zone.
+ * The policies run intel_pstate with HWP, so they have an energy
+ * performance preference and move in steps of 100MHz. There are a processor cooling device and
+ * an intel_powerclamp one.
+ * An asus_fan device cools all of them. With fake_hybrid set, the
+ * cpus have a cpu_capacity and the odd packages a lower maximum.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int fake_sysfs_create(int cpus, int packages, int per_cpu_policies);
+
+/* Account seconds of time at load, from 0 to 1, to every cpu of
+ * the tree and rewrite /proc/stat with the new counters.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int fake_sysfs_load(double load, double seconds);
+
+/* Remove the tree built by fake_sysfs_create. */
+void fake_sysfs_destroy(void);
+
+#endif /* FAKE_SYSFS_H */
@@ -0,0 +1,279 @@
+/**
+* idle.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Idle injection, the last stage of throttling. Once every busy
+ * policy is pinned at cpuinfo_min_freq and the temperature is still
+ * above the hysteresis band, idle time is forced onto the cpus
+ * through thermal cooling devices such as intel_powerclamp. It is
+ * taken back before any ceiling is raised again. */
+
+#include <fcntl.h>
+#include <dirent.h>
+#include "cpu_throttle.h"
+
+struct idle_device * idle_devices;
+int num_idle_devices;
+
+/* cooling device types which inject idle time. Names ending
+ * in '-' match every device of that family. */
+static const char *idle_types[] = {
+	"intel_powerclamp",
+	"thermal-idle-",
+};
+
+/* whether the cooling devices were looked for since the
+ * stage was last turned on */
+static int idle_opened;
+
+/* Returns true if the cooling device type injects idle time. */
+static int idle_type_known(const char *type)
+{
+	size_t i, len;
+
+	for (i = 0; i < sizeof(idle_types) / sizeof(idle_types[0]); i++) {
+		len = strlen(idle_types[i]);
+
+		if ((idle_types[i][len - 1] == '-') ?
+				!strncmp(type, idle_types[i], len) :
+				!strcmp(type, idle_types[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Read the file at filename into buf, without the newline, quietly.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int idle_read(const char *filename, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len <= 0)
+		return -1;
+
+	if (buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/* Open the cooling device with index, of type.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int idle_add_device(int index, const char *type)
+{
+	char filename[MAX_BUF_SIZE], buf[MIN_BUF_SIZE];
+	struct idle_device *device;
+
+	device = realloc(idle_devices, (num_idle_devices + 1) * sizeof(struct idle_device));
+	if (!device)
+		return -1;
+
+	idle_devices = device;
+	device = &idle_devices[num_idle_devices];
+	device->index = index;
+	snprintf(device->type, sizeof(device->type), "%s", type);
+
+	sysfs_path(filename, sizeof(filename), THERMAL_DIR "/cooling_device%d/max_state", index);
+	if ((idle_read(filename, buf, sizeof(buf)) == -1) ||
+			((device->max_state = atoi(buf)) <= 0))
+		return -1;
+
+	sysfs_path(filename, sizeof(filename), THERMAL_DIR "/cooling_device%d/cur_state", index);
+	if (actuator_open(&device->state, filename) == -1) {
+		if (device->state.node.fd == -1)
+			return -1;
+
+		/* intel_powerclamp reads -1 while it is not injecting */
+		device->state.value = 0;
+	}
+	device->orig_state = device->state.value;
+	device->written = 0;
+
+	num_idle_devices++;
+	return 0;
+}
+
+/* Find every thermal cooling device which injects idle time,
+ * by its type.
+ *
+ * @return: the number of devices found, -1 on error. */
+int idle_open(void)
+{
+	char dirname[MAX_BUF_SIZE], path[MAX_BUF_SIZE];
+	char type[MIN_BUF_SIZE];
+	struct dirent *entry;
+	int index, end;
+	DIR *dir;
+
+	idle_opened = 1;
+
+	sysfs_path(dirname, sizeof(dirname), THERMAL_DIR);
+	if (!(dir = opendir(dirname)))
+		return -1;
+
+	while ((entry = readdir(dir))) {
+		if ((sscanf(entry->d_name, "cooling_device%d%n", &index, &end) != 1) ||
+				entry->d_name[end])
+			continue;
+
+		sysfs_path(path, sizeof(path), THERMAL_DIR "/cooling_device%d/type", index);
+		if ((idle_read(path, type, sizeof(type)) == -1) ||
+				!idle_type_known(type))
+			continue;
+
+		if (idle_add_device(index, type) == -1) {
+			LOGW("\tCould not use cooling device %d (%s).\n", index, type);
+			continue;
+		}
+	}
+	closedir(dir);
+
+	return num_idle_devices;
+}
+
+/* Move every device by steps of IDLE_STEPS towards its max_state,
+ * or back towards 0 if steps is negative. */
+static void idle_step(int steps)
+{
+	struct idle_device *device;
+	int i, step, state;
+
+	for (i = 0; i < num_idle_devices; i++) {
+		device = &idle_devices[i];
+
+		if ((state = actuator_get(&device->state)) == -1)
+			continue;
+
+		if ((step = device->max_state / IDLE_STEPS) < 1)
+			step = 1;
+
+		state += steps * step;
+		if (state > device->max_state)
+			state = device->max_state;
+		else if (state < 0)
+			state = 0;
+
+		if (state == device->state.value)
+			continue;
+
+		if (settings->verbose) {
+			LOGI("\t[cooling_device%d] Setting idle injection to %d of %d.\n",
+					device->index, state, device->max_state);
+		}
+		actuator_set(&device->state, state);
+		device->written = 1;
+	}
+}
+
+/* Inject more idle time while temp is above the hysteresis band and
+ * at_floor says every ceiling is already at its minimum, and take it
+ * back once temp is below the band.
+ *
+ * @return: 1 if idle time is being injected, 0 otherwise. */
+int idle_update(int temp, int at_floor)
+{
+	int i;
+
+	/* hand the devices back once if the stage was turned off,
+	 * they belong to the kernel and thermald again */
+	if (!settings->idle_injection) {
+		if (idle_opened)
+			idle_close();
+		return 0;
+	}
+
+	/* look for the devices once it is turned on */
+	if (!idle_opened && (idle_open() <= 0)) {
+		LOGW("\tNo idle injection cooling device found, idle injection is disabled.\n");
+	}
+
+	if (!num_idle_devices)
+		return 0;
+
+	if (temp != -1) {
+		if (at_floor && (temp > hysteresis_upper_limit))
+			idle_step(1);
+		else if (temp < hysteresis_lower_limit)
+			idle_step(-1);
+	}
+
+	for (i = 0; i < num_idle_devices; i++) {
+		if (idle_devices[i].state.value > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns the highest idle injection state, in percent of
+ * max_state, -1 if there are no devices. */
+int idle_state(void)
+{
+	int i, state = -1, percent;
+
+	for (i = 0; i < num_idle_devices; i++) {
+		if (idle_devices[i].state.value == -1)
+			continue;
+
+		percent = idle_devices[i].state.value * 100 / idle_devices[i].max_state;
+		if (percent > state)
+			state = percent;
+	}
+	return state;
+}
+
+/* Write the states found when the devices were opened back,
+ * on the devices the daemon has written to. */
+void idle_restore(void)
+{
+	int i;
+
+	for (i = 0; i < num_idle_devices; i++) {
+		if (!idle_devices[i].written || (idle_devices[i].orig_state == -1))
+			continue;
+
+		actuator_set(&idle_devices[i].state, idle_devices[i].orig_state);
+		idle_devices[i].written = 0;
+	}
+}
+
+/* Restore every device and close its node. */
+void idle_close(void)
+{
+	int i;
+
+	idle_restore();
+
+	for (i = 0; i < num_idle_devices; i++) {
+		sysfs_node_close(&idle_devices[i].state.node);
+	}
+	free(idle_devices);
+	idle_devices = NULL;
+	num_idle_devices = 0;
+	idle_opened = 0;
+}
@@ -0,0 +1,150 @@
+/**
+* load.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#include <fcntl.h>
+#include "cpu_throttle.h"
+
+/* /proc/stat, kept open between samples */
+static struct sysfs_node stat_node = { .fd = -1 };
+
+/* the file is read here whole every sample, it is too
+ * large for the stack with many cpus */
+static char stat_buf[LOAD_BUF_SIZE];
+
+/* Parse the unsigned decimal at *pos, skipping leading blanks,
+ * and move *pos past it. Stops at end.
+ *
+ * @return: the value, 0 if there are no digits. */
+static unsigned long long load_parse(const char **pos, const char *end)
+{
+	unsigned long long value = 0;
+	const char *p = *pos;
+
+	while ((p < end) && (*p == ' '))
+		p++;
+
+	for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+		value = (value * 10) + (*p - '0');
+
+	*pos = p;
+	return value;
+}
+
+/* Open /proc/stat below sysfs_root for load_sample. Must be
+ * called after the topology and the policies are known.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int load_open(void)
+{
+	char filename[MAX_BUF_SIZE];
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		cpu_topology[i].busy_time = 0;
+		cpu_topology[i].total_time = 0;
+		cpu_topology[i].util = -1;
+	}
+
+	for (i = 0; i < num_policies; i++) {
+		cpu_policies[i].util = -1;
+	}
+
+	/* missing from copies of the sysfs tree, the
+	 * caller decides whether that matters */
+	sysfs_path(filename, sizeof(filename), "/proc/stat");
+	if (access(filename, R_OK) == -1)
+		return -1;
+
+	return sysfs_node_open(&stat_node, filename, O_RDONLY);
+}
+
+/* Work out how busy every cpu and policy was since the last
+ * sample from the time counters in /proc/stat. Parses the file in
+ * place without allocating. */
+void load_sample(void)
+{
+	unsigned long long field[8], busy, total;
+	const char *pos, *end, *line_end;
+	struct cpu_policy *policy;
+	struct cpu_info *info;
+	ssize_t len;
+	int i, j, cpu;
+
+	if ((len = sysfs_node_read_buf(&stat_node, stat_buf,
+			sizeof(stat_buf))) == -1)
+		return;
+
+	end = stat_buf + len;
+
+	for (pos = stat_buf; pos < end; pos = line_end + 1) {
+		if (!(line_end = memchr(pos, '\n', end - pos)))
+			line_end = end;
+
+		/* only the per cpu lines, "cpuN user nice system idle
+		 * iowait irq softirq steal ...", they come first */
+		if ((line_end - pos < 4) || memcmp(pos, "cpu", 3))
+			break;
+		if ((pos[3] < '0') || (pos[3] > '9'))
+			continue;
+
+		pos += 3;
+		cpu = load_parse(&pos, line_end);
+
+		for (i = 0; i < 8; i++) {
+			field[i] = load_parse(&pos, line_end);
+		}
+
+		if (cpu >= num_cpus)
+			continue;
+
+		/* guest time is already counted in user */
+		busy = field[0] + field[1] + field[2] + field[5]
+			+ field[6] + field[7];
+		total = busy + field[3] + field[4];
+
+		info = &cpu_topology[cpu];
+
+		if (info->total_time && (total > info->total_time) &&
+				(busy >= info->busy_time)) {
+			info->util = (int)((100 * (busy - info->busy_time))
+					/ (total - info->total_time));
+		}
+		info->busy_time = busy;
+		info->total_time = total;
+	}
+
+	/* a policy is as busy as its busiest cpu */
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+		policy->util = -1;
+
+		for (j = 0; j < policy->num_cpus; j++) {
+			if (cpu_topology[policy->cpus[j]].util > policy->util)
+				policy->util = cpu_topology[policy->cpus[j]].util;
+		}
+	}
+}
+
+/* Close the descriptor opened by load_open. */
+void load_close(void)
+{
+	sysfs_node_close(&stat_node);
+}
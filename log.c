@@ -0,0 +1,364 @@
+/**
+* log.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "cpu_throttle.h"
+
+/* A formatted message waiting for the writer thread */
+struct log_message {
+	int level;
+	char text[LOG_MSG_SIZE];
+};
+
+/* Single producer, single consumer queue of messages. Only the
+ * owning thread moves head and only the writer thread moves tail,
+ * so neither side takes a lock. */
+struct log_ring {
+	struct log_message slots[LOG_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+};
+
+/* rings of every thread which has logged so far */
+static _Atomic(struct log_ring *) rings[LOG_MAX_THREADS];
+static atomic_int num_rings;
+
+/* ring of the calling thread */
+static __thread struct log_ring *thread_ring;
+
+/* messages lost to full rings, not yet reported */
+static atomic_ulong dropped;
+
+/* writer thread state */
+static pthread_t writer;
+static atomic_int writer_running;
+static atomic_int writer_stopping;
+
+/* eventfd the writer thread sleeps on, and whether it has been
+ * signalled since it last woke up, so a burst of messages costs
+ * a single write */
+static int writer_event = -1;
+static atomic_int writer_signalled;
+
+/* pid printed with every message */
+static int log_pid;
+
+/* Letter printed for each enum log_level */
+static const char level_tags[] = { 'E', 'W', 'I' };
+
+/* Write one message to the log file. */
+static void log_emit(int level, const char *text)
+{
+	fprintf(log_file ? log_file : stderr, "[%d] %c: %s",
+			log_pid, level_tags[level], text);
+}
+
+/* Returns true if site may log another message this second. The
+ * first message of a new window reports how many were suppressed. */
+static int log_ratelimit(struct log_site *site, int *suppressed)
+{
+	struct timespec now;
+
+	/* the coarse clock is read from the vdso, without a syscall */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	*suppressed = 0;
+
+	if (now.tv_sec != site->window) {
+		*suppressed = site->suppressed;
+		site->window = now.tv_sec;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+
+	if (site->count >= LOG_RATELIMIT_BURST) {
+		site->suppressed++;
+		return 0;
+	}
+	site->count++;
+	return 1;
+}
+
+/* Find or register the ring of the calling thread.
+ *
+ * @return: the ring, NULL if every ring is taken. */
+static struct log_ring *log_thread_ring(void)
+{
+	int index;
+
+	if (thread_ring)
+		return thread_ring;
+
+	if ((index = atomic_load(&num_rings)) >= LOG_MAX_THREADS)
+		return NULL;
+
+	if (!(thread_ring = calloc(1, sizeof(struct log_ring))))
+		return NULL;
+
+	/* publish the ring before the writer can see the new count */
+	index = atomic_fetch_add(&num_rings, 1);
+	if (index >= LOG_MAX_THREADS) {
+		free(thread_ring);
+		thread_ring = NULL;
+		return NULL;
+	}
+	atomic_store(&rings[index], thread_ring);
+
+	return thread_ring;
+}
+
+/* Wake the writer thread up, unless it was already woken
+ * and has not drained the rings since. */
+static void log_signal(void)
+{
+	uint64_t one = 1;
+
+	/* let the next message try again if the write failed */
+	if (!atomic_exchange(&writer_signalled, 1) &&
+			(write(writer_event, &one, sizeof(one)) == -1))
+		atomic_store(&writer_signalled, 0);
+}
+
+/* Queue text at level on the ring of the calling thread,
+ * dropping it if the ring is full. */
+static void log_queue(int level, const char *text)
+{
+	struct log_ring *ring;
+	struct log_message *message;
+	unsigned int head;
+
+	if (!(ring = log_thread_ring())) {
+		atomic_fetch_add(&dropped, 1);
+		log_signal();
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+			>= LOG_RING_SIZE) {
+		atomic_fetch_add(&dropped, 1);
+		log_signal();
+		return;
+	}
+
+	message = &ring->slots[head & (LOG_RING_SIZE - 1)];
+	message->level = level;
+	memcpy(message->text, text, strlen(text) + 1);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	log_signal();
+}
+
+/* Names of each enum log_level */
+static const char *level_names[] = { "error", "warn", "info" };
+#define NUM_LOG_LEVELS ((int)(sizeof(level_names) / sizeof(level_names[0])))
+
+/* Find the log level called name.
+ *
+ * @return: its enum log_level value, -1 if there is none. */
+int log_level_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_LOG_LEVELS; i++) {
+		if (!strcmp(level_names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+/* Returns the name of log level, NULL if there is none. */
+const char *log_level_name(int level)
+{
+	if ((level < 0) || (level >= NUM_LOG_LEVELS))
+		return NULL;
+
+	return level_names[level];
+}
+
+/* Format a message at level and queue it on the ring of the
+ * calling thread, or write it out directly if the writer thread
+ * is not running. Never blocks once the writer is running: a
+ * message is dropped and counted if the ring is full. */
+void log_write(struct log_site *site, int level, const char *fmt, ...)
+{
+	char text[LOG_MSG_SIZE];
+	va_list args;
+	int suppressed;
+
+	if (level > settings->log_level)
+		return;
+
+	if (!log_ratelimit(site, &suppressed))
+		return;
+
+	if (!log_pid)
+		log_pid = getpid();
+
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+
+	if (!atomic_load(&writer_running)) {
+		if (suppressed) {
+			fprintf(log_file ? log_file : stderr,
+				"[%d] W: %d similar messages suppressed.\n",
+				log_pid, suppressed);
+		}
+		log_emit(level, text);
+		return;
+	}
+
+	if (suppressed) {
+		char note[MIN_BUF_SIZE * 2];
+
+		snprintf(note, sizeof(note),
+				"%d similar messages suppressed.\n", suppressed);
+		log_queue(LOG_LEVEL_WARN, note);
+	}
+	log_queue(level, text);
+}
+
+/* Write out every queued message and report drops.
+ *
+ * @return: the number of messages written. */
+static int log_drain(void)
+{
+	struct log_ring *ring;
+	struct log_message *message;
+	unsigned int head, tail;
+	unsigned long lost;
+	int i, count, written = 0;
+
+	count = atomic_load(&num_rings);
+	if (count > LOG_MAX_THREADS)
+		count = LOG_MAX_THREADS;
+
+	for (i = 0; i < count; i++) {
+		if (!(ring = atomic_load(&rings[i])))
+			continue;
+
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		for (; tail != head; tail++, written++) {
+			message = &ring->slots[tail & (LOG_RING_SIZE - 1)];
+			log_emit(message->level, message->text);
+		}
+
+		/* hand the slots back to the producer */
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	if ((lost = atomic_exchange(&dropped, 0))) {
+		fprintf(log_file ? log_file : stderr,
+			"[%d] W: Dropped %lu log messages.\n", log_pid, lost);
+		written++;
+	}
+
+	if (written)
+		fflush(log_file ? log_file : stderr);
+
+	return written;
+}
+
+/* Body of the writer thread: sleep until a message is queued,
+ * then drain the rings, until told to stop. */
+static void *log_writer(void *arg)
+{
+	uint64_t count;
+
+	while (!atomic_load(&writer_stopping)) {
+		if ((read(writer_event, &count, sizeof(count)) == -1) &&
+				(errno != EINTR))
+			break;
+
+		/* messages queued from here on signal again */
+		atomic_store(&writer_signalled, 0);
+		log_drain();
+	}
+	return NULL;
+}
+
+/* Start the writer thread draining the rings to log_file.
+ * The rings are flushed when the process exits.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int log_start(void)
+{
+	sigset_t mask, old_mask;
+	int rc;
+
+	if (atomic_load(&writer_running))
+		return 0;
+
+	log_pid = getpid();
+	atomic_store(&writer_stopping, 0);
+	atomic_store(&writer_signalled, 0);
+
+	if ((writer_event == -1) &&
+			((writer_event = eventfd(0, EFD_CLOEXEC)) == -1)) {
+		perror("eventfd");
+		return -1;
+	}
+
+	/* the writer inherits a fully blocked mask, so signals
+	 * are always left to the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	rc = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (rc) {
+		errno = rc;
+		perror("pthread_create");
+		return -1;
+	}
+	atomic_store(&writer_running, 1);
+
+	/* do not lose the messages of an exit(3) */
+	atexit(log_stop);
+
+	return 0;
+}
+
+/* Stop the writer thread and write out whatever is queued. */
+void log_stop(void)
+{
+	if (!atomic_load(&writer_running))
+		return;
+
+	atomic_store(&writer_stopping, 1);
+
+	/* wake it up, even if a wakeup is already pending */
+	atomic_store(&writer_signalled, 0);
+	log_signal();
+
+	pthread_join(writer, NULL);
+	atomic_store(&writer_running, 0);
+
+	/* anything queued after the last pass */
+	log_drain();
+}
@@ -0,0 +1,458 @@
+/**
+* metrics.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* accept4 and asprintf need the feature macros set by cpu_throttle.h */
+#include "cpu_throttle.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* upper bounds of the tick latency histogram buckets, in uS */
+static const int latency_buckets[] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+#define NUM_LATENCY_BUCKETS \
+	((int)(sizeof(latency_buckets) / sizeof(latency_buckets[0])))
+
+/* Figures kept for every policy */
+struct policy_metrics {
+	/* time spent in each enum temp_band, in uS */
+	unsigned long long band_time[BAND_ABOVE + 1];
+
+	/* time spent above the target temperature, in uS */
+	unsigned long long above_target_time;
+
+	/* lowest and highest ceiling seen, in KHz */
+	int min_freq;
+	int max_freq;
+};
+
+/* A connected scraper */
+struct metrics_client {
+	int fd;
+
+	/* request read so far */
+	char request[MAX_BUF_SIZE];
+	size_t request_len;
+
+	/* response and how much of it was sent */
+	char *response;
+	size_t response_len;
+	size_t response_sent;
+};
+
+static int listen_fd = -1;
+static char socket_path[MAX_BUF_SIZE];
+
+static struct metrics_client clients[METRICS_MAX_CLIENTS];
+
+static unsigned long long ticks;
+static unsigned long long latency_counts[NUM_LATENCY_BUCKETS + 1];
+static long long latency_sum;
+
+static struct policy_metrics *policy_metrics;
+static int num_policy_metrics;
+
+/* Names exported for each enum temp_band */
+static const char *band_names[] = { "below", "lower", "upper", "above" };
+
+/* Account for a tick which took elapsed nS. Does nothing
+ * if metrics are not being served. */
+void metrics_tick(long long elapsed)
+{
+	struct policy_metrics *metrics;
+	struct cpu_policy *policy;
+	int i, band, freq;
+
+	if (listen_fd == -1)
+		return;
+
+	ticks++;
+	latency_sum += elapsed;
+
+	for (i = 0; (i < NUM_LATENCY_BUCKETS) &&
+			(elapsed > latency_buckets[i] * 1000LL); i++)
+		;
+	latency_counts[i]++;
+
+	for (i = 0; (i < num_policies) && (i < num_policy_metrics); i++) {
+		policy = &cpu_policies[i];
+		metrics = &policy_metrics[i];
+
+		if ((band = temperature_band(policy->curr_temp)) != BAND_UNKNOWN)
+			metrics->band_time[band] += tick_interval;
+
+		if (policy->curr_temp > settings->cpu_target_temperature)
+			metrics->above_target_time += tick_interval;
+
+		if ((freq = policy->max_freq.value) == -1)
+			continue;
+
+		if ((metrics->min_freq == -1) || (freq < metrics->min_freq))
+			metrics->min_freq = freq;
+		if (freq > metrics->max_freq)
+			metrics->max_freq = freq;
+	}
+}
+
+/* Write the metrics in the Prometheus text format to out. */
+static void metrics_format(FILE *out)
+{
+	struct policy_metrics *metrics;
+	unsigned long long cumulative = 0;
+	int i, band;
+
+	fprintf(out, "# HELP cpu_throttle_ticks_total Control ticks run.\n"
+			"# TYPE cpu_throttle_ticks_total counter\n"
+			"cpu_throttle_ticks_total %llu\n", ticks);
+
+	fprintf(out, "# HELP cpu_throttle_sysfs_reads_total Reads of sysfs nodes.\n"
+			"# TYPE cpu_throttle_sysfs_reads_total counter\n"
+			"cpu_throttle_sysfs_reads_total %lu\n", sysfs_reads);
+	fprintf(out, "# HELP cpu_throttle_sysfs_writes_total Writes to sysfs nodes.\n"
+			"# TYPE cpu_throttle_sysfs_writes_total counter\n"
+			"cpu_throttle_sysfs_writes_total %lu\n", sysfs_writes);
+	fprintf(out, "# HELP cpu_throttle_sysfs_read_errors_total Failed sysfs reads.\n"
+			"# TYPE cpu_throttle_sysfs_read_errors_total counter\n"
+			"cpu_throttle_sysfs_read_errors_total %lu\n", sysfs_read_errors);
+	fprintf(out, "# HELP cpu_throttle_sysfs_write_errors_total Failed sysfs writes.\n"
+			"# TYPE cpu_throttle_sysfs_write_errors_total counter\n"
+			"cpu_throttle_sysfs_write_errors_total %lu\n", sysfs_write_errors);
+
+	fprintf(out, "# HELP cpu_throttle_band_seconds_total Time spent in each "
+			"part of the hysteresis band.\n"
+			"# TYPE cpu_throttle_band_seconds_total counter\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		for (band = BAND_BELOW; band <= BAND_ABOVE; band++) {
+			fprintf(out, "cpu_throttle_band_seconds_total"
+				"{policy=\"%d\",band=\"%s\"} %.3f\n", cpu_policies[i].id,
+				band_names[band], policy_metrics[i].band_time[band] / 1e6);
+		}
+	}
+
+	fprintf(out, "# HELP cpu_throttle_above_target_seconds_total Time spent "
+			"above the target temperature.\n"
+			"# TYPE cpu_throttle_above_target_seconds_total counter\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		fprintf(out, "cpu_throttle_above_target_seconds_total"
+			"{policy=\"%d\"} %.3f\n", cpu_policies[i].id,
+			policy_metrics[i].above_target_time / 1e6);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_max_freq_khz Current frequency ceiling.\n"
+			"# TYPE cpu_throttle_max_freq_khz gauge\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		fprintf(out, "cpu_throttle_max_freq_khz{policy=\"%d\"} %d\n",
+			cpu_policies[i].id, cpu_policies[i].max_freq.value);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_max_freq_lowest_khz Lowest frequency "
+			"ceiling set.\n"
+			"# TYPE cpu_throttle_max_freq_lowest_khz gauge\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		metrics = &policy_metrics[i];
+		fprintf(out, "cpu_throttle_max_freq_lowest_khz{policy=\"%d\"} %d\n",
+			cpu_policies[i].id, metrics->min_freq);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_max_freq_highest_khz Highest frequency "
+			"ceiling set.\n"
+			"# TYPE cpu_throttle_max_freq_highest_khz gauge\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		metrics = &policy_metrics[i];
+		fprintf(out, "cpu_throttle_max_freq_highest_khz{policy=\"%d\"} %d\n",
+			cpu_policies[i].id, metrics->max_freq);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_utilisation_percent Utilisation of "
+			"the busiest cpu of a policy, when load aware.\n"
+			"# TYPE cpu_throttle_utilisation_percent gauge\n");
+	for (i = 0; i < num_policy_metrics; i++) {
+		if (cpu_policies[i].util == -1)
+			continue;
+		fprintf(out, "cpu_throttle_utilisation_percent{policy=\"%d\"} %d\n",
+			cpu_policies[i].id, cpu_policies[i].util);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_power_limit_watts RAPL power limit "
+			"of a package.\n"
+			"# TYPE cpu_throttle_power_limit_watts gauge\n");
+	for (i = 0; i < num_rapl_zones; i++) {
+		fprintf(out, "cpu_throttle_power_limit_watts{package=\"%d\"} %.3f\n",
+			rapl_zones[i].package, rapl_zones[i].limit / 1e6);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_epp_grade Energy performance "
+			"preference steps below the original one.\n"
+			"# TYPE cpu_throttle_epp_grade gauge\n");
+	for (i = 0; i < num_policies; i++) {
+		if (epp_grade(i) == -1)
+			continue;
+		fprintf(out, "cpu_throttle_epp_grade{policy=\"%d\"} %d\n",
+			cpu_policies[i].id, epp_grade(i));
+	}
+
+	fprintf(out, "# HELP cpu_throttle_idle_injection_state Idle injection "
+			"state of a cooling device.\n"
+			"# TYPE cpu_throttle_idle_injection_state gauge\n");
+	for (i = 0; i < num_idle_devices; i++) {
+		fprintf(out, "cpu_throttle_idle_injection_state{device=\"%d\",type=\"%s\"} %d\n",
+			idle_devices[i].index, idle_devices[i].type,
+			idle_devices[i].state.value);
+	}
+
+	if (turbo_state() != -1) {
+		fprintf(out, "# HELP cpu_throttle_turbo_enabled Whether turbo is on.\n"
+				"# TYPE cpu_throttle_turbo_enabled gauge\n"
+				"cpu_throttle_turbo_enabled %d\n", turbo_state());
+	}
+
+	fprintf(out, "# HELP cpu_throttle_fan_pwm Current fan pwm value.\n"
+			"# TYPE cpu_throttle_fan_pwm gauge\n");
+	for (i = 0; i < num_fans; i++) {
+		fprintf(out, "cpu_throttle_fan_pwm{fan=\"%d\"} %d\n",
+			i, fans[i].pwm.value);
+	}
+
+	fprintf(out, "# HELP cpu_throttle_tick_duration_seconds Time taken "
+			"to process a tick.\n"
+			"# TYPE cpu_throttle_tick_duration_seconds histogram\n");
+	for (i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+		cumulative += latency_counts[i];
+		fprintf(out, "cpu_throttle_tick_duration_seconds_bucket"
+			"{le=\"%g\"} %llu\n", latency_buckets[i] / 1e6, cumulative);
+	}
+	fprintf(out, "cpu_throttle_tick_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+			"cpu_throttle_tick_duration_seconds_sum %.9f\n"
+			"cpu_throttle_tick_duration_seconds_count %llu\n",
+			ticks, latency_sum / 1e9, ticks);
+}
+
+/* Drop a client and free its slot. */
+static void metrics_disconnect(struct metrics_client *client)
+{
+	engine_remove_fd(client->fd);
+	close(client->fd);
+	free(client->response);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+/* Returns the client connected on fd. */
+static struct metrics_client *metrics_find(int fd)
+{
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (clients[i].fd == fd)
+			return &clients[i];
+	}
+	return NULL;
+}
+
+/* Build the HTTP response for client.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int metrics_respond(struct metrics_client *client)
+{
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *out;
+	int len;
+
+	if (!(out = open_memstream(&body, &body_len)))
+		return -1;
+
+	metrics_format(out);
+	fclose(out);
+
+	len = asprintf(&client->response, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n%s", body_len, body);
+	free(body);
+
+	if (len == -1) {
+		client->response = NULL;
+		return -1;
+	}
+	client->response_len = len;
+	client->response_sent = 0;
+
+	return 0;
+}
+
+/* Event loop callback for a connected client: read its request
+ * until the blank line ending the headers, then send the metrics
+ * back as the socket lets us. */
+static void metrics_client_ready(int fd, uint32_t events)
+{
+	struct metrics_client *client;
+	ssize_t rc;
+
+	if (!(client = metrics_find(fd)))
+		return;
+
+	if (!client->response && (events & EPOLLIN)) {
+		rc = read(fd, client->request + client->request_len,
+				sizeof(client->request) - client->request_len - 1);
+
+		if (rc <= 0) {
+			if ((rc == -1) && (errno == EAGAIN))
+				return;
+			metrics_disconnect(client);
+			return;
+		}
+		client->request_len += rc;
+		client->request[client->request_len] = '\0';
+
+		/* wait for the rest of the headers, we only care
+		 * that the request ended */
+		if (!strstr(client->request, "\r\n\r\n") &&
+				!strstr(client->request, "\n\n") &&
+				(client->request_len < sizeof(client->request) - 1))
+			return;
+
+		if ((metrics_respond(client) == -1) ||
+				(engine_modify_fd(fd, EPOLLOUT) == -1)) {
+			metrics_disconnect(client);
+			return;
+		}
+	}
+
+	if (client->response && (events & EPOLLOUT)) {
+		rc = write(fd, client->response + client->response_sent,
+				client->response_len - client->response_sent);
+
+		if ((rc == -1) && (errno == EAGAIN))
+			return;
+
+		if (rc > 0)
+			client->response_sent += rc;
+
+		/* done, or the client went away */
+		if ((rc <= 0) || (client->response_sent == client->response_len))
+			metrics_disconnect(client);
+		return;
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR))
+		metrics_disconnect(client);
+}
+
+/* Event loop callback for the listening socket. */
+static void metrics_accept(int fd, uint32_t events)
+{
+	struct metrics_client *client;
+	int client_fd;
+
+	if ((client_fd = accept4(fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		return;
+
+	if (!(client = metrics_find(-1))) {
+		/* busy, the scraper will retry */
+		close(client_fd);
+		return;
+	}
+
+	client->fd = client_fd;
+
+	if (engine_add_fd(client_fd, EPOLLIN, metrics_client_ready) == -1) {
+		close(client_fd);
+		client->fd = -1;
+	}
+}
+
+/* Listen for metrics scrapes on the unix socket at path, served
+ * from the event loop. Must be called after engine_init.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int metrics_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("Metrics socket path %s is too long.\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	if (!(policy_metrics = calloc(num_policies, sizeof(struct policy_metrics))))
+		return -1;
+
+	num_policy_metrics = num_policies;
+	for (i = 0; i < num_policy_metrics; i++) {
+		policy_metrics[i].min_freq = -1;
+		policy_metrics[i].max_freq = -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+			| SOCK_CLOEXEC, 0)) == -1) {
+		LOGE("Could not create the metrics socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* a socket left behind by an earlier run */
+	unlink(path);
+
+	if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+			(listen(listen_fd, METRICS_MAX_CLIENTS) == -1) ||
+			(engine_add_fd(listen_fd, EPOLLIN, metrics_accept) == -1)) {
+		LOGE("Could not listen on %s: %s\n", path, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	strncpy(socket_path, path, MAX_BUF_SIZE - 1);
+	return 0;
+}
+
+/* Stop listening and remove the socket. */
+void metrics_close(void)
+{
+	int i;
+
+	if (listen_fd == -1)
+		return;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (clients[i].fd != -1)
+			metrics_disconnect(&clients[i]);
+	}
+
+	engine_remove_fd(listen_fd);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_path);
+
+	free(policy_metrics);
+	policy_metrics = NULL;
+	num_policy_metrics = 0;
+}
@@ -0,0 +1,288 @@
+/**
+* rapl.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* RAPL backend. For the packages it is enabled on, the controller
+ * keeps deciding a frequency ceiling for every policy, but the
+ * ceiling is only kept in memory. Once per tick the lowest ceiling
+ * of the policies of a package is turned into a long term power
+ * limit, and the firmware picks the frequency mix that fits it. */
+
+#include <fcntl.h>
+#include <dirent.h>
+#include "cpu_throttle.h"
+
+struct rapl_zone * rapl_zones;
+int num_rapl_zones;
+
+/* Read the integer in the file at filename, quietly. Not counted
+ * as sysfs traffic, as the file may be missing.
+ *
+ * @return: the value read, -1 otherwise. */
+static long long rapl_read(const char *filename)
+{
+	char buf[INT64_BUF_SIZE];
+	long long value;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if ((len <= 0) || (parse_integer64(buf, len, &value) == -1))
+		return -1;
+
+	return value;
+}
+
+/* Open the zone at path, a package domain of intel-rapl, as
+ * the zone of package.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int rapl_add_zone(const char *path, int package)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	struct rapl_zone *zone;
+	long long min_power;
+
+	zone = realloc(rapl_zones, (num_rapl_zones + 1) * sizeof(struct rapl_zone));
+	if (!zone)
+		return -1;
+
+	rapl_zones = zone;
+	zone = &rapl_zones[num_rapl_zones];
+	zone->package = package;
+
+	snprintf(filename, sizeof(filename), "%s/constraint_0_power_limit_uw", path);
+	if (sysfs_node_open(&zone->node, filename, O_RDWR) == -1)
+		return -1;
+
+	if ((zone->limit = sysfs_node_read64(&zone->node)) <= 0) {
+		sysfs_node_close(&zone->node);
+		return -1;
+	}
+	zone->orig_limit = zone->limit;
+
+	/* never go below what the firmware allows, or below a
+	 * RAPL_MIN_SHARE of the limit if it does not say */
+	snprintf(filename, sizeof(filename), "%s/constraint_0_min_power_uw", path);
+	min_power = rapl_read(filename);
+
+	zone->min_limit = (zone->orig_limit / 100) * RAPL_MIN_SHARE;
+	if ((min_power > zone->min_limit) && (min_power < zone->orig_limit))
+		zone->min_limit = min_power;
+
+	num_rapl_zones++;
+	return 0;
+}
+
+/* Write limit to zone, unless it already holds it and force is
+ * not set.
+ *
+ * @return: 0 if succesful or nothing had to be written, -1 otherwise. */
+static int rapl_set(struct rapl_zone *zone, long long limit, int force)
+{
+	if (!force && (limit == zone->limit))
+		return 0;
+
+	if (sysfs_node_write64(&zone->node, limit) == -1) {
+		/* we no longer know what the hardware holds */
+		zone->limit = -1;
+		return -1;
+	}
+	zone->limit = limit;
+	return 0;
+}
+
+/* Returns the zone capping package, NULL if there is none. */
+static struct rapl_zone *rapl_zone_of(int package)
+{
+	int i;
+
+	for (i = 0; i < num_rapl_zones; i++) {
+		if (rapl_zones[i].package == package)
+			return &rapl_zones[i];
+	}
+	return NULL;
+}
+
+/* Find the RAPL zone of every package in settings->rapl_packages
+ * and hand the ceilings of their policies over to it. The real
+ * scaling_max_freq of those policies is opened up to the maximum.
+ * Must be called after the policies are known.
+ *
+ * @return: the number of zones used, -1 on error. */
+int rapl_open(void)
+{
+	char dirname[MAX_BUF_SIZE], path[MAX_BUF_SIZE];
+	char name[MIN_BUF_SIZE];
+	int packages[RAPL_MAX_PACKAGES], wanted[RAPL_MAX_PACKAGES] = { 0 };
+	struct cpu_policy *policy;
+	struct dirent *entry;
+	int i, j, count, package, index, end, fd;
+	ssize_t len;
+	DIR *dir;
+
+	count = parse_cpu_list(settings->rapl_packages, packages, RAPL_MAX_PACKAGES);
+	for (i = 0; i < count; i++) {
+		if ((packages[i] >= 0) && (packages[i] < RAPL_MAX_PACKAGES))
+			wanted[packages[i]] = 1;
+	}
+
+	sysfs_path(dirname, sizeof(dirname), POWERCAP_DIR);
+	if (!(dir = opendir(dirname))) {
+		LOGE("Could not open %s: %s\n", dirname, strerror(errno));
+		return -1;
+	}
+
+	/* the package domains are intel-rapl:N, named package-N.
+	 * Subzones (intel-rapl:N:M) cap single domains of a package. */
+	while ((entry = readdir(dir))) {
+		if ((sscanf(entry->d_name, "intel-rapl:%d%n", &index, &end) != 1) ||
+				entry->d_name[end])
+			continue;
+
+		sysfs_path(path, sizeof(path), POWERCAP_DIR "/intel-rapl:%d/name", index);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		len = read(fd, name, sizeof(name) - 1);
+		close(fd);
+
+		if (len <= 0)
+			continue;
+		name[len] = '\0';
+
+		if ((sscanf(name, "package-%d", &package) != 1) ||
+				(package < 0) || (package >= RAPL_MAX_PACKAGES) ||
+				!wanted[package])
+			continue;
+
+		sysfs_path(path, sizeof(path), POWERCAP_DIR "/intel-rapl:%d", index);
+		if (rapl_add_zone(path, package) == -1) {
+			LOGW("\tCould not use the power limit of package %d.\n", package);
+			continue;
+		}
+		wanted[package] = 0;
+	}
+	closedir(dir);
+
+	for (i = 0; i < RAPL_MAX_PACKAGES; i++) {
+		if (wanted[i])
+			LOGW("\tNo RAPL zone for package %d.\n", i);
+	}
+
+	/* a policy is handed over if all its cpus are in zones */
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+
+		for (j = 0; j < policy->num_cpus; j++) {
+			if (!rapl_zone_of(cpu_topology[policy->cpus[j]].package))
+				break;
+		}
+		if (j < policy->num_cpus)
+			continue;
+
+		actuator_reset(&policy->max_freq, policy->hw_max_freq);
+		policy->max_freq.virtual = 1;
+		policy->owner = POLICY_OWNER_RAPL;
+	}
+
+	return num_rapl_zones;
+}
+
+/* Turn the ceilings of the policies of every zone into a power
+ * limit. The lowest ceiling of a package, relative to the range of
+ * its own policy, decides, mapped onto the range between min_limit
+ * and the original limit along the cube of the frequency, as
+ * dynamic power roughly follows it. Limits are
+ * rounded to the nearest W, so small corrections do not cause a
+ * write every interval. */
+void rapl_apply(void)
+{
+	struct cpu_policy *policy;
+	struct rapl_zone *zone;
+	long long limit;
+	double ratio, policy_ratio;
+	int i, j;
+
+	for (i = 0; i < num_rapl_zones; i++) {
+		zone = &rapl_zones[i];
+		ratio = -1.0;
+
+		for (j = 0; j < num_policies; j++) {
+			policy = &cpu_policies[j];
+
+			if ((policy->owner != POLICY_OWNER_RAPL) || (cpu_topology[
+					policy->cpus[0]].package != zone->package))
+				continue;
+
+			policy_ratio = policy_freq_ratio(policy, policy->max_freq.value);
+			if ((ratio < 0.0) || (policy_ratio < ratio))
+				ratio = policy_ratio;
+		}
+
+		if (ratio < 0.0)
+			continue;
+
+		limit = zone->min_limit + (long long)((zone->orig_limit - zone->min_limit)
+				* ratio * ratio * ratio);
+		limit = ((limit + 500000) / 1000000) * 1000000;
+
+		/* the firmware limit need not be whole W, so keep
+		 * it exactly when the package is not throttled */
+		if ((ratio >= 1.0) || (limit > zone->orig_limit - 1000000))
+			limit = zone->orig_limit;
+		if (limit < zone->min_limit)
+			limit = zone->min_limit;
+
+		if ((limit != zone->limit) && settings->verbose) {
+			LOGI("\t[package%d] Setting power limit to %lldW.\n",
+					zone->package, limit / 1000000);
+		}
+		rapl_set(zone, limit, 0);
+	}
+}
+
+/* Write the power limits found at startup back. */
+void rapl_restore(void)
+{
+	int i;
+
+	for (i = 0; i < num_rapl_zones; i++) {
+		rapl_set(&rapl_zones[i], rapl_zones[i].orig_limit, 1);
+	}
+}
+
+/* Restore the power limits and close the zones. */
+void rapl_close(void)
+{
+	int i;
+
+	rapl_restore();
+
+	for (i = 0; i < num_rapl_zones; i++) {
+		sysfs_node_close(&rapl_zones[i].node);
+	}
+	free(rapl_zones);
+	rapl_zones = NULL;
+	num_rapl_zones = 0;
+}
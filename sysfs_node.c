@@ -0,0 +1,393 @@
+/**
+* sysfs_node.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include "cpu_throttle.h"
+
+unsigned long sysfs_reads;
+unsigned long sysfs_writes;
+unsigned long sysfs_read_errors;
+unsigned long sysfs_write_errors;
+
+/* Parse a decimal integer from the first len bytes of buf.
+ * Leading whitespace and a sign are accepted, parsing stops
+ * at the first non-digit character.
+ *
+ * @return: 0 if succesful, -1 if no digits were found. */
+int parse_integer64(const char *buf, size_t len, long long *value)
+{
+	size_t i = 0;
+	int negative = 0, digits = 0;
+	long long result = 0;
+
+	/* skip leading whitespace */
+	while ((i < len) && ((buf[i] == ' ') || (buf[i] == '\t')))
+		i++;
+
+	if ((i < len) && ((buf[i] == '-') || (buf[i] == '+'))) {
+		negative = (buf[i] == '-');
+		i++;
+	}
+
+	/* accumulate the digits */
+	for (; (i < len) && (buf[i] >= '0') && (buf[i] <= '9'); i++) {
+		result = (result * 10) + (buf[i] - '0');
+		digits++;
+	}
+
+	if (!digits)
+		return -1;
+
+	*value = negative ? -result : result;
+	return 0;
+}
+
+/* As parse_integer64, truncated to an int.
+ *
+ * @return: 0 if succesful, -1 if no digits were found. */
+int parse_integer(const char *buf, size_t len, int *value)
+{
+	long long result;
+
+	if (parse_integer64(buf, len, &result) == -1)
+		return -1;
+
+	*value = (int)result;
+	return 0;
+}
+
+/* Format value as a decimal string into buf, which must
+ * be at least INT_BUF_SIZE bytes long. No terminator is added.
+ *
+ * @return: the number of characters written. */
+int format_integer(char *buf, int value)
+{
+	char digits[INT_BUF_SIZE];
+	unsigned int magnitude;
+	int len = 0, i = 0;
+
+	magnitude = (value < 0) ? -(unsigned int)value : (unsigned int)value;
+
+	/* write the digits out in reverse */
+	do {
+		digits[i++] = '0' + (magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude);
+
+	if (value < 0)
+		buf[len++] = '-';
+
+	while (i)
+		buf[len++] = digits[--i];
+
+	return len;
+}
+
+/* Returns true if errno indicates the node went away under us,
+ * for example because the cpu it belongs to was hotplugged. */
+static int sysfs_node_is_stale(int error)
+{
+	return (error == ENODEV) || (error == ENOENT) || (error == EBADF)
+		|| (error == ENXIO) || (error == ESTALE);
+}
+
+/* (Re)open the file backing node. */
+static int sysfs_node_reopen(struct sysfs_node *node)
+{
+	if (node->fd != -1) {
+		close(node->fd);
+	}
+
+	node->fd = open(node->path, node->flags | O_CLOEXEC);
+	return (node->fd == -1) ? -1 : 0;
+}
+
+/* Resolve the node at path and keep it open for later
+ * reads and writes. flags is O_RDONLY or O_RDWR.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_open(struct sysfs_node *node, const char *path, int flags)
+{
+	strncpy(node->path, path, MAX_BUF_SIZE - 1);
+	node->path[MAX_BUF_SIZE - 1] = '\0';
+	node->flags = flags;
+	node->fd = -1;
+
+	if (sysfs_node_reopen(node) == -1) {
+		LOGE("Could not open %s: %s\n",
+				node->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* pread or pwrite len bytes of buf at offset 0 of node. A
+ * descriptor that went stale is reopened and the call retried once.
+ *
+ * @return: the result of the last call, -1 on error. */
+static ssize_t sysfs_node_io(struct sysfs_node *node, char *buf,
+		size_t len, int write)
+{
+	ssize_t rc = -1;
+	int attempt;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+
+		/* the node went stale earlier, try to get it back */
+		if ((node->fd == -1) && (sysfs_node_reopen(node) == -1))
+			return -1;
+
+		if (write) {
+			rc = pwrite(node->fd, buf, len, 0);
+			sysfs_writes++;
+		}
+		else {
+			rc = pread(node->fd, buf, len, 0);
+			sysfs_reads++;
+		}
+
+		if (rc > 0)
+			return rc;
+
+		if ((rc == -1) && !sysfs_node_is_stale(errno))
+			return -1;
+
+		/* drop the descriptor and retry once with a fresh one */
+		close(node->fd);
+		node->fd = -1;
+	}
+	return rc;
+}
+
+/* Read the integer value held by node.
+ *
+ * @prereq: Assumes that integer is non-negative.
+ *
+ * @return: integer value read if succesful, -1 otherwise. */
+int sysfs_node_read(struct sysfs_node *node)
+{
+	char buf[INT_BUF_SIZE];
+	ssize_t rc;
+	int value;
+
+	rc = sysfs_node_io(node, buf, sizeof(buf), 0);
+
+	if ((rc <= 0) || (parse_integer(buf, rc, &value) == -1)) {
+		sysfs_read_errors++;
+		return -1;
+	}
+
+	return value;
+}
+
+/* Read the integer value held by node, for values which
+ * may not fit in an int.
+ *
+ * @return: integer value read if succesful, -1 otherwise. */
+long long sysfs_node_read64(struct sysfs_node *node)
+{
+	char buf[INT64_BUF_SIZE];
+	long long value;
+	ssize_t rc;
+
+	rc = sysfs_node_io(node, buf, sizeof(buf), 0);
+
+	if ((rc <= 0) || (parse_integer64(buf, rc, &value) == -1)) {
+		sysfs_read_errors++;
+		return -1;
+	}
+
+	return value;
+}
+
+/* Read up to len bytes held by node into buf as they are, for
+ * files holding more than one value.
+ *
+ * @return: the number of bytes read if succesful, -1 otherwise. */
+ssize_t sysfs_node_read_buf(struct sysfs_node *node, char *buf, size_t len)
+{
+	ssize_t rc;
+
+	if ((rc = sysfs_node_io(node, buf, len, 0)) <= 0) {
+		sysfs_read_errors++;
+		return -1;
+	}
+	return rc;
+}
+
+/* Write value to node as a string, not an integer. The value is
+ * newline terminated like the kernel's own output, so a shorter
+ * value written over a regular file still parses correctly.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write(struct sysfs_node *node, int value)
+{
+	char buf[INT_BUF_SIZE];
+	int len;
+
+	len = format_integer(buf, value);
+	buf[len++] = '\n';
+
+	if (sysfs_node_io(node, buf, len, 1) != len) {
+		sysfs_write_errors++;
+		return -1;
+	}
+	return 0;
+}
+
+/* As sysfs_node_write, for values which may not fit in an int.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write64(struct sysfs_node *node, long long value)
+{
+	char buf[INT64_BUF_SIZE];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%lld\n", value);
+
+	if (sysfs_node_io(node, buf, len, 1) != len) {
+		sysfs_write_errors++;
+		return -1;
+	}
+	return 0;
+}
+
+/* Write the string value to node, newline terminated.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int sysfs_node_write_str(struct sysfs_node *node, const char *value)
+{
+	char buf[MAX_BUF_SIZE];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s\n", value);
+	if ((len >= (int)sizeof(buf)) || (sysfs_node_io(node, buf, len, 1) != len)) {
+		sysfs_write_errors++;
+		return -1;
+	}
+	return 0;
+}
+
+/* Close the descriptor held by node. */
+void sysfs_node_close(struct sysfs_node *node)
+{
+	if (node->fd != -1) {
+		close(node->fd);
+		node->fd = -1;
+	}
+}
+
+/* Open the node backing act and seed the shadow value from it.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int actuator_open(struct actuator *act, const char *path)
+{
+	act->intervals_since_sync = 0;
+	act->virtual = 0;
+
+	if (sysfs_node_open(&act->node, path, O_RDWR) == -1) {
+		act->value = -1;
+		return -1;
+	}
+	act->value = sysfs_node_read(&act->node);
+	return (act->value == -1) ? -1 : 0;
+}
+
+/* Return the value last written to act. The shadow is re-read from
+ * sysfs every ACTUATOR_RESYNC_INTERVAL calls, or right away if it is
+ * not known, and anything written behind our back is adopted.
+ *
+ * @return: the current value if known, -1 otherwise. */
+int actuator_get(struct actuator *act)
+{
+	int value;
+
+	/* there is nothing to resync with */
+	if (act->virtual)
+		return act->value;
+
+	if ((act->value != -1) &&
+			(++act->intervals_since_sync < ACTUATOR_RESYNC_INTERVAL)) {
+		return act->value;
+	}
+	act->intervals_since_sync = 0;
+
+	if ((value = sysfs_node_read(&act->node)) == -1)
+		return act->value;
+
+	if ((act->value != -1) && (value != act->value) && settings->verbose) {
+		LOGW("\t%s changed externally from %d to %d.\n",
+				act->node.path, act->value, value);
+	}
+	act->value = value;
+
+	return value;
+}
+
+/* Write value to act unless the shadow says it is already set.
+ *
+ * @return: 0 if succesful or nothing had to be written, -1 otherwise. */
+int actuator_set(struct actuator *act, int value)
+{
+	if (value == act->value)
+		return 0;
+
+	return actuator_reset(act, value);
+}
+
+/* Write value to act unconditionally and update the shadow.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int actuator_reset(struct actuator *act, int value)
+{
+	if (act->virtual) {
+		act->value = value;
+		return 0;
+	}
+
+	if (sysfs_node_write(&act->node, value) == -1) {
+		/* we no longer know what the hardware holds */
+		act->value = -1;
+		return -1;
+	}
+	act->value = value;
+	return 0;
+}
+
+/* Format a path below sysfs_root into buf, so the daemon can
+ * be pointed at a copy of the sysfs tree.
+ *
+ * @return: the length of the path, as for snprintf. */
+int sysfs_path(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	len = snprintf(buf, size, "%s", sysfs_root);
+	if ((size_t)len >= size)
+		return len;
+
+	va_start(args, fmt);
+	len += vsnprintf(buf + len, size - len, fmt, args);
+	va_end(args);
+
+	return len;
+}
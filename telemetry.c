@@ -0,0 +1,156 @@
+/**
+* telemetry.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "cpu_throttle.h"
+
+/* the mapped file, NULL if telemetry is off */
+static struct telemetry_header *telemetry;
+static size_t telemetry_size;
+static char telemetry_file[MAX_BUF_SIZE];
+
+/* Create the telemetry file at path, sized for the sensors,
+ * policies and fans found, and map it.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int telemetry_open(const char *path)
+{
+	struct telemetry_header *header;
+	size_t record_size;
+	int fd;
+
+	record_size = sizeof(struct telemetry_record)
+		+ (num_sensors * sizeof(int32_t))
+		+ (num_policies * sizeof(struct telemetry_policy))
+		+ (num_fans * sizeof(int32_t));
+
+	/* keep every record 8 byte aligned */
+	record_size = (record_size + 7) & ~(size_t)7;
+
+	telemetry_size = sizeof(struct telemetry_header)
+		+ (TELEMETRY_RECORDS * record_size);
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1) {
+		LOGE("Could not create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, telemetry_size) == -1) {
+		LOGE("Could not size %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	header = mmap(NULL, telemetry_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (header == MAP_FAILED) {
+		LOGE("Could not map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	header->version = TELEMETRY_VERSION;
+	header->record_size = record_size;
+	header->num_records = TELEMETRY_RECORDS;
+	header->num_sensors = num_sensors;
+	header->num_policies = num_policies;
+	header->num_fans = num_fans;
+	header->polling_interval = settings->polling_interval;
+	header->ticks = 0;
+
+	/* readers only trust the layout once the magic is there */
+	__atomic_store_n(&header->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	strncpy(telemetry_file, path, MAX_BUF_SIZE - 1);
+	telemetry = header;
+
+	return 0;
+}
+
+/* Publish the state of this tick into the next record of the
+ * ring. Does nothing if telemetry is not open. */
+void telemetry_publish(void)
+{
+	struct telemetry_record *record;
+	struct telemetry_policy *entry;
+	struct cpu_policy *policy;
+	struct timespec now;
+	int32_t *values;
+	uint64_t tick;
+	uint32_t seq;
+	int i;
+
+	if (!telemetry)
+		return;
+
+	/* only this thread writes, a plain read of ticks is enough */
+	tick = telemetry->ticks + 1;
+	record = (struct telemetry_record *)((char *)(telemetry + 1)
+			+ (((tick - 1) % TELEMETRY_RECORDS) * telemetry->record_size));
+
+	/* odd while the record is inconsistent */
+	seq = record->seq;
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->tick = tick;
+	record->time = (now.tv_sec * 1000000000LL) + now.tv_nsec;
+
+	values = (int32_t *)(record + 1);
+	for (i = 0; i < num_sensors; i++) {
+		values[i] = temp_sensors[i].curr_temp;
+	}
+
+	entry = (struct telemetry_policy *)(values + num_sensors);
+	for (i = 0; i < num_policies; i++) {
+		policy = &cpu_policies[i];
+
+		entry[i].id = policy->id;
+		entry[i].temp = policy->curr_temp;
+		entry[i].max_freq = policy->max_freq.value;
+		entry[i].band = temperature_band(policy->curr_temp);
+		entry[i].step = policy->freq_step;
+	}
+
+	values = (int32_t *)(entry + num_policies);
+	for (i = 0; i < num_fans; i++) {
+		values[i] = fans[i].pwm.value;
+	}
+
+	__atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&telemetry->ticks, tick, __ATOMIC_RELEASE);
+}
+
+/* Unmap and remove the telemetry file. */
+void telemetry_close(void)
+{
+	if (!telemetry)
+		return;
+
+	munmap(telemetry, telemetry_size);
+	unlink(telemetry_file);
+	telemetry = NULL;
+}
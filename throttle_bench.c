@@ -0,0 +1,209 @@
+/**
+* throttle_bench.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/* Microbenchmarks of the sysfs primitives and of a full control
+ * tick, run against a fake sysfs tree on tmpfs. */
+
+#include <fcntl.h>
+#include <time.h>
+#include "fake_sysfs.h"
+
+/* iterations of every primitive */
+#define BENCH_OPS 200000
+
+/* ticks measured at every cpu count */
+#define BENCH_TICKS 1000
+
+/* largest cpu count measured, starting from 1 and doubling */
+#define BENCH_MAX_CPUS 256
+
+/* heap allocations made since startup, counted by the
+ * wrappers below around the glibc allocator */
+static unsigned long allocations;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+/* Monotonic time in nS. */
+static long long bench_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000000000LL) + now.tv_nsec;
+}
+
+/* Print the cost of one primitive call. */
+static void bench_report(const char *name, long long start)
+{
+	printf("%-20s %10.1f\n", name,
+			(double)(bench_now() - start) / BENCH_OPS);
+}
+
+/* Time the primitives on the frequency node of a one cpu tree.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int bench_primitives(void)
+{
+	char filename[MAX_BUF_SIZE];
+	struct sysfs_node node;
+	const char *path;
+	long long start;
+	int i;
+
+	if (fake_sysfs_create(1, 1, 1) == -1)
+		return -1;
+
+	path = fake_policy_paths[0];
+
+	printf("%-20s %10s\n", "primitive", "ns/op");
+
+	start = bench_now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		read_integer(path);
+	}
+	bench_report("read_integer", start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		write_integer(path, FAKE_MAX_FREQ - (i & 1));
+	}
+	bench_report("write_integer", start);
+
+	if (sysfs_node_open(&node, path, O_RDWR) == -1)
+		return -1;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		sysfs_node_read(&node);
+	}
+	bench_report("sysfs_node_read", start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		sysfs_node_write(&node, FAKE_MAX_FREQ - (i & 1));
+	}
+	bench_report("sysfs_node_write", start);
+
+	sysfs_node_close(&node);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		sysfs_path(filename, sizeof(filename), SCALING_DIR,
+				i & (MAX_CPUS - 1), "scaling_max_freq");
+	}
+	bench_report("sysfs_path", start);
+
+	fake_sysfs_destroy();
+	return 0;
+}
+
+/* Time engine_tick on a tree of cpus cpus with one policy each.
+ * The temperatures swing across the hysteresis band every tick, so
+ * every tick moves every ceiling. Only the tick itself is timed.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int bench_tick(int cpus)
+{
+	unsigned long syscalls, allocs;
+	long long elapsed = 0, start;
+	int tick, core, temp;
+
+	initialise_settings();
+	log_file = fopen("/dev/null", "w");
+
+	if (fake_sysfs_create(cpus, 1, 1) == -1)
+		return -1;
+
+	initialise_hardware();
+	validate_settings();
+
+	if (open_sysfs_nodes() == -1)
+		return -1;
+
+	syscalls = sysfs_reads + sysfs_writes;
+	allocs = allocations;
+
+	for (tick = 0; tick < BENCH_TICKS; tick++) {
+		temp = (tick & 1) ? C_TO_MC(65) : C_TO_MC(45);
+
+		for (core = 0; core <= fake_packages[0].num_cores; core++) {
+			write_integer(fake_packages[0].temp_paths[core], temp);
+		}
+
+		start = bench_now();
+		engine_tick();
+		elapsed += bench_now() - start;
+	}
+
+	printf("%6d %10d %12.1f %14.1f %12.2f\n", cpus, num_policies,
+			(double)elapsed / BENCH_TICKS,
+			(double)(sysfs_reads + sysfs_writes - syscalls) / BENCH_TICKS,
+			(double)(allocations - allocs) / BENCH_TICKS);
+
+	close_sysfs_nodes();
+	fake_sysfs_destroy();
+	fclose(log_file);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int cpus;
+
+	log_file = stderr;
+
+	if (bench_primitives() == -1) {
+		fprintf(stderr, "Could not set up the fake sysfs tree.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("\n%6s %10s %12s %14s %12s\n", "cpus", "policies",
+			"ns/tick", "syscalls/tick", "allocs/tick");
+
+	for (cpus = 1; cpus <= BENCH_MAX_CPUS; cpus *= 2) {
+		if (bench_tick(cpus) == -1) {
+			fprintf(stderr, "Could not run %d cpus.\n", cpus);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
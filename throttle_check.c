@@ -0,0 +1,142 @@
+/**
+* throttle_check.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/* Checks of the configuration file handling, run against
+ * a fake sysfs tree on tmpfs. */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include "fake_sysfs.h"
+
+/* limit saved in the legacy dump, below FAKE_MAX_FREQ, in KHz */
+#define CHECK_MAX_FREQ 2000000
+
+/* Write the first len bytes of s to path, as the raw struct
+ * dump older releases saved.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int check_write_dump(const char *path,
+		const struct throttle_settings *s, size_t len)
+{
+	int fd, rc = 0;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		perror("open");
+		return -1;
+	}
+
+	if (write(fd, s, len) != (ssize_t)len) {
+		perror("write");
+		rc = -1;
+	}
+
+	close(fd);
+	return rc;
+}
+
+/* Migrate a legacy dump holding a max-freq below the hardware
+ * maximum, then load the file it was rewritten to. The limit must
+ * survive both, since the dump is read before the hardware is.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int check_migration(void)
+{
+	struct throttle_settings legacy, *reloaded = NULL;
+	char path[FAKE_PATH_SIZE];
+	int rc = -1;
+
+	if (fake_sysfs_create(2, 1, 0) == -1) {
+		fprintf(stderr, "Could not build the fake sysfs tree.\n");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/cpu_throttle.dat", fake_root);
+	config_file_path = path;
+
+	/* the dump ended with num_cores */
+	memcpy(&legacy, settings, sizeof(legacy));
+	legacy.cpu_max_freq = CHECK_MAX_FREQ;
+
+	if (check_write_dump(path, &legacy,
+			offsetof(struct throttle_settings, controller)) == -1)
+		goto out;
+
+	/* in the order the daemon starts up in */
+	if (read_configuration_file(settings) == -1) {
+		fprintf(stderr, "Could not migrate %s.\n", path);
+		goto out;
+	}
+	initialise_hardware();
+	validate_settings();
+
+	if (settings->cpu_max_freq != CHECK_MAX_FREQ) {
+		fprintf(stderr, "Migrated max-freq is %d, expected %d.\n",
+				settings->cpu_max_freq, CHECK_MAX_FREQ);
+		goto out;
+	}
+
+	if (!(reloaded = copy_settings()))
+		goto out;
+	reloaded->cpu_max_freq = -1;
+
+	if (read_configuration_file(reloaded) == -1) {
+		fprintf(stderr, "Could not load the migrated %s.\n", path);
+		goto out;
+	}
+
+	if (reloaded->cpu_max_freq != CHECK_MAX_FREQ) {
+		fprintf(stderr, "Rewritten max-freq is %d, expected %d.\n",
+				reloaded->cpu_max_freq, CHECK_MAX_FREQ);
+		goto out;
+	}
+	rc = 0;
+
+out:
+	free(reloaded);
+	config_file_path = NULL;
+	fake_sysfs_destroy();
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		int (*run)(void);
+	} checks[] = {
+		{ "config migration", check_migration },
+	};
+	int i, failed = 0;
+
+	initialise_settings();
+	log_file = fopen("/dev/null", "w");
+
+	for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+		if (checks[i].run() == -1) {
+			printf("%-20s FAIL\n", checks[i].name);
+			failed++;
+		}
+		else {
+			printf("%-20s ok\n", checks[i].name);
+		}
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -24,6 +24,18 @@
 #include <getopt.h>
 #include "cpu_throttle.h"
 
+FILE * log_file;
+int termination_signaled;
+struct throttle_settings * settings;
+char * config_file_path;
+int write_config;
+int config_format;
+char sysfs_root[MAX_BUF_SIZE];
+int hysteresis_upper_limit;
+int hysteresis_lower_limit;
+int cpuinfo_min_freq;
+int cpuinfo_max_freq;
+
 /* Read the file at filename and returns the integer
  * value in the file.
  *
@@ -32,18 +44,22 @@
  * @return: integer value read if succesful, -1 otherwise. */
 int read_integer(const char* filename) {
 
-	int retval;
-	FILE * file;
+	char buf[INT_BUF_SIZE];
+	int fd, retval;
+	ssize_t rc;
 
 	/* open the file */
-	if (!(file = fopen(filename, "r"))) {
+	if ((fd = open(filename, O_RDONLY)) == -1) {
 		perror("open");
-		LOGE("%s\n", getpid(), strerror(errno));
+		LOGE("%s\n", strerror(errno));
 		return -1;
 	}
 	/* read the value from the file */
-	fscanf(file, "%d", &retval);
-	fclose(file);
+	rc = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if ((rc <= 0) || (parse_integer(buf, rc, &retval) == -1))
+		return -1;
 
 	return retval;
 }
@@ -55,603 +71,522 @@ int read_integer(const char* filename) {
  * @return: 0 if succesful, -1 otherwise. */
 int write_integer(const char* filename, int value)
 {
-	int fd;
+	char buf[INT_BUF_SIZE];
+	int fd, len;
+	ssize_t rc;
 
 	/* open the file */
 	if ((fd = open(filename, O_RDWR)) == -1) {
 		perror("open");
-		LOGE("%s\n", getpid(), strerror(errno));
+		LOGE("%s\n", strerror(errno));
 		return -1;
 	}
 	/* write the string to the file */
-	dprintf(fd, "%d", value);
+	len = format_integer(buf, value);
+	buf[len++] = '\n';
+	rc = write(fd, buf, len);
 	close(fd);
-	return 0;
+
+	return (rc == len) ? 0 : -1;
 }
 
-/* Reset the maximum frequency on cpu core to the
- * maximum defined in sysfs
+/* Open the temperature, frequency and fan nodes used by the
+ * workers. Must be called after the settings are validated.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int reset_max_freq(int core)
+int open_sysfs_nodes(void)
 {
-	char filename[MAX_BUF_SIZE];
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	struct fan_control *fan;
+	int i, rc = 0;
 
-	/* format the full file name */
-	sprintf(filename, SCALING_DIR, core, "scaling_max_freq");
+	/* map every cpu to the sensor covering its physical core */
+	if (discover_cpu_topology() <= 0) {
+		LOGE("Could not discover the cpu topology.\n");
+		return -1;
+	}
 
-	if (settings.verbose) {
-		LOGI("\t[cpu%d] Resetting speed ceiling to %d.\n",
-				getpid(), core, cpuinfo_max_freq);
+	/* group the cores by the frequency policy they share */
+	if (discover_cpu_policies() <= 0) {
+		LOGE("Could not find any cpufreq policies.\n");
+		rc = -1;
 	}
 
-	/* write the string to the file and return */
-	return write_integer(filename, cpuinfo_max_freq);
-}
+	/* hand the ceilings of these packages over to RAPL */
+	if (settings->rapl_packages[0] && (rapl_open() <= 0)) {
+		LOGW("\tNo RAPL zones found, throttling through scaling_max_freq.\n");
+	}
 
-/* Decrease the maximum frequency on cpu core by step
- *
- * @return: 0 if succesful, -1 otherwise. */
-int decrease_max_freq(int core, int step)
-{
-	char filename[MAX_BUF_SIZE];
-	int freq;
+	/* and those of HWP policies to their energy preferences */
+	if (settings->epp && (epp_open() <= 0)) {
+		LOGW("\tNo energy performance preferences found, throttling through scaling_max_freq.\n");
+	}
 
-	/* format the full file name */
-	sprintf(filename, SCALING_DIR, core, "scaling_max_freq");
+	/* the cooling devices are left alone unless the stage is on */
+	if (settings->idle_injection && (idle_open() <= 0)) {
+		LOGW("\tNo idle injection cooling device found, idle injection is disabled.\n");
+	}
 
-	/* read the current max frequency */
-	freq = read_integer(filename);
+	if ((turbo_open() == -1) && settings->turbo_gating) {
+		LOGW("\tNo turbo switch found, turbo gating is disabled.\n");
+	}
 
-	/* determine the new frequency */
-	freq -= step;
-	if (freq < cpuinfo_min_freq) {
-		freq = cpuinfo_min_freq;
-
-		/* log a message */
-		if (settings.verbose) {
-			LOGI("\t[cpu%d] Setting speed ceiling to %dMHz.\n",
-				getpid(), core, KHZ_TO_MHZ(freq));
-		}
+	/* without it every policy counts as busy */
+	if ((load_open() == -1) && (settings->load_threshold > 0)) {
+		LOGW("\tCpu utilisation is unknown, throttling every policy.\n");
 	}
-	else if (settings.verbose) {
-		LOGI("\t[cpu%d] Decreasing speed ceiling by %dMHz.\n",
-			getpid(), core, KHZ_TO_MHZ(step));
+
+	for (i = 0; i < num_fans; i++) {
+		fan = &fans[i];
+
+		snprintf(filename, sizeof(filename), "%s/pwm%d",
+				fan->hwmon.path, fan->channel);
+		rc |= actuator_open(&fan->pwm, filename);
+
+		snprintf(filename, sizeof(filename), "%s/pwm%d_enable",
+				fan->hwmon.path, fan->channel);
+		rc |= sysfs_node_open(&fan->pwm_enable, filename, O_RDWR);
+
+		/* remember the mode to hand the fan back in */
+		fan->orig_enable = sysfs_node_read(&fan->pwm_enable);
 	}
 
-	/* write the string to the file and return */
-	return write_integer(filename, freq);
+	return rc;
 }
 
-/* Increase the maximum frequency on cpu core by step
- *
- * @return: 0 if succesful, -1 otherwise. */
-int increase_max_freq(int core, int step)
+/* Close every node opened by open_sysfs_nodes. */
+void close_sysfs_nodes(void)
 {
-	char filename[MAX_BUF_SIZE];
-	int freq;
-
-	/* format the full file name */
-	sprintf(filename, SCALING_DIR, core, "scaling_max_freq");
-
-	/* read the current max frequency */
-	freq = read_integer(filename);
+	int i;
 
-	/* determine the new frequency */
-	freq += step;
-	if (freq > settings.cpu_max_freq) {
-		freq = settings.cpu_max_freq;
-
-		/* log a message */
-		if (settings.verbose) {
-			LOGI("\t[cpu%d] Setting speed ceiling to %dMHz.\n",
-				getpid(), core, KHZ_TO_MHZ(freq));
-		}
+	load_close();
+	rapl_close();
+	epp_close();
+	idle_close();
+	turbo_close();
+	free_cpu_policies();
+	free_cpu_topology();
+
+	for (i = 0; i < num_fans; i++) {
+		sysfs_node_close(&fans[i].pwm.node);
+		sysfs_node_close(&fans[i].pwm_enable);
 	}
-	else if (settings.verbose) {
-		LOGI("\t[cpu%d] Increasing speed ceiling by %dMHz.\n",
-			getpid(), core, KHZ_TO_MHZ(step));
+	free_hwmons();
+}
+
+/* Reset the maximum frequency of policy to the
+ * maximum defined in sysfs
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int reset_max_freq(struct cpu_policy *policy)
+{
+	if (settings->verbose) {
+		LOGI("\t[policy%d] Resetting speed ceiling to %d.\n", policy->id, policy->hw_max_freq);
 	}
 
 	/* write the string to the file and return */
-	return write_integer(filename, freq);
+	return actuator_reset(&policy->max_freq, policy->hw_max_freq);
 }
 
-/* Reset the fan speed to the
- * (user defined) minimum fan speed.
+/* Returns the highest entry of the frequency table of policy at or
+ * below freq, or the lowest one at or above it if up is set. Past
+ * either end of the table the nearest end is returned, and freq
+ * itself if the policy has no table. */
+static int snap_freq(const struct cpu_policy *policy, int freq, int up)
+{
+	int lo = 0, hi = policy->num_freqs - 1, mid;
+
+	if (!policy->num_freqs)
+		return freq;
+
+	if (freq <= policy->freqs[lo])
+		return policy->freqs[lo];
+	if (freq >= policy->freqs[hi])
+		return policy->freqs[hi];
+
+	/* freqs[lo] < freq < freqs[hi] */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+
+		if (policy->freqs[mid] == freq)
+			return freq;
+		if (policy->freqs[mid] < freq)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return up ? policy->freqs[hi] : policy->freqs[lo];
+}
+
+/* Returns the highest ceiling policy may be given, the configured
+ * maximum snapped down to its frequency table.
  *
- * @return: 0 if succesful, -1 otherwise. */
-int reset_fan_speed(void)
+ * @return: the ceiling in KHz. */
+int policy_max_freq(const struct cpu_policy *policy)
+{
+	int max_freq, freq;
+
+	/* the configured maximum may be above what this class reaches */
+	max_freq = (settings->cpu_max_freq > policy->hw_max_freq) ?
+		policy->hw_max_freq : settings->cpu_max_freq;
+	freq = snap_freq(policy, max_freq, 0);
+
+	/* the table may start above the configured maximum */
+	return (freq > max_freq) ? max_freq : freq;
+}
+
+/* Returns where freq sits in the frequency range of policy,
+ * from 0 at its minimum to 1 at its maximum. */
+double policy_freq_ratio(const struct cpu_policy *policy, int freq)
 {
-	char file_path[MAX_BUF_SIZE];
-	char filename[MIN_BUF_SIZE];
+	double ratio;
 
-	/* format the full file name */
-	sprintf(filename, "pwm%d",
-			sysfs_fanctrl_hwmon_subnode);
+	if (policy->hw_max_freq <= policy->hw_min_freq)
+		return 1.0;
 
-	sprintf(file_path, FAN_CTRL_DIR,
-			sysfs_fanctrl_hwmon_node, filename);
+	ratio = (double)(freq - policy->hw_min_freq)
+		/ (policy->hw_max_freq - policy->hw_min_freq);
 
-	if (settings.verbose) {
-		LOGI("\t[fan] Resetting fan speed to %d.\n", getpid(),
-				settings.fan_min_speed);
-	}
+	return (ratio < 0) ? 0 : (ratio > 1) ? 1 : ratio;
+}
 
-	/* set the fan speed */
-	return write_integer(file_path, settings.fan_min_speed);
+/* Returns step, given for the widest frequency range of all the
+ * cpus, scaled to the frequency range of policy. */
+int policy_freq_step(const struct cpu_policy *policy, int step)
+{
+	if ((cpuinfo_max_freq <= cpuinfo_min_freq) ||
+			(policy->hw_max_freq <= policy->hw_min_freq))
+		return step;
+
+	return (int)((long long)step * (policy->hw_max_freq - policy->hw_min_freq)
+			/ (cpuinfo_max_freq - cpuinfo_min_freq));
 }
 
-/* Increase the fan speed by step
+/* Decrease the maximum frequency of policy by step, moving at least
+ * one entry down its frequency table if it has one.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int increase_fan_speed(int step)
+int decrease_max_freq(struct cpu_policy *policy, int step)
 {
-	char file_path[MAX_BUF_SIZE];
-	char filename[MIN_BUF_SIZE];
-	int fan_speed;
+	int curr_freq, freq;
 
-	/* format the full file name */
-	sprintf(filename, "pwm%d",
-			sysfs_fanctrl_hwmon_subnode);
+	/* get the current max frequency */
+	if ((curr_freq = actuator_get(&policy->max_freq)) == -1)
+		return -1;
 
-	sprintf(file_path, FAN_CTRL_DIR,
-			sysfs_fanctrl_hwmon_node, filename);
+	/* determine the new frequency */
+	freq = curr_freq - policy_freq_step(policy, step);
+	if (freq < policy->hw_min_freq) {
+		freq = policy->hw_min_freq;
+	}
 
-	/* read the current fan speed */
-	fan_speed = read_integer(file_path);
+	/* land on a frequency the policy can run at, so the
+	 * write changes what it runs at */
+	freq = snap_freq(policy, freq, 0);
+	if (freq >= curr_freq)
+		freq = snap_freq(policy, curr_freq - 1, 0);
+	if (freq > curr_freq)
+		freq = curr_freq;
 
-	/* determine the new fan speed */
-	fan_speed += step;
-	if (fan_speed > fan_hw_max_speed) {
-		fan_speed = fan_hw_max_speed;
+	/* nothing to do if we are already at the floor */
+	if (freq == curr_freq)
+		return 0;
 
-		if (settings.verbose) {
-			LOGI("\t[fan] Setting fan speed to %d.\n",
-				getpid(), fan_speed);
+	/* log a message */
+	if (settings->verbose) {
+		if (freq == policy->hw_min_freq) {
+			LOGI("\t[policy%d] Setting speed ceiling to %dMHz.\n", policy->id, KHZ_TO_MHZ(freq));
+		}
+		else {
+			LOGI("\t[policy%d] Decreasing speed ceiling by %dMHz.\n", policy->id, KHZ_TO_MHZ((curr_freq - freq)));
 		}
 	}
-	else if (settings.verbose) {
-		LOGI("\t[fan] Increasing fan speed by %d.\n",
-			getpid(), step);
-	}
-	/* set the fan speed */
-	return write_integer(file_path, fan_speed);
+
+	/* write the string to the file and return */
+	return actuator_set(&policy->max_freq, freq);
 }
 
-/* Decrease the fan speed by step
+/* Increase the maximum frequency of policy by step, moving at least
+ * one entry up its frequency table if it has one.
  *
  * @return: 0 if succesful, -1 otherwise. */
-int decrease_fan_speed(int step)
+int increase_max_freq(struct cpu_policy *policy, int step)
 {
-	char file_path[MAX_BUF_SIZE];
-	char filename[MIN_BUF_SIZE];
-	int fan_speed;
+	int curr_freq, freq, max_freq = policy_max_freq(policy);
 
-	/* format the full file name */
-	sprintf(filename, "pwm%d", sysfs_fanctrl_hwmon_subnode);
-	sprintf(file_path, FAN_CTRL_DIR,
-			sysfs_fanctrl_hwmon_node, filename);
+	/* get the current max frequency */
+	if ((curr_freq = actuator_get(&policy->max_freq)) == -1)
+		return -1;
 
-	/* read the current fan speed */
-	fan_speed = read_integer(file_path);
+	/* determine the new frequency */
+	freq = curr_freq + policy_freq_step(policy, step);
+	if (freq > max_freq) {
+		freq = max_freq;
+	}
 
-	/* determine the new fan speed */
-	fan_speed -= step;
-	if (fan_speed < settings.fan_min_speed) {
+	/* land on a frequency the policy can run at */
+	freq = snap_freq(policy, freq, 1);
+	if (freq <= curr_freq)
+		freq = snap_freq(policy, curr_freq + 1, 1);
+	if ((freq > max_freq) || (freq < curr_freq))
+		freq = (curr_freq > max_freq) ? max_freq : curr_freq;
 
-		fan_speed = settings.fan_min_speed;
+	/* nothing to do if we are already at the ceiling */
+	if (freq == curr_freq)
+		return 0;
 
-		if (settings.verbose) {
-			LOGI("\t[fan] Setting fan speed to %d.\n",
-				getpid(), fan_speed);
+	/* log a message */
+	if (settings->verbose) {
+		if (freq == max_freq) {
+			LOGI("\t[policy%d] Setting speed ceiling to %dMHz.\n", policy->id, KHZ_TO_MHZ(freq));
+		}
+		else {
+			LOGI("\t[policy%d] Increasing speed ceiling by %dMHz.\n", policy->id, KHZ_TO_MHZ((freq - curr_freq)));
 		}
 	}
-	else if (settings.verbose) {
-		LOGI("\t[fan] Decreasing fan speed by %d.\n",
-			getpid(), step);
-	}
-	/* set the fan speed */
-	return write_integer(file_path, fan_speed);
-}
 
-/* Worker function which does the actual throttling.
- * Is intended to be run as a pthread. */
-void * cpu_worker(void* worker_num) {
+	/* write the string to the file and return */
+	return actuator_set(&policy->max_freq, freq);
+}
 
-	/* buffers for storing file names/paths */
-	char temperature_file_path[MAX_BUF_SIZE];
-	char filename[MIN_BUF_SIZE];
+/* Set the maximum frequency of policy to freq, clamped to
+ * the range between its cpuinfo_min_freq and the configured maximum,
+ * and snapped to the nearest entry of its frequency table.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int set_max_freq(struct cpu_policy *policy, int freq)
+{
+	int max_freq = policy_max_freq(policy), below, above;
 
-	int core = *(int*)worker_num;
-	int curr_temp = 0, prev_temp = 0;
+	if (freq > max_freq) {
+		freq = max_freq;
+	}
+	if (freq < policy->hw_min_freq) {
+		freq = policy->hw_min_freq;
+	}
 
-	/* count the number of intervals spent in hysteresis */
-	int intervals_in_hysteresis = 0;
+	below = snap_freq(policy, freq, 0);
+	above = snap_freq(policy, freq, 1);
+	freq = ((above - freq) < (freq - below)) ? above : below;
 
-	/* Format the temperature reading file. We add two because the
-	 * hwmon files are 1-indexed and the first one is that of the whole die. */
-	sprintf(filename, "temp%d_input", core+2);
-	sprintf(temperature_file_path, CT_HWMON_DIR,
-			sysfs_coretemp_hwmon_node, filename);
+	/* nothing to do if the ceiling is already there */
+	if (freq == actuator_get(&policy->max_freq))
+		return 0;
 
-	/* let's loop forever */
-	while (1) {
-		/* sleep, then run the commands */
-		usleep(settings.polling_interval);
+	if (settings->verbose) {
+		LOGI("\t[policy%d] Setting speed ceiling to %dMHz.\n", policy->id, KHZ_TO_MHZ(freq));
+	}
 
-		/* read the current temp of the core */
-		curr_temp = read_integer(temperature_file_path);
+	/* write the string to the file and return */
+	return actuator_set(&policy->max_freq, freq);
+}
 
-		if (curr_temp == -1) {
-			if (settings.verbose) {
-					LOGE("\t[cpu%d] Could not read "
-						"cpu temperature.\n",
-							getpid(), core);
-			}
-			continue;
-		}
+/* Reset the fan speed to the
+ * (user defined) minimum fan speed.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int reset_fan_speed(void)
+{
+	int i, rc = 0;
 
-		/*case 1: temp is in hysteresis range of target */
-		if ((curr_temp >= hysteresis_lower_limit)
-				&& (curr_temp <= hysteresis_upper_limit)) {
-
-			if (settings.verbose) {
-				LOGI("\t[cpu%d] Current temperature is %dC.\n",
-						getpid(), core, MC_TO_C(curr_temp));
-			}
-
-			/*subcase 1: If temp is between lower and target temp */
-			if (curr_temp <= settings.cpu_target_temperature) {
-				/* adjust the processor speed by a quarter step */
-				increase_max_freq(core, ceil((float)settings.cpu_scaling_step/4.0));
-			}
-			/*subcase 2: If temp is between target temp and upper range */
-			else {
-				/* update the hysteresis counter */
-				intervals_in_hysteresis += 1;
-
-				/* check if we've reached the reset threshold */
-				if (intervals_in_hysteresis == settings.hysteresis_reset_threshold) {
-
-					/* reset the hysteresis counter */
-					intervals_in_hysteresis = 0;
-
-					/* reset the speed to the settings.cpu_max_freq */
-					increase_max_freq(core, cpuinfo_max_freq);
-				}
-			}
+	for (i = 0; i < num_fans; i++) {
+		if (settings->verbose) {
+			LOGI("\t[fan%d] Resetting fan speed to %d.\n",
+					i, fans[i].min_speed);
 		}
-		/*case 2: temp is below the (lower) hysteresis range of target */
-		else if (curr_temp < hysteresis_lower_limit) {
-
-			/* reset hysteresis counter */
-			intervals_in_hysteresis = 0;
 
-			/* increase the processor speed by half a step */
-			increase_max_freq(core, ceil((float)settings.cpu_scaling_step/2.0));
-		}
-		/*case 3: temp is beyond the (upper) hysteresis range of target */
-		else {
-			/* reset hysteresis counter */
-			intervals_in_hysteresis = 0;
-
-			/* check if the temperature has dropped significantly
-			 * since the last time we read the temps .*/
-			int temp_difference = prev_temp - curr_temp;
-
-			/* if our temperature didn't change, decrease the core max frequency */
-			if (temp_difference == 0) {
-				/* adjust the processor speed by a quarter step */
-				decrease_max_freq(core, ceil((float)settings.cpu_scaling_step/4.0));
-			}
-			/* if our current temp is lower than the previous one */
-			else if (temp_difference > 0) {
-				/* decrease the processor speed by half a step */
-				decrease_max_freq(core, ceil((float)settings.cpu_scaling_step/2.0));
-			}
-			/* if our current temp is worse than the previous one */
-			else {
-				/* decrease the processor speed by a step */
-				decrease_max_freq(core, settings.cpu_scaling_step);
-			}
-			prev_temp = curr_temp;
-		}
-		/* break out of the loop if we are signaled to terminate */
-		if (termination_signaled) break;
+		/* set the fan speed */
+		rc |= actuator_reset(&fans[i].pwm, fans[i].min_speed);
 	}
-	return NULL;
+	return rc;
 }
 
-/* Worker function which does the actual throttling.
- * Is intended to be run as a pthread. */
-void * fan_worker(void* worker_num) {
-
-	/* buffers for storing file names */
-	char fanctrl_file_path[MAX_BUF_SIZE];
-	char temperature_file_path[MAX_BUF_SIZE];
-
-	/* general filename buffer. */
-	char filename_buf[MIN_BUF_SIZE];
-
-	int curr_temp = 0, prev_temp = 0;
+/* Move the speed of fan by step, which may be negative,
+ * keeping it within the range allowed for the fan.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int step_fan_speed(int index, int step)
+{
+	struct fan_control *fan = &fans[index];
+	int curr_speed, fan_speed, limit;
 
-	/* Format the temperature reading file. We add two because the
-	 * hwmon files are 1-indexed and the first one is that of the whole die. */
-	sprintf(temperature_file_path, CT_HWMON_DIR,
-			sysfs_coretemp_hwmon_node, "temp1_input");
+	/* get the current fan speed */
+	if ((curr_speed = actuator_get(&fan->pwm)) == -1)
+		return -1;
 
-	if (sysfs_fanctrl_hwmon_subnode != -1) {
-		/* format the full file name */
-		sprintf(filename_buf, "pwm%d_enable",
-				sysfs_fanctrl_hwmon_subnode);
+	/* determine the new fan speed */
+	fan_speed = curr_speed + step;
+	limit = (step > 0) ? fan->hw_max_speed : fan->min_speed;
 
-		sprintf(fanctrl_file_path, FAN_CTRL_DIR,
-				sysfs_fanctrl_hwmon_node, filename_buf);
-		/* enable manual fan control */
-		write_integer(fanctrl_file_path, 1);
-	}
-	else { /* return NULL if theres no fan control. */
-		LOGW("\tNo fan control interface detetected. "
-			"Disabling fan control worker.\n", getpid());
-		return NULL;
+	if (((step > 0) && (fan_speed > limit)) ||
+			((step < 0) && (fan_speed < limit))) {
+		fan_speed = limit;
 	}
 
-	/* let's loop forever */
-	while (1) {
-		/* sleep, then run the commands */
-		usleep(settings.polling_interval);
-
-		/* read the current temp of the core */
-		curr_temp = read_integer(temperature_file_path);
-
-		if (curr_temp == -1) {
-			if (settings.verbose) {
-				LOGE("\tCould not read cpu die temperature.\n",
-						getpid());
-			}
-			continue;
-		}
+	/* nothing to do if the fan is already at its limit */
+	if (fan_speed == curr_speed)
+		return 0;
 
-		/*case 1: temp is in hysteresis range of target */
-		if ((curr_temp >= hysteresis_lower_limit)
-				&& (curr_temp <= hysteresis_upper_limit)) {
-
-			/*subcase 1: If temp is between lower and target temp */
-			if (curr_temp <= settings.cpu_target_temperature) {
-				/* decrease the fan speed by a quarter step */
-				decrease_fan_speed(ceil((float)settings.fan_scaling_step/4.0));
-			}
-			/*subcase 2: If temp is between target temp and upper range */
-			else {
-				/* increase the fan speed by a quarter step */
-				increase_fan_speed(ceil((float)settings.fan_scaling_step/4.0));
-			}
-		}
-		/*case 2: temp is below the (lower) hysteresis range of target */
-		else if (curr_temp < hysteresis_lower_limit) {
-			/* decrease the fan speed by half a step */
-			decrease_fan_speed(ceil((float)settings.fan_scaling_step/2.0));
+	if (settings->verbose) {
+		if (fan_speed == limit) {
+			LOGI("\t[fan%d] Setting fan speed to %d.\n", index, fan_speed);
 		}
-		/*case 3: temp is beyond the (upper) hysteresis range of target */
 		else {
-			/* check if the temperature has dropped significantly
-			 * since the last time we read the temps .*/
-			int temp_difference = prev_temp - curr_temp;
-
-			/* if our temperature didn't change, move it a step */
-			if (temp_difference == 0) {
-				/* inrease the fan speed by a quarter step */
-				increase_fan_speed(ceil((float)settings.fan_scaling_step/4.0));
-			}
-			/* if our current temp is lower than the previous one */
-			else if (temp_difference > 0) {
-				/* increase the fan speed by half a step */
-				increase_fan_speed(ceil((float)settings.fan_scaling_step/2.0));
-			}
-			/* if our current temp is worse than the previous one */
-			else {
-				/* increase the fan speed by a step */
-				increase_fan_speed(settings.fan_scaling_step);
-			}
-			prev_temp = curr_temp;
+			LOGI("\t[fan%d] %s fan speed by %d.\n", index,
+				(step > 0) ? "Increasing" : "Decreasing", abs(step));
 		}
-		/* break out of the loop if we are signaled to terminate */
-		if (termination_signaled) break;
 	}
-	return NULL;
+	/* set the fan speed */
+	return actuator_set(&fan->pwm, fan_speed);
 }
 
-/* Read the configuration specified by the user.
+/* Increase the fan speed by step
  *
  * @return: 0 if succesful, -1 otherwise. */
-int read_configuration_file(void) {
-
-	struct stat stat_buf;
-	int fd;
-	int rc;
+int increase_fan_speed(int step)
+{
+	int i, rc = 0;
 
-	// Do nothing if there's no config file specified.
-	if (config_file_path == NULL) {
-		return 0;
+	for (i = 0; i < num_fans; i++) {
+		rc |= step_fan_speed(i, step);
 	}
-	/* check if the file exists at that path */
-	if (stat(config_file_path, &stat_buf) != -1) {
-
-		// we found the node
-		LOGI("\tFound config file at %s.\n",
-				getpid(), config_file_path);
-
-		/* open the file */
-		if ((fd = open(config_file_path, O_RDONLY)) == -1) {
-			perror("open");
-			LOGE("Failed to open config file %s for reading.\n",
-					getpid(), config_file_path);
-			return fd;
-		}
+	return rc;
+}
 
-		/* write the settings to the file */
-		rc = read(fd, &settings,
-				sizeof(struct throttle_settings));
+/* Decrease the fan speed by step
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+int decrease_fan_speed(int step)
+{
+	int i, rc = 0;
 
-		if (rc == -1) {
-			perror("open");
-			LOGE("Failed to open to config file at %s.\n",
-					getpid(), config_file_path);
-			return rc;
-		}
-		close(fd);
-		return 0;
+	for (i = 0; i < num_fans; i++) {
+		rc |= step_fan_speed(i, -step);
 	}
-
-	return 0;
+	return rc;
 }
 
-/* Read sysfs interfaces and populate the
- * throttle_settings buffer with basic defaults. */
+/* Populate the throttle_settings buffer with basic defaults. */
 void initialise_settings(void) {
 
-	struct stat stat_buf;
-	char filename[MAX_BUF_SIZE];
-
-	int i = 0, max_tries = 10;
-
 	/* initialise global variables */
 	log_file = NULL;
 	config_file_path = NULL;
 	write_config = 0;
+	config_format = CONFIG_BINARY;
+	sysfs_root[0] = '\0';
 
 	/* signal the threads to stop */
 	termination_signaled = 0;
 
-	// initialise the hwmon global variables
-	sysfs_coretemp_hwmon_node = -1;
-	sysfs_fanctrl_hwmon_node = -1;
-	sysfs_fanctrl_hwmon_subnode = -1;
-
-	/* find the hwmon nodes for the core control */
-	for (i = 0; i < max_tries; i++) {
-		// format the filename
-		sprintf(filename, CT_HWMON_DIR, i, "");
-
-		// stat the dir
-		if (stat(filename, &stat_buf) != -1) {
-			// we found the node
-			sysfs_coretemp_hwmon_node = i;
-			break;
-		}
+	/* start from a clean snapshot */
+	free(settings);
+	if (!(settings = calloc(1, sizeof(struct throttle_settings)))) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
 	}
 
-	/* find the hwmon nodes for fan control */
-	for (i = 0; i < max_tries; i++) {
-		// format the filename
-		sprintf(filename, FAN_CTRL_DIR, i, "");
+	// initialise to -1. We will set this later.
+	settings->fan_min_speed = -1;
 
-		// stat the dir
-		if (stat(filename, &stat_buf) != -1) {
-			// we found the node
-			sysfs_fanctrl_hwmon_node = i;
-			break;
-		}
-	}
-	/* find out the naming convention for the pwm files */
-	if (sysfs_fanctrl_hwmon_node != -1) {
-		for (i = 0; i < max_tries; i++) {
-			char fanctrl_file[MIN_BUF_SIZE];
+	/* set the default target freqency to the maximum. We
+	 * will set this later when the limits are known. */
+	settings->cpu_max_freq = -1;
 
-			// format the filename
-			sprintf(fanctrl_file, "pwm%d_enable", i);
-			sprintf(filename, FAN_CTRL_DIR,
-				sysfs_fanctrl_hwmon_node,
-				fanctrl_file);
+	/* set sane defaults for everything */
+	settings->polling_interval = MS_TO_US(500);
+	settings->cpu_scaling_step = MHZ_TO_KHZ(100);
+	settings->cpu_target_temperature = C_TO_MC(55);
+	settings->hysteresis = C_TO_MC(6);
+	settings->hysteresis_reset_threshold = 100;
+	settings->fan_scaling_step = 2;
+	settings->num_cores = 1;
+
+	/* keep the ladder unless asked otherwise */
+	settings->controller = CONTROLLER_LEGACY;
+	settings->pid_kp = MHZ_TO_KHZ(100);
+	settings->pid_ki = MHZ_TO_KHZ(25);
+	settings->pid_kd = MHZ_TO_KHZ(20);
+
+	/* log everything the verbosity asks for */
+	settings->log_level = LOG_LEVEL_INFO;
 
-			// stat the file
-			if (stat(filename, &stat_buf) != -1) {
-				// set the fan control global variable.
-				sysfs_fanctrl_hwmon_subnode = i;
-				break;
-			}
-		}
-	}
+	/* disable logging by default */
+	settings->verbose = 0;
+	settings->logging_enabled = 0;
 
-	/* read and set the fan speeds */
-	if (sysfs_fanctrl_hwmon_subnode != -1) {
-		char general_buf[MIN_BUF_SIZE];
+	/* no telemetry unless asked for */
+	settings->telemetry_path[0] = '\0';
+	settings->metrics_path[0] = '\0';
+	settings->control_path[0] = '\0';
+	settings->rapl_packages[0] = '\0';
 
-		sprintf(general_buf, "fan%d_speed_max",
-				sysfs_fanctrl_hwmon_subnode);
-		sprintf(filename, FAN_CTRL_DIR,
-				sysfs_fanctrl_hwmon_node, general_buf);
-		fan_hw_max_speed = read_integer(filename);
+	/* react to the measured temperature unless asked otherwise */
+	settings->predict_horizon = 0;
+	settings->predict_alpha = 50;
+	settings->predict_beta = 30;
 
-		sprintf(general_buf, "fan%d_min",
-				sysfs_fanctrl_hwmon_subnode);
-		sprintf(filename, FAN_CTRL_DIR,
-				sysfs_fanctrl_hwmon_node, general_buf);
-		fan_hw_min_speed = read_integer(filename);
-	}
+	/* move every ceiling whatever the load */
+	settings->load_threshold = 0;
 
-	/* get the cpuinfo scaling limits */
-	sprintf(filename, SCALING_DIR, 0, "cpuinfo_min_freq");
-	cpuinfo_min_freq = read_integer(filename);
-	sprintf(filename, SCALING_DIR, 0, "cpuinfo_max_freq");
-	cpuinfo_max_freq = read_integer(filename);
+	/* leave turbo alone unless asked, and give it a few
+	 * degrees below the band before turning it back on */
+	settings->turbo_gating = 0;
+	settings->turbo_off_offset = C_TO_MC(0);
+	settings->turbo_on_margin = C_TO_MC(3);
 
-	// initialise to -1. We will set this later.
-	settings.fan_min_speed = -1;
+	/* clamp scaling_max_freq even on HWP systems */
+	settings->epp = 0;
 
-	/* set the default target freqency to the maximum */
-	settings.cpu_max_freq = cpuinfo_max_freq;
+	/* stop at the frequency floor */
+	settings->idle_injection = 0;
 
-	/* set sane defaults for everything */
-	settings.polling_interval = MS_TO_US(500);
-	settings.cpu_scaling_step = MHZ_TO_KHZ(100);
-	settings.cpu_target_temperature = C_TO_MC(55);
-	settings.hysteresis = C_TO_MC(6);
-	settings.hysteresis_reset_threshold = 100;
-	settings.fan_scaling_step = 2;
-	settings.num_cores = 1;
+	/* poll even while cool */
+	settings->event_wakeups = 0;
 
-	/* disable logging by default */
-	settings.verbose = 0;
-	settings.logging_enabled = 0;
+	/* keep the polling interval fixed */
+	settings->max_polling_interval = 0;
+
+	/* treat every cpu class alike */
+	settings->throttle_first = THROTTLE_FIRST_NONE;
 }
 
-/* Write to the configuration specified by the user.
- *
- * @return: 0 if succesful, -1 otherwise. */
-int write_configuration_file()
-{
-	int fd;
-	int rc;
+/* Find the hwmon devices and read the cpu scaling limits
+ * below sysfs_root. The limits span every cpu, since the cpu
+ * classes of a hybrid part each have their own range. Must be
+ * called after the command line is parsed. */
+void initialise_hardware(void) {
 
-	// Do nothing if no config was specified.
-	if (config_file_path == NULL) {
-		return 0;
-	}
+	char filename[MAX_BUF_SIZE];
+	int cpu, freq;
 
-	/* open the file */
-	if ((fd = open(config_file_path, O_CREAT|O_TRUNC|O_WRONLY,
-				S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1) {
-		perror("open");
-		LOGE("Failed to open config file %s for writing.\n",
-				getpid(), config_file_path);
-		return fd;
-	}
+	/* find the temperature and fan control hwmon devices */
+	discover_hwmons();
+
+	/* get the cpuinfo scaling limits */
+	sysfs_path(filename, sizeof(filename),
+			SCALING_DIR, 0, "cpuinfo_min_freq");
+	cpuinfo_min_freq = read_integer(filename);
+	sysfs_path(filename, sizeof(filename),
+			SCALING_DIR, 0, "cpuinfo_max_freq");
+	cpuinfo_max_freq = read_integer(filename);
+
+	/* widen them to the other cpus, which may be offline */
+	for (cpu = 1; cpu < MAX_CPUS; cpu++) {
+		sysfs_path(filename, sizeof(filename),
+				SCALING_DIR, cpu, "cpuinfo_max_freq");
+		if (access(filename, R_OK))
+			continue;
 
-	/* write the settings to the file */
-	rc = write(fd, &settings,
-			sizeof(struct throttle_settings));
+		if ((freq = read_integer(filename)) > cpuinfo_max_freq)
+			cpuinfo_max_freq = freq;
 
-	if (rc == -1) {
-		perror("write");
-		LOGE("Failed to write to config file at %s.\n",
-				getpid(), config_file_path);
-		return rc;
+		sysfs_path(filename, sizeof(filename),
+				SCALING_DIR, cpu, "cpuinfo_min_freq");
+		if (((freq = read_integer(filename)) != -1) &&
+				((cpuinfo_min_freq == -1) || (freq < cpuinfo_min_freq)))
+			cpuinfo_min_freq = freq;
 	}
-
-	close(fd);
-	return 0;
 }
 
 /* Helper function to parse command line arguments from main */
@@ -674,14 +609,37 @@ void parse_commmand_line(int argc, char *argv[]) {
 		{"minimum-fan-speed",	required_argument,	   0, 'e' },
 		{"config",	required_argument,	   0, 'o' },
 		{"cores",	required_argument,	   0, 'c' },
+		{"sysfs-root",	required_argument,	   0, 'R' },
+		{"controller",	required_argument,	   0, 'm' },
+		{"pid-kp",	required_argument,	   0, 'P' },
+		{"pid-ki",	required_argument,	   0, 'I' },
+		{"pid-kd",	required_argument,	   0, 'D' },
+		{"log-level",	required_argument,	   0, 'L' },
+		{"telemetry",	required_argument,	   0, 'T' },
+		{"metrics-socket",	required_argument,	   0, 'M' },
+		{"control-socket",	required_argument,	   0, 'C' },
 		{"write-config",	no_argument,	   0, 'w' },
+		{"config-format",	required_argument,	   0, 'F' },
+		{"predict-horizon",	required_argument,	   0, 'H' },
+		{"predict-alpha",	required_argument,	   0, 'A' },
+		{"predict-beta",	required_argument,	   0, 'B' },
+		{"load-threshold",	required_argument,	   0, 'U' },
+		{"rapl",	required_argument,	   0, 'p' },
+		{"turbo-gating",	no_argument,	   0, 'g' },
+		{"turbo-off",	required_argument,	   0, 'O' },
+		{"turbo-on",	required_argument,	   0, 'N' },
+		{"epp",	no_argument,	   0, 'E' },
+		{"idle-injection",	no_argument,	   0, 'j' },
+		{"event-wakeups",	no_argument,	   0, 'W' },
+		{"max-interval",	required_argument,	   0, 'X' },
+		{"throttle-first",	required_argument,	   0, 'Y' },
 		{"help",	no_argument,	   0, 'h' },
 		{"verbose",	no_argument,	   0, 'v' },
 		{0,		 0,				 0,  0 }
 	};
 
 	/* read in the command line args if anything was passed */
-	while ( (opt = getopt_long(argc, argv, "i:f:s:a:c:t:l:o:r:e:u:hvw",
+	while ( (opt = getopt_long(argc, argv, "i:f:s:a:c:t:l:o:r:e:u:R:m:P:I:D:L:T:M:C:F:H:A:B:U:p:O:N:X:Y:EgjWhvw",
 					long_options, &optind)) != -1 ) {
 		switch (opt) {
 			case 'o':
@@ -691,39 +649,127 @@ void parse_commmand_line(int argc, char *argv[]) {
 			case 'w':
 				write_config=1;
 				break;
+			case 'F':
+				if (!strcmp(optarg, "text")) {
+					config_format = CONFIG_TEXT;
+				}
+				else if (!strcmp(optarg, "binary")) {
+					config_format = CONFIG_BINARY;
+				}
+				else {
+					fprintf(stderr, "Unknown config format %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'H':
+				settings->predict_horizon=atoi(optarg);
+				break;
+			case 'A':
+				settings->predict_alpha=atoi(optarg);
+				break;
+			case 'B':
+				settings->predict_beta=atoi(optarg);
+				break;
+			case 'g':
+				settings->turbo_gating = 1;
+				break;
+			case 'O':
+				settings->turbo_off_offset=C_TO_MC(atoi(optarg));
+				break;
+			case 'N':
+				settings->turbo_on_margin=C_TO_MC(atoi(optarg));
+				break;
+			case 'E':
+				settings->epp = 1;
+				break;
+			case 'j':
+				settings->idle_injection = 1;
+				break;
+			case 'W':
+				settings->event_wakeups = 1;
+				break;
+			case 'X':
+				settings->max_polling_interval=MS_TO_US(atoi(optarg));
+				break;
+			case 'Y':
+				if ((settings->throttle_first = throttle_first_lookup(optarg)) == -1) {
+					fprintf(stderr, "Unknown cpu class %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				strncpy(settings->rapl_packages, optarg, MAX_BUF_SIZE - 1);
+				break;
+			case 'U':
+				settings->load_threshold=atoi(optarg);
+				break;
 			case 'u':
-				settings.hysteresis_reset_threshold=atoi(optarg);
+				settings->hysteresis_reset_threshold=atoi(optarg);
 				break;
 			case 'a':
-				settings.fan_scaling_step=atoi(optarg);
+				settings->fan_scaling_step=atoi(optarg);
 				break;
 			case 'e':
-				settings.fan_min_speed=atoi(optarg);
+				settings->fan_min_speed=atoi(optarg);
 				break;
 			case 'r':
-				settings.hysteresis=C_TO_MC(atoi(optarg));
+				settings->hysteresis=C_TO_MC(atoi(optarg));
 				break;
 			case 'i':
-				settings.polling_interval=MS_TO_US(atoi(optarg));
+				settings->polling_interval=MS_TO_US(atoi(optarg));
 				break;
 			case 'f':
-				settings.cpu_max_freq=MHZ_TO_KHZ(atoi(optarg));
+				settings->cpu_max_freq=MHZ_TO_KHZ(atoi(optarg));
 				break;
 			case 's':
-				settings.cpu_scaling_step=MHZ_TO_KHZ(atoi(optarg));
+				settings->cpu_scaling_step=MHZ_TO_KHZ(atoi(optarg));
 				break;
 			case 't':
-				settings.cpu_target_temperature=C_TO_MC(atoi(optarg));
+				settings->cpu_target_temperature=C_TO_MC(atoi(optarg));
 				break;
 			case 'v':
-				settings.verbose = 1;
+				settings->verbose = 1;
+				break;
+			case 'M':
+				strncpy(settings->metrics_path, optarg, MAX_BUF_SIZE - 1);
+				break;
+			case 'C':
+				strncpy(settings->control_path, optarg, MAX_BUF_SIZE - 1);
+				break;
+			case 'T':
+				strncpy(settings->telemetry_path, optarg, MAX_BUF_SIZE - 1);
+				break;
+			case 'L':
+				if ((settings->log_level = log_level_lookup(optarg)) == -1) {
+					fprintf(stderr, "Unknown log level %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
 				break;
 			case 'l':
-				strncpy(settings.log_path, optarg, MAX_BUF_SIZE);
-				settings.logging_enabled = 1;
+				strncpy(settings->log_path, optarg, MAX_BUF_SIZE);
+				settings->logging_enabled = 1;
 				break;
 			case 'c':
-				settings.num_cores = atoi(optarg);
+				fprintf(stderr, "--cores is ignored, cpus are "
+						"discovered automatically.\n");
+				break;
+			case 'R':
+				strncpy(sysfs_root, optarg, MAX_BUF_SIZE - 1);
+				break;
+			case 'm':
+				if ((settings->controller = controller_lookup(optarg)) == -1) {
+					fprintf(stderr, "Unknown controller %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'P':
+				settings->pid_kp=atof(optarg) * MHZ_TO_KHZ(1);
+				break;
+			case 'I':
+				settings->pid_ki=atof(optarg) * MHZ_TO_KHZ(1);
+				break;
+			case 'D':
+				settings->pid_kd=atof(optarg) * MHZ_TO_KHZ(1);
 				break;
 			case 'h':
 			case '?': // case in which the argument is not recognised.
@@ -739,10 +785,32 @@ void parse_commmand_line(int argc, char *argv[]) {
 				fprintf (stderr, "  -r, --hysteresis\t Hysteresis deviation range in degrees.\n");
 				fprintf (stderr, "  -u, --reset-threshold\t Number of intervals spent consecutively\n"
 						"\t\t\t in hysteresis before fan speed and cpu clock are reset.\n");
-				fprintf (stderr, "  -o, --config\t\t Path to read/write binary config.\n" );
+				fprintf (stderr, "  -m, --controller\t Control law, legacy or pid.\n" );
+				fprintf (stderr, "  -P, --pid-kp\t\t Proportional gain, in MHz per degree.\n" );
+				fprintf (stderr, "  -I, --pid-ki\t\t Integral gain, in MHz per degree-second.\n" );
+				fprintf (stderr, "  -D, --pid-kd\t\t Derivative gain, in MHz per degree/second.\n" );
+				fprintf (stderr, "  -H, --predict-horizon\t Act on the temperature predicted this many intervals ahead, 0 to disable.\n" );
+				fprintf (stderr, "  -A, --predict-alpha\t Weight of a new sample in the prediction filter, in percent.\n" );
+				fprintf (stderr, "  -B, --predict-beta\t Weight of a new slope in the prediction filter, in percent.\n" );
+				fprintf (stderr, "  -U, --load-threshold\t Only move the ceiling of policies at least this busy, in percent.\n" );
+				fprintf (stderr, "  -p, --rapl\t\t Packages to cap through RAPL power limits, e.g. 0-1.\n" );
+				fprintf (stderr, "  -g, --turbo-gating\t Turn turbo off before cutting any frequency ceiling.\n" );
+				fprintf (stderr, "  -O, --turbo-off\t Degrees above the target at which turbo is turned off.\n" );
+				fprintf (stderr, "  -N, --turbo-on\t Degrees below the hysteresis range at which turbo is turned back on.\n" );
+				fprintf (stderr, "  -E, --epp\t\t Throttle HWP policies through their energy performance preference.\n" );
+				fprintf (stderr, "  -j, --idle-injection\t Inject idle time once every ceiling is at the minimum frequency.\n" );
+				fprintf (stderr, "  -W, --event-wakeups\t Stop polling while cool, and sleep until a temperature alarm fires.\n" );
+				fprintf (stderr, "  -X, --max-interval\t Longest polling interval in ms while the temperature is stable, 0 to keep it fixed.\n" );
+				fprintf (stderr, "  -Y, --throttle-first\t Cpu class throttled first on hybrid parts: none, e-cores or p-cores.\n" );
+				fprintf (stderr, "  -o, --config\t\t Path to read/write config.\n" );
 				fprintf (stderr, "  -w, --write-config\t\t Just save the new configuration and exit.\n" );
-				fprintf (stderr, "  -c, --cores\t\t Number of (physical) cores on the system.\n" );
+				fprintf (stderr, "  -F, --config-format\t Format the config is saved in: binary or text.\n" );
+				fprintf (stderr, "  -R, --sysfs-root\t Prefix for sysfs paths, for testing.\n" );
 				fprintf (stderr, "  -l, --log\t\t Path to log file.\n" );
+				fprintf (stderr, "  -T, --telemetry\t File to publish per-tick telemetry to, e.g. " TELEMETRY_PATH ".\n" );
+				fprintf (stderr, "  -M, --metrics-socket\t Unix socket to serve Prometheus metrics on.\n" );
+				fprintf (stderr, "  -C, --control-socket\t Unix socket accepting settings changes at runtime.\n" );
+				fprintf (stderr, "  -L, --log-level\t Most verbose messages logged: error, warn or info.\n" );
 				fprintf (stderr, "  -v, --verbose\t\t Print detailed throttling information.\n");
 				fprintf (stderr, "  -h, --help\t\t Print this message.\n");
 				exit (EXIT_FAILURE);
@@ -750,98 +818,208 @@ void parse_commmand_line(int argc, char *argv[]) {
 	}
 }
 
+/* Clamp the values in candidate to what the hardware and
+ * the controllers can work with. */
+void sanitise_settings(struct throttle_settings *candidate) {
+
+	// make sure an illegal target frequency wasn't specified.
+	if ((candidate->cpu_max_freq > cpuinfo_max_freq) ||
+			(candidate->cpu_max_freq <= 0)) {
+		candidate->cpu_max_freq = cpuinfo_max_freq;
+	}
+
+	/* the timer cannot run without an interval */
+	if (candidate->polling_interval <= 0)
+		candidate->polling_interval = MS_TO_US(500);
+
+	if (candidate->max_polling_interval < 0)
+		candidate->max_polling_interval = 0;
+
+	if (candidate->hysteresis < 0)
+		candidate->hysteresis = 0;
+
+	/* negative gains would push the ceiling the wrong way */
+	if (candidate->pid_kp < 0)
+		candidate->pid_kp = 0;
+	if (candidate->pid_ki < 0)
+		candidate->pid_ki = 0;
+	if (candidate->pid_kd < 0)
+		candidate->pid_kd = 0;
+
+	if ((candidate->log_level < LOG_LEVEL_ERROR) ||
+			(candidate->log_level > LOG_LEVEL_INFO)) {
+		candidate->log_level = LOG_LEVEL_INFO;
+	}
+
+	if ((candidate->throttle_first < THROTTLE_FIRST_NONE) ||
+			(candidate->throttle_first >= NUM_THROTTLE_FIRST)) {
+		candidate->throttle_first = THROTTLE_FIRST_NONE;
+	}
+
+	if (candidate->predict_horizon < 0)
+		candidate->predict_horizon = 0;
+	else if (candidate->predict_horizon > PREDICT_MAX_HORIZON)
+		candidate->predict_horizon = PREDICT_MAX_HORIZON;
+
+	/* a zero alpha would never follow the sensor */
+	if ((candidate->predict_alpha <= 0) || (candidate->predict_alpha > 100))
+		candidate->predict_alpha = 50;
+	if ((candidate->predict_beta < 0) || (candidate->predict_beta > 100))
+		candidate->predict_beta = 30;
+
+	if (candidate->load_threshold < 0)
+		candidate->load_threshold = 0;
+	else if (candidate->load_threshold > 100)
+		candidate->load_threshold = 100;
+
+	if (candidate->turbo_on_margin < 0)
+		candidate->turbo_on_margin = 0;
+
+	if ((candidate->controller < 0) ||
+			(candidate->controller >= NUM_CONTROLLERS)) {
+		candidate->controller = CONTROLLER_LEGACY;
+	}
+
+	terminate_settings(candidate);
+}
+
+/* Terminate the string fields of candidate, which may have been
+ * loaded from a raw dump. Needs no hardware information. */
+void terminate_settings(struct throttle_settings *candidate) {
+
+	candidate->log_path[MAX_BUF_SIZE - 1] = '\0';
+	candidate->telemetry_path[MAX_BUF_SIZE - 1] = '\0';
+	candidate->metrics_path[MAX_BUF_SIZE - 1] = '\0';
+	candidate->control_path[MAX_BUF_SIZE - 1] = '\0';
+	candidate->rapl_packages[MAX_BUF_SIZE - 1] = '\0';
+}
+
+/* Make a private copy of the current settings, to be
+ * changed and handed to publish_settings.
+ *
+ * @return: the copy, NULL if out of memory. */
+struct throttle_settings *copy_settings(void) {
+
+	struct throttle_settings *copy;
+
+	if ((copy = malloc(sizeof(struct throttle_settings))))
+		memcpy(copy, settings, sizeof(struct throttle_settings));
+
+	return copy;
+}
+
+/* Validate candidate and make it the current settings with a
+ * single pointer swap, so a tick never sees half an update. The
+ * state derived from the settings is recomputed straight after.
+ * Takes ownership of candidate. */
+void publish_settings(struct throttle_settings *candidate) {
+
+	struct throttle_settings *old = settings;
+
+	sanitise_settings(candidate);
+	__atomic_store_n(&settings, candidate, __ATOMIC_RELEASE);
+
+	/* the loop is the only reader, nothing can still hold old */
+	free(old);
+
+	validate_settings();
+}
+
 /* Verifies taht settings input are valid */
 void validate_settings(void) {
 
+	struct fan_control *fan;
+	int i;
+
+	sanitise_settings(settings);
+
 	/* calculate the hysteresis range */
 	hysteresis_upper_limit =
-		settings.cpu_target_temperature + settings.hysteresis;
+		settings->cpu_target_temperature + settings->hysteresis;
 	hysteresis_lower_limit =
-		settings.cpu_target_temperature - settings.hysteresis;
-
-	// make sure an illegal target frequency wasn't specified.
-	if (settings.cpu_max_freq > cpuinfo_max_freq ) {
-		settings.cpu_max_freq = cpuinfo_max_freq;
-	}
+		settings->cpu_target_temperature - settings->hysteresis;
 
-	/* set the target speed to the hardware minimum if
-	 * not already set. */
-	if (settings.fan_min_speed == -1) {
-		settings.fan_min_speed = fan_hw_min_speed;
-	}
+	/* falls back to the ladder if the mode is unknown */
+	controller_select(settings->controller);
 
-	/* check if the sysfs core temperature node exist */
-	if (sysfs_coretemp_hwmon_node == -1) {
-		LOGE("\tCould not find core temp hwmon directory.\n", getpid());
+	/* check if the sysfs core temperature nodes exist */
+	if (num_temp_hwmons <= 0) {
+		LOGE("\tCould not find core temp hwmon directory.\n");
 		exit(EXIT_FAILURE);
 	}
 
 	/* check if we read the cpu scaling limits properly */
 	if ((cpuinfo_min_freq == -1) || (cpuinfo_min_freq == -1)) {
-		LOGE("\tCould not read cpu scaling limits.\n", getpid());
+		LOGE("\tCould not read cpu scaling limits.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if (sysfs_fanctrl_hwmon_subnode != -1) {
+	for (i = 0; i < num_fans; i++) {
+		fan = &fans[i];
+
+		/* use the hardware minimum if not set */
+		fan->min_speed = (settings->fan_min_speed == -1) ?
+			fan->hw_min_speed : settings->fan_min_speed;
+
 		// make sure an illegal target fan speed wasn't specified.
-		if (settings.fan_min_speed > fan_hw_max_speed) {
-			settings.fan_min_speed = fan_hw_max_speed;
+		if (fan->min_speed > fan->hw_max_speed) {
+			fan->min_speed = fan->hw_max_speed;
 		}
-		else if (settings.fan_min_speed < fan_hw_min_speed) {
-			settings.fan_min_speed = fan_hw_min_speed;
+		else if (fan->min_speed < fan->hw_min_speed) {
+			fan->min_speed = fan->hw_min_speed;
 		}
 	}
 }
 
-/* Signal handler function to handle termination
- * signals and reset hardware settings to original. */
+/* Handle a termination or reload signal delivered through the
+ * event loop, resetting hardware settings to original on exit. */
 void handler(int signal) {
 
-	char filename[MIN_BUF_SIZE];
+	struct throttle_settings *candidate;
 	int i;
 
 	if ((signal == SIGTERM) || (signal == SIGINT)) {
-		LOGI("Termination signal received. Winding up...\n", getpid());
+		LOGI("Termination signal received. Winding up...\n");
 
-		/* signal the threads to stop */
+		/* signal the event loop to stop */
 		termination_signaled = 1;
 
-		/* give them time to come to a halt */
-		usleep(settings.polling_interval);
-
-		if (sysfs_fanctrl_hwmon_subnode != -1) {
-
-			char fanctrl_file_path[MAX_BUF_SIZE];
-
-			/* format the full file name */
-			sprintf(filename, "pwm%d_enable",
-					sysfs_fanctrl_hwmon_subnode);
-
-			sprintf(fanctrl_file_path, FAN_CTRL_DIR,
-					sysfs_fanctrl_hwmon_node, filename);
-
-			/* disable manual fan control */
-			LOGI("[fan] Enabling automatic fan control...\n", getpid());
-			write_integer(fanctrl_file_path, 0);
+		for (i = 0; i < num_fans; i++) {
+			/* hand the fan back in the mode we found it in */
+			LOGI("[fan%d] Enabling automatic fan control...\n", i);
+			sysfs_node_write(&fans[i].pwm_enable,
+				(fans[i].orig_enable == -1) ? 0 : fans[i].orig_enable);
 		}
 
 		/* reset the cpu maximum frequency */
-		for (i = 0; i < settings.num_cores; i++) {
+		for (i = 0; i < num_policies; i++) {
 
-			LOGI("[cpu%d] Resetting maximum frequency...\n",
-					getpid(), i);
+			LOGI("[policy%d] Resetting maximum frequency...\n", cpu_policies[i].id);
 
-			reset_max_freq(i);
+			reset_max_freq(&cpu_policies[i]);
 		}
+
+		/* hand the power limits, preferences, idle time and turbo back */
+		rapl_restore();
+		epp_restore();
+		idle_restore();
+		turbo_restore();
 	}
 	else if (signal == SIGHUP) {
-		LOGI("Reloading configuration...\n", getpid());
+		LOGI("Reloading configuration...\n");
 
-		/* read a configuration file if one was passed */
-		read_configuration_file();
+		/* read into a copy, the running settings stay
+		 * untouched if the file cannot be read */
+		if (!(candidate = copy_settings()))
+			return;
+
+		if (read_configuration_file(candidate) == -1) {
+			free(candidate);
+			return;
+		}
 
-		/* validate the settings read */
-		validate_settings();
+		/* validate the settings read and switch to them */
+		publish_settings(candidate);
 	}
 }
 
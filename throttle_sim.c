@@ -0,0 +1,487 @@
+/**
+* throttle_sim.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+/* Closed-loop simulator. Builds a sysfs-shaped tree in a temporary
+ * directory, runs a thermal model of every package against it and
+ * drives the real control engine one tick at a time on a virtual
+ * clock, so hours of control run in seconds. */
+
+#include <getopt.h>
+#include <math.h>
+#include "fake_sysfs.h"
+
+/* power drawn by a package, in W. The dynamic part is spread
+ * over the cpus and scales with load and the cube of frequency. */
+#define SIM_IDLE_POWER 3.0
+#define SIM_PACKAGE_POWER 45.0
+
+/* thermal resistance to ambient of a package with the fan
+ * stopped in K/W, how much a fan at full speed divides it by,
+ * and the heat capacity of a package in J/K */
+#define SIM_RESISTANCE 1.2
+#define SIM_FAN_GAIN 2.0
+#define SIM_CAPACITY 40.0
+
+/* resistance between a core and its package, in K/W */
+#define SIM_CORE_RESISTANCE 0.5
+
+/* share of SIM_PACKAGE_POWER drawn by a package of
+ * efficiency cores at their top frequency */
+#define SIM_EFFICIENCY_POWER 0.35
+
+/* Share of the top frequency HWP settles at under load for every
+ * energy performance preference. */
+static const struct {
+	const char *name;
+	double share;
+} sim_epp_shares[] = {
+	{ "performance", 1.0 },
+	{ "balance_performance", 1.0 },
+	{ "balance_power", 0.85 },
+	{ "power", 0.65 },
+};
+
+/* options of the simulated run */
+static int sim_cpus = 8;
+static int sim_packages = 1;
+static int sim_duration = 3600;
+static int sim_interval = 500;
+static int sim_max_interval;
+static int sim_ambient = 25;
+static int sim_target = 55;
+static int sim_burst_period = 600;
+static double sim_load = 1.0;
+static int sim_horizon;
+static int sim_load_threshold;
+static int sim_rapl;
+static int sim_turbo_gating;
+static int sim_epp;
+static int sim_idle_injection;
+static int sim_throttle_first = -1;
+static int sim_verbose;
+
+/* figures gathered over one simulated run */
+struct sim_result {
+	double seconds_above_target;
+	double freq_sum;
+	double max_temp;
+	double freq_time;
+	long ticks;
+	unsigned long writes;
+	unsigned long reads;
+};
+
+/* die temperature of every package, in degrees */
+static double *package_temps;
+
+/* Load on every cpu at time t, in seconds. With bursts enabled the
+ * load drops to a quarter for the second half of every period. */
+static double sim_load_at(double t)
+{
+	if ((sim_burst_period <= 0) ||
+			(((long)t % sim_burst_period) < (sim_burst_period / 2)))
+		return sim_load;
+
+	return sim_load / 4.0;
+}
+
+/* Share of the top frequency policy is allowed by its energy
+ * performance preference. */
+static double sim_epp_share(int policy)
+{
+	char buf[MIN_BUF_SIZE];
+	FILE *file;
+	size_t i;
+
+	if (!(file = fopen(fake_epp_paths[policy], "r")))
+		return 1.0;
+
+	buf[0] = '\0';
+	if (fgets(buf, sizeof(buf), file))
+		buf[strcspn(buf, "\n")] = '\0';
+	fclose(file);
+
+	for (i = 0; i < sizeof(sim_epp_shares) / sizeof(sim_epp_shares[0]); i++) {
+		if (!strcmp(buf, sim_epp_shares[i].name))
+			return sim_epp_shares[i].share;
+	}
+	return 1.0;
+}
+
+/* Advance the thermal model by dt seconds at time t using the
+ * ceilings and fan speed the engine left behind, and publish
+ * the new temperatures to the tree. */
+static void sim_step(double t, double dt, struct sim_result *result)
+{
+	double load, ratio, cpu_power, power, resistance, temp, limit;
+	int cpus_per_package = sim_cpus / sim_packages;
+	int pkg, core, freq, max_freq, pwm, limit_uw, perf_pct, idle;
+	double package_power;
+
+	load = sim_load_at(t);
+
+	/* powerclamp forces its state in percent of idle time */
+	if ((idle = read_integer(fake_idle_path)) > 0)
+		load *= 1.0 - (idle / 100.0);
+	fake_sysfs_load(load, dt);
+
+	/* the fan is the same for every package */
+	if ((pwm = read_integer(fake_fan_path)) < 0)
+		pwm = PWM_MIN;
+	resistance = SIM_RESISTANCE / (1.0 + (SIM_FAN_GAIN * pwm / PWM_MAX));
+
+	for (pkg = 0; pkg < sim_packages; pkg++) {
+		max_freq = fake_package_max_freq(pkg);
+		package_power = (max_freq < FAKE_MAX_FREQ) ?
+			SIM_EFFICIENCY_POWER * SIM_PACKAGE_POWER : SIM_PACKAGE_POWER;
+
+		if ((freq = read_integer(fake_policy_paths[pkg])) <= 0)
+			freq = max_freq;
+
+		/* the cpus only run at whole P-states */
+		freq -= (freq - FAKE_MIN_FREQ) % INTEL_PSTATE_STEP;
+
+		/* HWP picks the clock from the preference, below
+		 * the global performance limit */
+		if (freq > sim_epp_share(pkg) * max_freq)
+			freq = sim_epp_share(pkg) * max_freq;
+
+		perf_pct = read_integer(fake_max_perf_path);
+		if ((perf_pct > 0) && (freq > FAKE_MAX_FREQ / 100 * perf_pct))
+			freq = FAKE_MAX_FREQ / 100 * perf_pct;
+
+		/* without turbo the cpus stop at the base clock */
+		if ((read_integer(fake_no_turbo_path) == 1) && (freq > FAKE_BASE_FREQ))
+			freq = FAKE_BASE_FREQ;
+
+		ratio = (double)freq / max_freq;
+		cpu_power = load * ratio * ratio * ratio
+			* package_power / cpus_per_package;
+		power = SIM_IDLE_POWER + (cpu_power * cpus_per_package);
+
+		/* the firmware lowers the clock until the package
+		 * fits in its power limit */
+		limit_uw = read_integer(fake_packages[pkg].rapl_path);
+		limit = (limit_uw > 0) ? limit_uw / 1e6 : power;
+
+		if ((power > limit) && (load > 0)) {
+			cpu_power = (limit > SIM_IDLE_POWER) ?
+				(limit - SIM_IDLE_POWER) / cpus_per_package : 0.0;
+			ratio = cbrt(cpu_power * cpus_per_package
+					/ (load * package_power));
+			freq = ratio * max_freq;
+			power = limit;
+		}
+
+		/* first order model: heat in minus heat lost to ambient */
+		package_temps[pkg] += dt * (power - ((package_temps[pkg]
+				- sim_ambient) / resistance)) / SIM_CAPACITY;
+
+		write_integer(fake_packages[pkg].temp_paths[0],
+				(int)C_TO_MC(package_temps[pkg]));
+
+		/* every core runs a little hotter than its package */
+		temp = package_temps[pkg] + (cpu_power * SIM_CORE_RESISTANCE);
+		for (core = 1; core <= cpus_per_package; core++) {
+			write_integer(fake_packages[pkg].temp_paths[core],
+					(int)C_TO_MC(temp));
+		}
+
+		if (temp > sim_target)
+			result->seconds_above_target += dt / sim_packages;
+		if (temp > result->max_temp)
+			result->max_temp = temp;
+
+		/* weighted by time, as the interval may adapt */
+		result->freq_sum += freq * dt;
+		result->freq_time += dt;
+	}
+}
+
+/* Run the engine with controller mode against a fresh tree
+ * for sim_duration seconds of virtual time.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int sim_run(int mode, struct sim_result *result,
+		int kp, int ki, int kd)
+{
+	double t, dt = sim_interval / 1000.0;
+	unsigned long reads, writes;
+	int i, rc = 0;
+
+	memset(result, 0, sizeof(*result));
+
+	initialise_settings();
+	log_file = sim_verbose ? stderr : fopen("/dev/null", "w");
+
+	settings->verbose = sim_verbose;
+	settings->polling_interval = MS_TO_US(sim_interval);
+	settings->max_polling_interval = MS_TO_US(sim_max_interval);
+	settings->cpu_target_temperature = C_TO_MC(sim_target);
+	settings->controller = mode;
+	settings->predict_horizon = sim_horizon;
+	settings->load_threshold = sim_load_threshold;
+
+	settings->turbo_gating = sim_turbo_gating;
+	settings->epp = sim_epp;
+	settings->idle_injection = sim_idle_injection;
+
+	if (sim_throttle_first != -1)
+		settings->throttle_first = sim_throttle_first;
+
+	/* cap every package through RAPL */
+	if (sim_rapl)
+		snprintf(settings->rapl_packages, MAX_BUF_SIZE, "0-%d", sim_packages - 1);
+
+	if (kp >= 0)
+		settings->pid_kp = kp;
+	if (ki >= 0)
+		settings->pid_ki = ki;
+	if (kd >= 0)
+		settings->pid_kd = kd;
+
+	if (fake_sysfs_create(sim_cpus, sim_packages, 0) == -1) {
+		fprintf(stderr, "Could not build the fake sysfs tree.\n");
+		rc = -1;
+		goto out;
+	}
+
+	for (i = 0; i < sim_packages; i++) {
+		package_temps[i] = sim_ambient;
+	}
+
+	initialise_hardware();
+	validate_settings();
+
+	if (open_sysfs_nodes() == -1) {
+		fprintf(stderr, "Could not open the nodes in %s.\n", fake_root);
+		rc = -1;
+		goto out;
+	}
+
+	/* what engine_init would do, without the timer and signals */
+	engine_reset();
+	for (i = 0; i < num_fans; i++) {
+		sysfs_node_write(&fans[i].pwm_enable, 1);
+	}
+
+	reads = sysfs_reads;
+	writes = sysfs_writes;
+
+	/* step the model by whatever interval the engine asks for */
+	for (t = 0; t < sim_duration; t += dt) {
+		sim_step(t, dt, result);
+		engine_tick();
+		result->ticks++;
+		dt = engine_interval() / 1000000.0;
+	}
+
+	result->reads = sysfs_reads - reads;
+	result->writes = sysfs_writes - writes;
+
+	close_sysfs_nodes();
+out:
+	fake_sysfs_destroy();
+
+	if (log_file != stderr)
+		fclose(log_file);
+	log_file = stderr;
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_result result;
+	int opt, i, mode = -1;
+	int kp = -1, ki = -1, kd = -1;
+
+	static struct option long_options[] = {
+		/* *name ,  has_arg,		   *flag,  val */
+		{"cpus",	required_argument,	   0, 'c' },
+		{"packages",	required_argument,	   0, 'k' },
+		{"duration",	required_argument,	   0, 'd' },
+		{"interval",	required_argument,	   0, 'i' },
+		{"max-interval",	required_argument,	   0, 'X' },
+		{"ambient",	required_argument,	   0, 'a' },
+		{"temp",	required_argument,	   0, 't' },
+		{"load",	required_argument,	   0, 'L' },
+		{"burst-period",	required_argument,	   0, 'b' },
+		{"controller",	required_argument,	   0, 'm' },
+		{"pid-kp",	required_argument,	   0, 'P' },
+		{"pid-ki",	required_argument,	   0, 'I' },
+		{"pid-kd",	required_argument,	   0, 'D' },
+		{"predict-horizon",	required_argument,	   0, 'H' },
+		{"load-threshold",	required_argument,	   0, 'U' },
+		{"rapl",	no_argument,	   0, 'p' },
+		{"turbo-gating",	no_argument,	   0, 'g' },
+		{"epp",	no_argument,	   0, 'e' },
+		{"idle-injection",	no_argument,	   0, 'j' },
+		{"throttle-first",	required_argument,	   0, 'Y' },
+		{"help",	no_argument,	   0, 'h' },
+		{"verbose",	no_argument,	   0, 'v' },
+		{0,		 0,				 0,  0 }
+	};
+
+	log_file = stderr;
+
+	while ((opt = getopt_long(argc, argv, "c:k:d:i:X:a:t:L:b:m:P:I:D:H:U:Y:pgejhv",
+					long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				sim_cpus = atoi(optarg);
+				break;
+			case 'k':
+				sim_packages = atoi(optarg);
+				break;
+			case 'd':
+				sim_duration = atoi(optarg);
+				break;
+			case 'i':
+				sim_interval = atoi(optarg);
+				break;
+			case 'X':
+				sim_max_interval = atoi(optarg);
+				break;
+			case 'a':
+				sim_ambient = atoi(optarg);
+				break;
+			case 't':
+				sim_target = atoi(optarg);
+				break;
+			case 'L':
+				sim_load = atof(optarg);
+				break;
+			case 'b':
+				sim_burst_period = atoi(optarg);
+				break;
+			case 'm':
+				if ((mode = controller_lookup(optarg)) == -1) {
+					fprintf(stderr, "Unknown controller %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'P':
+				kp = atof(optarg) * MHZ_TO_KHZ(1);
+				break;
+			case 'I':
+				ki = atof(optarg) * MHZ_TO_KHZ(1);
+				break;
+			case 'D':
+				kd = atof(optarg) * MHZ_TO_KHZ(1);
+				break;
+			case 'H':
+				sim_horizon = atoi(optarg);
+				break;
+			case 'U':
+				sim_load_threshold = atoi(optarg);
+				break;
+			case 'p':
+				sim_rapl = 1;
+				break;
+			case 'g':
+				sim_turbo_gating = 1;
+				break;
+			case 'e':
+				sim_epp = 1;
+				break;
+			case 'j':
+				sim_idle_injection = 1;
+				break;
+			case 'Y':
+				if ((sim_throttle_first = throttle_first_lookup(optarg)) == -1) {
+					fprintf(stderr, "Unknown cpu class %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				fake_hybrid = 1;
+				break;
+			case 'v':
+				sim_verbose = 1;
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf (stderr, "Usage: %s [OPTION]\n", argv[0]);
+				fprintf (stderr, "\nOptional commands:\n");
+				fprintf (stderr, "  -c, --cpus\t\t Number of simulated cpus.\n");
+				fprintf (stderr, "  -k, --packages\t Number of packages they are spread over.\n");
+				fprintf (stderr, "  -d, --duration\t Virtual time to simulate, in seconds.\n");
+				fprintf (stderr, "  -i, --interval\t Polling interval, in ms.\n");
+				fprintf (stderr, "  -X, --max-interval\t Longest adaptive polling interval, in ms.\n");
+				fprintf (stderr, "  -a, --ambient\t\t Ambient temperature, in degrees.\n");
+				fprintf (stderr, "  -t, --temp\t\t Target temperature, in degrees.\n");
+				fprintf (stderr, "  -L, --load\t\t Load on every cpu, from 0 to 1.\n");
+				fprintf (stderr, "  -b, --burst-period\t Seconds between load bursts, 0 for constant load.\n");
+				fprintf (stderr, "  -m, --controller\t Only simulate this controller.\n");
+				fprintf (stderr, "  -P, --pid-kp\t\t Proportional gain, in MHz per degree.\n");
+				fprintf (stderr, "  -I, --pid-ki\t\t Integral gain, in MHz per degree-second.\n");
+				fprintf (stderr, "  -D, --pid-kd\t\t Derivative gain, in MHz per degree/second.\n");
+				fprintf (stderr, "  -H, --predict-horizon\t Intervals ahead the engine predicts, 0 to disable.\n");
+				fprintf (stderr, "  -U, --load-threshold\t Only move the ceiling of policies at least this busy, in percent.\n");
+				fprintf (stderr, "  -p, --rapl\t\t Throttle through RAPL power limits.\n");
+				fprintf (stderr, "  -g, --turbo-gating\t Turn turbo off before cutting ceilings.\n");
+				fprintf (stderr, "  -e, --epp\t\t Throttle through energy performance preferences.\n");
+				fprintf (stderr, "  -j, --idle-injection\t Inject idle time once every ceiling is at the minimum.\n");
+				fprintf (stderr, "  -Y, --throttle-first\t Make every odd package efficiency cores and throttle none, e-cores or p-cores first.\n");
+				fprintf (stderr, "  -v, --verbose\t\t Print the engine's throttling decisions.\n");
+				fprintf (stderr, "  -h, --help\t\t Print this message.\n");
+				exit (EXIT_FAILURE);
+		}
+	}
+
+	if ((sim_packages < 1) || (sim_cpus < sim_packages) ||
+			(sim_cpus > MAX_CPUS) || (sim_interval <= 0)) {
+		fprintf(stderr, "Invalid cpu count, package count or interval.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* a hybrid part needs a package of either class */
+	if (fake_hybrid && (sim_packages < 2))
+		sim_packages = 2;
+
+	/* keep every package the same size */
+	sim_cpus -= sim_cpus % sim_packages;
+
+	package_temps = calloc(sim_packages, sizeof(double));
+
+	printf("%d cpus in %d package(s), %ds at %dms, load %.2f, "
+			"ambient %dC, target %dC\n\n", sim_cpus, sim_packages,
+			sim_duration, sim_interval, sim_load, sim_ambient, sim_target);
+	printf("%-12s %12s %10s %10s %8s %10s %10s\n", "controller",
+			"above target", "avg freq", "max temp", "ticks", "writes", "reads");
+
+	for (i = 0; i < NUM_CONTROLLERS; i++) {
+		if ((mode != -1) && (mode != i))
+			continue;
+
+		if (sim_run(i, &result, kp, ki, kd) == -1)
+			exit(EXIT_FAILURE);
+
+		printf("%-12s %11.1f%% %7.0fMHz %9.1fC %8ld %10lu %10lu\n",
+				controller->name,
+				100.0 * result.seconds_above_target / sim_duration,
+				KHZ_TO_MHZ(result.freq_sum / result.freq_time),
+				result.max_temp, result.ticks, result.writes, result.reads);
+	}
+
+	free(package_temps);
+
+	return 0;
+}
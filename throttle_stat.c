@@ -0,0 +1,196 @@
+/**
+* throttle_stat.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Reader for the telemetry ring published with --telemetry. The
+ * ring is only ever mapped and read, so following it costs the
+ * daemon nothing. */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "cpu_throttle.h"
+
+/* Names printed for each enum temp_band */
+static const char *band_names[] = { "below", "lower", "upper", "above" };
+
+/* Copy the record at index out of the ring, retrying while the
+ * daemon is writing it.
+ *
+ * @return: the tick the copy belongs to. */
+static uint64_t stat_copy(const struct telemetry_header *header,
+		uint64_t index, struct telemetry_record *copy)
+{
+	const struct telemetry_record *record;
+	uint32_t seq;
+
+	record = (const struct telemetry_record *)((const char *)(header + 1)
+			+ ((index % header->num_records) * header->record_size));
+
+	for (;;) {
+		seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, record, header->record_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq)
+			return copy->tick;
+	}
+}
+
+/* Print one record on a line. */
+static void stat_print(const struct telemetry_header *header,
+		const struct telemetry_record *record)
+{
+	const struct telemetry_policy *policy;
+	const int32_t *values;
+	uint32_t i;
+
+	printf("%8llu %10.3f ", (unsigned long long)record->tick,
+			record->time / 1000000000.0);
+
+	values = (const int32_t *)(record + 1);
+	for (i = 0; i < header->num_sensors; i++) {
+		printf(" %3dC", MC_TO_C(values[i]));
+	}
+
+	policy = (const struct telemetry_policy *)(values + header->num_sensors);
+	for (i = 0; i < header->num_policies; i++) {
+		printf("  [policy%d] %4dMHz %+5dMHz %s", policy[i].id,
+				KHZ_TO_MHZ(policy[i].max_freq),
+				KHZ_TO_MHZ(policy[i].step),
+				((policy[i].band >= BAND_BELOW) &&
+					(policy[i].band <= BAND_ABOVE))
+				? band_names[policy[i].band] : "unknown");
+	}
+
+	values = (const int32_t *)(policy + header->num_policies);
+	for (i = 0; i < header->num_fans; i++) {
+		printf("  [fan%d] %3d", i, values[i]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = TELEMETRY_PATH;
+	const struct telemetry_header *header;
+	struct telemetry_record *copy;
+	struct timespec interval;
+	uint64_t ticks, next = 0;
+	long count = -1;
+	struct stat stat_buf;
+	int opt, fd;
+
+	static struct option long_options[] = {
+		/* *name ,  has_arg,		   *flag,  val */
+		{"count",	required_argument,	   0, 'n' },
+		{"help",	no_argument,	   0, 'h' },
+		{0,		 0,				 0,  0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "n:h",
+					long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf (stderr, "Usage: %s [OPTION] [FILE]\n", argv[0]);
+				fprintf (stderr, "\nFollow the telemetry published by cpu_throttle,"
+						" " TELEMETRY_PATH " by default.\n");
+				fprintf (stderr, "\nOptional commands:\n");
+				fprintf (stderr, "  -n, --count\t\t Exit after printing this many ticks.\n");
+				fprintf (stderr, "  -h, --help\t\t Print this message.\n");
+				exit (EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	if ((fstat(fd, &stat_buf) == -1) ||
+			(stat_buf.st_size < sizeof(struct telemetry_header))) {
+		fprintf(stderr, "%s is not a telemetry file.\n", path);
+		return EXIT_FAILURE;
+	}
+
+	header = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if ((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC) ||
+			(header->version != TELEMETRY_VERSION) ||
+			(stat_buf.st_size < sizeof(struct telemetry_header)
+				+ ((size_t)header->num_records * header->record_size))) {
+		fprintf(stderr, "%s is not a telemetry file this reader "
+				"understands.\n", path);
+		return EXIT_FAILURE;
+	}
+
+	if (!(copy = malloc(header->record_size)))
+		return EXIT_FAILURE;
+
+	/* poll twice per tick of the daemon */
+	interval.tv_sec = header->polling_interval / 2000000;
+	interval.tv_nsec = (header->polling_interval % 2000000) * 500L;
+
+	/* start with the latest tick */
+	ticks = __atomic_load_n(&header->ticks, __ATOMIC_ACQUIRE);
+	if (ticks)
+		next = ticks - 1;
+
+	while (count) {
+		ticks = __atomic_load_n(&header->ticks, __ATOMIC_ACQUIRE);
+
+		if (next >= ticks) {
+			nanosleep(&interval, NULL);
+			continue;
+		}
+
+		/* the writer lapped us, skip to the oldest record left */
+		if (ticks - next > header->num_records)
+			next = ticks - header->num_records;
+
+		stat_copy(header, next++, copy);
+		stat_print(header, copy);
+		fflush(stdout);
+
+		if (count > 0)
+			count--;
+	}
+
+	free(copy);
+	return 0;
+}
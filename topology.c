@@ -0,0 +1,865 @@
+/**
+* topology.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <fcntl.h>
+#include <dirent.h>
+#include "cpu_throttle.h"
+
+struct hwmon_device * temp_hwmons;
+int num_temp_hwmons;
+struct temp_sensor * temp_sensors;
+int num_sensors;
+struct cpu_info * cpu_topology;
+int num_cpus;
+struct cpu_policy * cpu_policies;
+int num_policies;
+struct fan_control * fans;
+int num_fans;
+
+/* Parse a cpu list such as "0 1 2 3" (related_cpus) or
+ * "0-3,8-11" (cpulist format) into cpus, which has room
+ * for max_cpus entries.
+ *
+ * @return: the number of cpus parsed. */
+int parse_cpu_list(const char *buf, int *cpus, int max_cpus)
+{
+	const char *p = buf;
+	int count = 0, first, last, cpu;
+	char *end;
+
+	while (*p && (count < max_cpus)) {
+
+		/* skip separators */
+		if ((*p < '0') || (*p > '9')) {
+			p++;
+			continue;
+		}
+
+		first = last = strtol(p, &end, 10);
+		p = end;
+
+		/* expand ranges */
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			p = end;
+		}
+
+		for (cpu = first; (cpu <= last) && (count < max_cpus); cpu++) {
+			cpus[count++] = cpu;
+		}
+	}
+	return count;
+}
+
+/* Read the cpu list in the file at filename into cpus.
+ *
+ * @return: the number of cpus read, -1 on error. */
+static int read_cpu_list(const char *filename, int *cpus, int max_cpus)
+{
+	/* room for every cpu number and a separator */
+	char buf[MAX_CPUS * 6];
+	ssize_t rc;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return -1;
+
+	rc = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (rc <= 0)
+		return -1;
+
+	buf[rc] = '\0';
+	return parse_cpu_list(buf, cpus, max_cpus);
+}
+
+/* Read the integer in the file at filename without logging
+ * anything, for attributes which are allowed to be missing. Not
+ * counted as sysfs traffic, so a missing one is not an error.
+ *
+ * @return: the value read, -1 otherwise. */
+static int read_optional_integer(const char *filename)
+{
+	char buf[INT_BUF_SIZE];
+	ssize_t len;
+	int fd, value;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if ((len <= 0) || (parse_integer(buf, len, &value) == -1))
+		return -1;
+
+	return value;
+}
+
+/* Add a temperature sensor reading from path to temp_sensors.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int add_temp_sensor(const char *path, int package, int core_id)
+{
+	struct temp_sensor *sensor;
+
+	sensor = realloc(temp_sensors,
+			(num_sensors + 1) * sizeof(struct temp_sensor));
+	if (!sensor)
+		return -1;
+
+	temp_sensors = sensor;
+	sensor = &temp_sensors[num_sensors];
+
+	if (sysfs_node_open(&sensor->node, path, O_RDONLY) == -1)
+		return 0;
+
+	sensor->package = package;
+	sensor->core_id = core_id;
+	sensor->curr_temp = -1;
+
+	num_sensors++;
+	return 0;
+}
+
+/* Find the sensor for the given physical core, falling back
+ * to the package sensor if the core has none of its own.
+ *
+ * @return: index into temp_sensors, -1 if none matched. */
+static int find_temp_sensor(int package, int core_id)
+{
+	int i, package_sensor = -1;
+
+	for (i = 0; i < num_sensors; i++) {
+		if (temp_sensors[i].package != package)
+			continue;
+
+		if (temp_sensors[i].core_id == core_id)
+			return i;
+
+		if (temp_sensors[i].core_id == -1)
+			package_sensor = i;
+	}
+	return package_sensor;
+}
+
+/* Read a short sysfs string attribute into buf, stripping
+ * the trailing newline.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int read_string(const char *filename, char *buf, size_t size)
+{
+	ssize_t rc;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return -1;
+
+	rc = read(fd, buf, size - 1);
+	close(fd);
+
+	if (rc <= 0)
+		return -1;
+
+	if (buf[rc - 1] == '\n')
+		rc--;
+	buf[rc] = '\0';
+
+	return 0;
+}
+
+/* A hwmon driver we know how to use, matched on the
+ * name attribute of the hwmon device. */
+struct hwmon_driver {
+	const char *name;
+
+	/* match any name starting with name, for drivers which
+	 * report the chip model (e.g. nct6798, it8728) */
+	int prefix;
+
+	enum hwmon_type type;
+};
+
+static const struct hwmon_driver hwmon_drivers[] = {
+	{ "coretemp",	0, HWMON_CPU_TEMP },
+	{ "k10temp",	0, HWMON_CPU_TEMP },
+	{ "zenpower",	0, HWMON_CPU_TEMP },
+	{ "nct6",	1, HWMON_FAN },
+	{ "it8",	1, HWMON_FAN },
+	{ "asus_fan",	0, HWMON_FAN },
+	{ "thinkpad",	0, HWMON_FAN },
+};
+
+/* Look up the driver entry matching name.
+ *
+ * @return: the matching entry, NULL if the driver is unknown. */
+static const struct hwmon_driver *find_hwmon_driver(const char *name)
+{
+	size_t i, len;
+
+	for (i = 0; i < sizeof(hwmon_drivers) / sizeof(hwmon_drivers[0]); i++) {
+		len = strlen(hwmon_drivers[i].name);
+
+		if (hwmon_drivers[i].prefix ?
+				!strncmp(name, hwmon_drivers[i].name, len) :
+				!strcmp(name, hwmon_drivers[i].name))
+			return &hwmon_drivers[i];
+	}
+	return NULL;
+}
+
+/* qsort comparator ordering hwmon devices by index */
+static int compare_hwmon_indices(const void *a, const void *b)
+{
+	return ((const struct hwmon_device *)a)->index
+		- ((const struct hwmon_device *)b)->index;
+}
+
+/* Add hwmon to the cpu temperature devices.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int add_temp_hwmon(const struct hwmon_device *hwmon)
+{
+	struct hwmon_device *devices;
+
+	devices = realloc(temp_hwmons,
+			(num_temp_hwmons + 1) * sizeof(struct hwmon_device));
+	if (!devices)
+		return -1;
+
+	temp_hwmons = devices;
+	temp_hwmons[num_temp_hwmons++] = *hwmon;
+
+	return 0;
+}
+
+/* Add the first pwm channel of hwmon which supports manual
+ * control to the fans, along with its speed range.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int add_fan_hwmon(const struct hwmon_device *hwmon)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	struct fan_control *fan;
+	struct stat stat_buf;
+	int channel;
+
+	/* find out the naming convention for the pwm files */
+	for (channel = 0; channel <= MAX_HWMON_INPUTS; channel++) {
+		snprintf(filename, sizeof(filename), "%s/pwm%d_enable",
+				hwmon->path, channel);
+		if (stat(filename, &stat_buf) != -1)
+			break;
+	}
+
+	if (channel > MAX_HWMON_INPUTS)
+		return 0;
+
+	fan = realloc(fans, (num_fans + 1) * sizeof(struct fan_control));
+	if (!fan)
+		return -1;
+
+	fans = fan;
+	fan = &fans[num_fans++];
+	memset(fan, 0, sizeof(*fan));
+
+	fan->hwmon = *hwmon;
+	fan->channel = channel;
+	fan->pwm.node.fd = -1;
+	fan->pwm_enable.fd = -1;
+
+	/* asus_fan exports its own speed range, the
+	 * others use the full pwm range */
+	snprintf(filename, sizeof(filename), "%s/fan%d_speed_max",
+			hwmon->path, channel);
+	fan->hw_max_speed = read_optional_integer(filename);
+
+	snprintf(filename, sizeof(filename), "%s/fan%d_min",
+			hwmon->path, channel);
+	fan->hw_min_speed = read_optional_integer(filename);
+
+	if ((fan->hw_max_speed == -1) || (fan->hw_min_speed == -1)) {
+		fan->hw_min_speed = PWM_MIN;
+		fan->hw_max_speed = PWM_MAX;
+	}
+	fan->min_speed = fan->hw_min_speed;
+
+	return 0;
+}
+
+/* Walk the hwmon class directory and match every device by its
+ * driver name. cpu temperature devices (coretemp, k10temp,
+ * zenpower) go to temp_hwmons, one per package on multi-socket
+ * systems, and the first pwm channel of every fan control device
+ * (nct6775, it87, asus_fan, thinkpad) goes to fans.
+ *
+ * @return: the number of devices used, -1 on error. */
+int discover_hwmons(void)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	const struct hwmon_driver *driver;
+	struct hwmon_device *found = NULL, *devices;
+	struct dirent *entry;
+	int index, count = 0, i, rc = 0;
+	DIR *dir;
+
+	temp_hwmons = NULL;
+	num_temp_hwmons = 0;
+	fans = NULL;
+	num_fans = 0;
+
+	sysfs_path(filename, sizeof(filename), HWMON_DIR);
+	if (!(dir = opendir(filename)))
+		return -1;
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "hwmon%d", &index) != 1)
+			continue;
+
+		devices = realloc(found, (count + 1) * sizeof(struct hwmon_device));
+		if (!devices) {
+			rc = -1;
+			break;
+		}
+		found = devices;
+
+		found[count].index = index;
+		sysfs_path(found[count].path, MAX_BUF_SIZE,
+				HWMON_DIR "/hwmon%d", index);
+
+		snprintf(filename, sizeof(filename), "%s/name",
+				found[count].path);
+		if (read_string(filename, found[count].name, MIN_BUF_SIZE) == -1)
+			continue;
+
+		count++;
+	}
+	closedir(dir);
+
+	/* keep enumeration order stable across boots */
+	qsort(found, count, sizeof(struct hwmon_device), compare_hwmon_indices);
+
+	for (i = 0; (i < count) && (rc == 0); i++) {
+		if (!(driver = find_hwmon_driver(found[i].name)))
+			continue;
+
+		if (driver->type == HWMON_CPU_TEMP)
+			rc = add_temp_hwmon(&found[i]);
+		else
+			rc = add_fan_hwmon(&found[i]);
+	}
+	free(found);
+
+	return (rc == -1) ? -1 : (num_temp_hwmons + num_fans);
+}
+
+/* Free the devices found by discover_hwmons. */
+void free_hwmons(void)
+{
+	free(temp_hwmons);
+	free(fans);
+
+	temp_hwmons = NULL;
+	num_temp_hwmons = 0;
+	fans = NULL;
+	num_fans = 0;
+}
+
+/* Add the sensors of a k10temp or zenpower device, which only
+ * report package level temperatures. Tdie is preferred over Tctl
+ * since the latter may carry a fan control offset. */
+static void discover_k10temp_sensors(const struct hwmon_device *hwmon,
+		int package)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	char label[MIN_BUF_SIZE];
+	int index, best = 1, best_rank = 0, rank;
+
+	for (index = 1; index <= MAX_HWMON_INPUTS; index++) {
+		snprintf(filename, sizeof(filename), "%s/temp%d_label",
+				hwmon->path, index);
+		if (read_string(filename, label, sizeof(label)) == -1)
+			continue;
+
+		rank = !strcmp(label, "Tdie") ? 2 : !strcmp(label, "Tctl");
+		if (rank > best_rank) {
+			best = index;
+			best_rank = rank;
+		}
+	}
+
+	snprintf(filename, sizeof(filename), "%s/temp%d_input",
+			hwmon->path, best);
+	add_temp_sensor(filename, package, -1);
+}
+
+/* Read the coretemp temp*_label files of hwmon and add a sensor
+ * for every "Package id P" (or "Physical id P" on older kernels)
+ * and "Core N" input found. Core sensors take the package id of
+ * their device, or package if it has no package sensor. */
+static void discover_coretemp_sensors(const struct hwmon_device *hwmon,
+		int package)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	char label[MIN_BUF_SIZE];
+	int index, value, first = num_sensors, i;
+
+	for (index = 1; index <= MAX_HWMON_INPUTS; index++) {
+		snprintf(filename, sizeof(filename), "%s/temp%d_label",
+				hwmon->path, index);
+		if (read_string(filename, label, sizeof(label)) == -1)
+			continue;
+
+		snprintf(filename, sizeof(filename), "%s/temp%d_input",
+				hwmon->path, index);
+
+		if ((sscanf(label, "Package id %d", &value) == 1) ||
+				(sscanf(label, "Physical id %d", &value) == 1)) {
+			package = value;
+			add_temp_sensor(filename, value, -1);
+		}
+		else if (sscanf(label, "Core %d", &value) == 1) {
+			add_temp_sensor(filename, -1, value);
+		}
+	}
+
+	/* core sensors belong to the package of their hwmon instance */
+	for (i = first; i < num_sensors; i++) {
+		if (temp_sensors[i].package == -1)
+			temp_sensors[i].package = package;
+	}
+}
+
+/* Find the online cpus, their physical core and package, and
+ * the temperature sensor which covers each one. Every package
+ * gets the sensors of its own hwmon device.
+ *
+ * @return: the number of cpus found, -1 on error. */
+int discover_cpu_topology(void)
+{
+	char filename[MAX_BUF_SIZE];
+	int cpus[MAX_CPUS];
+	int count, cpu, i, num_packages = 0, num_pkg_hwmons = 0, pkg_hwmon = 0;
+
+	temp_sensors = NULL;
+	num_sensors = 0;
+
+	sysfs_path(filename, sizeof(filename), CPU_DIR "/online");
+	if ((count = read_cpu_list(filename, cpus, MAX_CPUS)) <= 0) {
+		LOGE("\tCould not read the online cpus.\n");
+		return -1;
+	}
+
+	/* cpus are indexed by number, size the table by the highest */
+	num_cpus = cpus[count - 1] + 1;
+	if (!(cpu_topology = malloc(num_cpus * sizeof(struct cpu_info))))
+		return -1;
+
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		cpu_topology[cpu].package = -1;
+		cpu_topology[cpu].core_id = -1;
+		cpu_topology[cpu].sensor = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		cpu = cpus[i];
+
+		sysfs_path(filename, sizeof(filename),
+				CPU_DIR "/cpu%d/topology/physical_package_id", cpu);
+		cpu_topology[cpu].package = read_optional_integer(filename);
+
+		sysfs_path(filename, sizeof(filename),
+				CPU_DIR "/cpu%d/topology/core_id", cpu);
+		cpu_topology[cpu].core_id = read_optional_integer(filename);
+
+		/* assume a single package if the kernel doesn't say */
+		if (cpu_topology[cpu].package == -1)
+			cpu_topology[cpu].package = 0;
+
+		if (cpu_topology[cpu].package >= num_packages)
+			num_packages = cpu_topology[cpu].package + 1;
+	}
+
+	for (i = 0; i < num_temp_hwmons; i++) {
+		if (strcmp(temp_hwmons[i].name, "coretemp"))
+			num_pkg_hwmons++;
+	}
+
+	/* add the sensors of every package */
+	for (i = 0; i < num_temp_hwmons; i++) {
+		if (strcmp(temp_hwmons[i].name, "coretemp")) {
+			/* k10temp/zenpower devices are per node and carry no
+			 * package id, spread them over the packages in order */
+			discover_k10temp_sensors(&temp_hwmons[i],
+					(pkg_hwmon++ * num_packages) / num_pkg_hwmons);
+		}
+		else {
+			discover_coretemp_sensors(&temp_hwmons[i], i);
+		}
+	}
+
+	if (!num_sensors) {
+		LOGE("\tCould not find any temperature sensors.\n");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		cpu = cpus[i];
+
+		cpu_topology[cpu].sensor = find_temp_sensor(
+				cpu_topology[cpu].package,
+				cpu_topology[cpu].core_id);
+
+		if ((cpu_topology[cpu].sensor == -1) && settings->verbose) {
+			LOGW("\t[cpu%d] No temperature sensor found.\n", cpu);
+		}
+	}
+	return count;
+}
+
+/* Free the tables built by discover_cpu_topology. */
+void free_cpu_topology(void)
+{
+	int i;
+
+	for (i = 0; i < num_sensors; i++) {
+		sysfs_node_close(&temp_sensors[i].node);
+	}
+	free(temp_sensors);
+	free(cpu_topology);
+
+	temp_sensors = NULL;
+	cpu_topology = NULL;
+	num_sensors = 0;
+	num_cpus = 0;
+}
+
+/* qsort comparator ordering frequencies */
+static int compare_freqs(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Returns the greatest common divisor of a and b. */
+static int gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Returns the step of the table of the intel_pstate policy with
+ * the cpufreq directory dir, in KHz: the coarsest one, up to
+ * INTEL_PSTATE_STEP, which its own minimum, maximum and base
+ * frequency are whole steps apart by. intel_pstate rounds these
+ * to 100MHz, so on hybrid performance cores, whose P-states are
+ * closer together, the table skips some. Every step still moves
+ * to another P-state. */
+static int intel_pstate_step(struct cpu_policy *policy, const char *dir)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE];
+	int step, base;
+
+	step = gcd(INTEL_PSTATE_STEP, policy->hw_max_freq - policy->hw_min_freq);
+
+	snprintf(filename, sizeof(filename), "%s/base_frequency", dir);
+	if ((base = read_optional_integer(filename)) > policy->hw_min_freq)
+		step = gcd(step, base - policy->hw_min_freq);
+
+	/* a grid this fine is not made of P-states */
+	if (step < INTEL_PSTATE_MIN_STEP)
+		return INTEL_PSTATE_STEP;
+
+	return step;
+}
+
+/* Build the sorted table of frequencies policy can run at, in KHz,
+ * from the scaling_available_frequencies in the policy directory dir.
+ * intel_pstate lists none, but moves in steps derived from the range
+ * of the policy, see intel_pstate_step. Drivers using CPPC, like amd-pstate, run at performance
+ * levels which map linearly onto frequency through the nominal one.
+ * Without any of these the policy is left without a table. */
+static void load_freq_table(struct cpu_policy *policy, const char *dir)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE], buf[MAX_BUF_SIZE];
+	char table[PSTATE_MAX_FREQS * INT_BUF_SIZE];
+	int freqs[PSTATE_MAX_FREQS], count = 0, i, freq, step;
+	int lowest, highest, nominal_perf, nominal_freq;
+	char *token, *saveptr;
+
+	snprintf(filename, sizeof(filename), "%s/scaling_available_frequencies", dir);
+	if (read_string(filename, table, sizeof(table)) == 0) {
+
+		/* a table which filled the buffer may end in
+		 * the middle of a number, drop what is left of it */
+		if ((strlen(table) == sizeof(table) - 1) &&
+				(token = strrchr(table, ' ')))
+			*token = '\0';
+
+		for (token = strtok_r(table, " ", &saveptr);
+				token && (count < PSTATE_MAX_FREQS);
+				token = strtok_r(NULL, " ", &saveptr)) {
+			if ((freq = atoi(token)) > 0)
+				freqs[count++] = freq;
+		}
+	}
+
+	snprintf(filename, sizeof(filename), "%s/scaling_driver", dir);
+	if (!count && (read_string(filename, buf, sizeof(buf)) == 0) &&
+			!strcmp(buf, "intel_pstate")) {
+		step = intel_pstate_step(policy, dir);
+		for (freq = policy->hw_min_freq; (freq <= policy->hw_max_freq) &&
+				(count < PSTATE_MAX_FREQS); freq += step)
+			freqs[count++] = freq;
+	}
+
+	if (!count) {
+		sysfs_path(filename, sizeof(filename), CPU_DIR "/cpu%d/acpi_cppc/lowest_perf", policy->cpus[0]);
+		lowest = read_optional_integer(filename);
+		sysfs_path(filename, sizeof(filename), CPU_DIR "/cpu%d/acpi_cppc/highest_perf", policy->cpus[0]);
+		highest = read_optional_integer(filename);
+		sysfs_path(filename, sizeof(filename), CPU_DIR "/cpu%d/acpi_cppc/nominal_perf", policy->cpus[0]);
+		nominal_perf = read_optional_integer(filename);
+		sysfs_path(filename, sizeof(filename), CPU_DIR "/cpu%d/acpi_cppc/nominal_freq", policy->cpus[0]);
+		nominal_freq = read_optional_integer(filename);
+
+		/* nominal_freq is in MHz */
+		if ((lowest > 0) && (highest >= lowest) && (nominal_perf > 0) &&
+				(nominal_freq > 0)) {
+			for (i = lowest; (i <= highest) && (count < PSTATE_MAX_FREQS); i++)
+				freqs[count++] = (int)((long long)MHZ_TO_KHZ(nominal_freq)
+						* i / nominal_perf);
+		}
+	}
+
+	if (!count)
+		return;
+
+	qsort(freqs, count, sizeof(int), compare_freqs);
+
+	if (!(policy->freqs = malloc(count * sizeof(int))))
+		return;
+
+	/* drop duplicates and anything outside the hardware range */
+	for (i = 0; i < count; i++) {
+		if ((freqs[i] < policy->hw_min_freq) || (freqs[i] > policy->hw_max_freq) ||
+				(policy->num_freqs &&
+				 (policy->freqs[policy->num_freqs - 1] == freqs[i])))
+			continue;
+		policy->freqs[policy->num_freqs++] = freqs[i];
+	}
+
+	if (!policy->num_freqs) {
+		free(policy->freqs);
+		policy->freqs = NULL;
+	}
+}
+
+/* Add a policy with the scaling_max_freq node at path
+ * and the given member cpus to cpu_policies.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int add_cpu_policy(int id, const char *path, int *cpus, int count)
+{
+	char dir[MAX_BUF_SIZE], filename[MAX_BUF_SIZE + MIN_BUF_SIZE], *slash;
+	struct cpu_policy *policy;
+	int i, members = 0;
+
+	/* only keep the cpus we know about */
+	for (i = 0; i < count; i++) {
+		if (cpus[i] < num_cpus)
+			cpus[members++] = cpus[i];
+	}
+
+	if (!members)
+		return 0;
+
+	policy = realloc(cpu_policies,
+			(num_policies + 1) * sizeof(struct cpu_policy));
+	if (!policy)
+		return -1;
+
+	cpu_policies = policy;
+	policy = &cpu_policies[num_policies];
+	memset(policy, 0, sizeof(*policy));
+
+	policy->id = id;
+	policy->num_cpus = members;
+	controller_reset(policy);
+
+	if (!(policy->cpus = malloc(members * sizeof(int))))
+		return -1;
+
+	memcpy(policy->cpus, cpus, members * sizeof(int));
+
+	if (actuator_open(&policy->max_freq, path) == -1) {
+		LOGW("\t[policy%d] Could not read scaling_max_freq.\n", id);
+	}
+
+	/* the attributes sit next to scaling_max_freq */
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((slash = strrchr(dir, '/')))
+		*slash = '\0';
+
+	/* hybrid parts have a range per cpu class */
+	snprintf(filename, sizeof(filename), "%s/cpuinfo_min_freq", dir);
+	if ((policy->hw_min_freq = read_optional_integer(filename)) <= 0)
+		policy->hw_min_freq = cpuinfo_min_freq;
+	snprintf(filename, sizeof(filename), "%s/cpuinfo_max_freq", dir);
+	if ((policy->hw_max_freq = read_optional_integer(filename)) <= 0)
+		policy->hw_max_freq = cpuinfo_max_freq;
+
+	sysfs_path(filename, sizeof(filename), CPU_DIR "/cpu%d/cpu_capacity",
+			policy->cpus[0]);
+	policy->capacity = read_optional_integer(filename);
+
+	load_freq_table(policy, dir);
+
+	num_policies++;
+	return 0;
+}
+
+/* qsort comparator ordering policies by id */
+static int compare_policy_ids(const void *a, const void *b)
+{
+	return ((const struct cpu_policy *)a)->id
+		- ((const struct cpu_policy *)b)->id;
+}
+
+/* Sort the policies into cpu classes. Policies with less capacity
+ * than the biggest cores are efficiency ones. Without cpu_capacity,
+ * the cpus listed by the cpu_atom PMU of Intel hybrid parts are.
+ * Favored cores give homogeneous parts per core maximum frequencies
+ * too, so these alone never make a part hybrid. */
+static void classify_cpu_policies(void)
+{
+	char filename[MAX_BUF_SIZE];
+	int cpus[MAX_CPUS], count, i, j, max_capacity = -1;
+
+	for (i = 0; i < num_policies; i++) {
+		cpu_policies[i].cpu_class = CPU_CLASS_PERFORMANCE;
+		if (cpu_policies[i].capacity > max_capacity)
+			max_capacity = cpu_policies[i].capacity;
+	}
+
+	if (max_capacity > 0) {
+		for (i = 0; i < num_policies; i++) {
+			if ((cpu_policies[i].capacity != -1) &&
+					(cpu_policies[i].capacity < max_capacity))
+				cpu_policies[i].cpu_class = CPU_CLASS_EFFICIENCY;
+		}
+		return;
+	}
+
+	sysfs_path(filename, sizeof(filename), ATOM_CPUS_PATH);
+	if ((count = read_cpu_list(filename, cpus, MAX_CPUS)) <= 0)
+		return;
+
+	for (i = 0; i < num_policies; i++) {
+		for (j = 0; j < count; j++) {
+			if (cpus[j] == cpu_policies[i].cpus[0]) {
+				cpu_policies[i].cpu_class = CPU_CLASS_EFFICIENCY;
+				break;
+			}
+		}
+	}
+}
+
+/* Group the online cpus by the cpufreq policy they
+ * share, so each policy is written once per interval. Falls
+ * back to one policy per cpu if no policy directories exist.
+ *
+ * @return: the number of policies found, -1 on error. */
+int discover_cpu_policies(void)
+{
+	char filename[MAX_BUF_SIZE];
+	int cpus[MAX_CPUS];
+	struct dirent *entry;
+	DIR *dir;
+	int id, count, cpu;
+
+	cpu_policies = NULL;
+	num_policies = 0;
+
+	/* the cpufreq directory holds one policyN entry per policy */
+	sysfs_path(filename, sizeof(filename), CPUFREQ_DIR);
+	if ((dir = opendir(filename))) {
+		while ((entry = readdir(dir))) {
+			if (sscanf(entry->d_name, "policy%d", &id) != 1)
+				continue;
+
+			sysfs_path(filename, sizeof(filename),
+					POLICY_DIR, id, "related_cpus");
+			if ((count = read_cpu_list(filename, cpus, MAX_CPUS)) <= 0)
+				continue;
+
+			sysfs_path(filename, sizeof(filename),
+					POLICY_DIR, id, "scaling_max_freq");
+			if (add_cpu_policy(id, filename, cpus, count) == -1) {
+				closedir(dir);
+				return -1;
+			}
+		}
+		closedir(dir);
+	}
+
+	if (num_policies) {
+		/* readdir order is arbitrary, keep them sorted by id */
+		qsort(cpu_policies, num_policies,
+				sizeof(struct cpu_policy), compare_policy_ids);
+		classify_cpu_policies();
+		return num_policies;
+	}
+
+	/* older kernels: every cpu is its own policy */
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (cpu_topology[cpu].package == -1)
+			continue;
+
+		sysfs_path(filename, sizeof(filename),
+				SCALING_DIR, cpu, "scaling_max_freq");
+		cpus[0] = cpu;
+		if (add_cpu_policy(cpu, filename, cpus, 1) == -1)
+			return -1;
+	}
+	classify_cpu_policies();
+	return num_policies;
+}
+
+/* Free the policies found by discover_cpu_policies. */
+void free_cpu_policies(void)
+{
+	int i;
+
+	for (i = 0; i < num_policies; i++) {
+		sysfs_node_close(&cpu_policies[i].max_freq.node);
+		free(cpu_policies[i].cpus);
+		free(cpu_policies[i].freqs);
+	}
+	free(cpu_policies);
+
+	cpu_policies = NULL;
+	num_policies = 0;
+}
@@ -0,0 +1,156 @@
+/**
+* turbo.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Turbo gating, the first stage of throttling. The top turbo bins
+ * cost the most power for the least performance, so they are turned
+ * off before any ceiling is cut, and turned back on once the package
+ * is well below the hysteresis band. */
+
+#include <fcntl.h>
+#include "cpu_throttle.h"
+
+/* intel_pstate/no_turbo or cpufreq/boost */
+static struct actuator turbo = { .node = { .fd = -1 }, .value = -1 };
+
+/* true if the node holds no_turbo, where 1 means off */
+static int turbo_inverted;
+
+/* true while turbo is off because we turned it off */
+static int turbo_off;
+
+/* Find the global turbo switch, intel_pstate's no_turbo or the
+ * boost attribute of acpi-cpufreq and amd-pstate.
+ *
+ * @return: 0 if succesful, -1 if there is none. */
+int turbo_open(void)
+{
+	char filename[MAX_BUF_SIZE];
+
+	sysfs_path(filename, sizeof(filename), CPU_DIR "/intel_pstate/no_turbo");
+	turbo_inverted = 1;
+
+	if (access(filename, W_OK) == -1) {
+		sysfs_path(filename, sizeof(filename), CPUFREQ_DIR "/boost");
+		turbo_inverted = 0;
+
+		if (access(filename, W_OK) == -1)
+			return -1;
+	}
+
+	if (actuator_open(&turbo, filename) == -1)
+		return -1;
+
+	turbo_off = 0;
+	return 0;
+}
+
+/* Returns 1 if turbo is on, 0 if it is off, -1 if unknown. */
+int turbo_state(void)
+{
+	if (turbo.value == -1)
+		return -1;
+
+	return turbo_inverted ? !turbo.value : !!turbo.value;
+}
+
+/* Turn turbo on or off.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int turbo_set(int on)
+{
+	return actuator_set(&turbo, turbo_inverted ? !on : on);
+}
+
+/* Returns true if turbo is off because the daemon turned it off. */
+int turbo_gated(void)
+{
+	return turbo_off;
+}
+
+/* Turn turbo off once temp passes turbo_off_offset above the target
+ * and back on once it is turbo_on_margin below the hysteresis band.
+ * Only turbo the daemon turned off is turned back on, right away
+ * if gating is turned off.
+ *
+ * @return: 1 if turbo was turned off this interval, 0 otherwise. */
+int turbo_update(int temp)
+{
+	int state;
+
+	if (turbo.node.fd == -1)
+		return 0;
+
+	/* give turbo back if gating was turned off at runtime */
+	if (!settings->turbo_gating) {
+		turbo_restore();
+		return 0;
+	}
+
+	if (temp == -1)
+		return 0;
+
+	/* pick up changes made behind our back */
+	actuator_get(&turbo);
+
+	if ((state = turbo_state()) == -1)
+		return 0;
+
+	/* turned back on by someone else, it is theirs again */
+	if (state)
+		turbo_off = 0;
+
+	if (state && (temp > settings->cpu_target_temperature
+				+ settings->turbo_off_offset)) {
+		if (settings->verbose) {
+			LOGI("\tDisabling turbo at %dC.\n", MC_TO_C(temp));
+		}
+		if (turbo_set(0) == -1)
+			return 0;
+
+		turbo_off = 1;
+		return 1;
+	}
+
+	if (turbo_off && (temp < hysteresis_lower_limit
+				- settings->turbo_on_margin)) {
+		if (settings->verbose) {
+			LOGI("\tEnabling turbo at %dC.\n", MC_TO_C(temp));
+		}
+		turbo_restore();
+	}
+	return 0;
+}
+
+/* Turn turbo back on if the daemon turned it off. */
+void turbo_restore(void)
+{
+	if (turbo_off && (turbo_set(1) == 0))
+		turbo_off = 0;
+}
+
+/* Restore turbo and close its node. */
+void turbo_close(void)
+{
+	turbo_restore();
+	sysfs_node_close(&turbo.node);
+	turbo.value = -1;
+	turbo_off = 0;
+}
@@ -0,0 +1,412 @@
+/**
+* wakeup.c
+*
+* Copyright (C) 2017 Vincent Zvikaramba <vincent.zvikaramba@mail.utoronto.ca>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This source is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with the source code.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+
+/* Event driven wakeups. While the machine is cool and nothing is
+ * throttled, the engine stops polling and sleeps until an alarm
+ * programmed at the bottom of the hysteresis band goes off:
+ *
+ *   - hwmon tempN_max, where the driver lets it be written, with
+ *     tempN_max_alarm watched for sysfs notifications
+ *   - passive trip points of x86_pkg_temp thermal zones, whose
+ *     crossings arrive on the thermal netlink event group
+ *
+ * Fast polling resumes once any of them fires. */
+
+#include "cpu_throttle.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+/* generic netlink family and multicast group of thermal events */
+#define THERMAL_GENL_NAME "thermal"
+#define THERMAL_GENL_EVENTS "event"
+
+/* thermal zone types with trip points which may be moved */
+static const char *wakeup_zone_types[] = {
+	"x86_pkg_temp",
+};
+
+static struct wakeup_alarm *alarms;
+static int num_alarms;
+
+static struct wakeup_trip *trips;
+static int num_trips;
+
+/* socket subscribed to thermal netlink events, -1 if none */
+static int netlink_fd = -1;
+
+/* true while the alarms are programmed */
+static int armed;
+
+/* Read the file at filename into buf, without the newline, quietly.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int wakeup_read(const char *filename, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len <= 0)
+		return -1;
+
+	if (buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/* Called from the loop when an alarm, or any thermal event, fired. */
+static void wakeup_event(int fd, uint32_t events)
+{
+	char buf[MAX_BUF_SIZE];
+
+	/* drain the socket, or re-arm the sysfs notification */
+	if (fd == netlink_fd) {
+		while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+			;
+	}
+	else if (pread(fd, buf, sizeof(buf), 0) == -1) {
+		LOGW("\tCould not read an alarm: %s\n", strerror(errno));
+	}
+
+	engine_wake();
+}
+
+/* Add an alarm for every sensor whose tempN_max can be written. */
+static void wakeup_open_alarms(void)
+{
+	char filename[MAX_BUF_SIZE + MIN_BUF_SIZE], base[MAX_BUF_SIZE];
+	struct wakeup_alarm *alarm;
+	char *suffix;
+	int i;
+
+	for (i = 0; i < num_sensors; i++) {
+		snprintf(base, sizeof(base), "%s", temp_sensors[i].node.path);
+		if (!(suffix = strstr(base, "_input")))
+			continue;
+		*suffix = '\0';
+
+		snprintf(filename, sizeof(filename), "%s_max", base);
+		if (access(filename, W_OK) == -1)
+			continue;
+
+		alarm = realloc(alarms, (num_alarms + 1) * sizeof(struct wakeup_alarm));
+		if (!alarm)
+			return;
+		alarms = alarm;
+		alarm = &alarms[num_alarms];
+
+		if (actuator_open(&alarm->max, filename) == -1) {
+			sysfs_node_close(&alarm->max.node);
+			continue;
+		}
+		alarm->orig_max = alarm->max.value;
+
+		snprintf(filename, sizeof(filename), "%s_max_alarm", base);
+		if ((sysfs_node_open(&alarm->alarm, filename, O_RDONLY) == -1) ||
+				(engine_add_fd(alarm->alarm.fd, EPOLLPRI,
+					wakeup_event) == -1)) {
+			sysfs_node_close(&alarm->alarm);
+			sysfs_node_close(&alarm->max.node);
+			continue;
+		}
+
+		/* a notification is only raised after a read */
+		sysfs_node_read(&alarm->alarm);
+		num_alarms++;
+	}
+}
+
+/* Add the first writable passive trip point of every thermal
+ * zone of a known type. */
+static void wakeup_open_trips(void)
+{
+	char dirname[MAX_BUF_SIZE], path[MAX_BUF_SIZE];
+	char type[MIN_BUF_SIZE];
+	struct wakeup_trip *trip;
+	struct dirent *entry;
+	int zone, point, end;
+	size_t i;
+	DIR *dir;
+
+	sysfs_path(dirname, sizeof(dirname), THERMAL_DIR);
+	if (!(dir = opendir(dirname)))
+		return;
+
+	while ((entry = readdir(dir))) {
+		if ((sscanf(entry->d_name, "thermal_zone%d%n", &zone, &end) != 1) ||
+				entry->d_name[end])
+			continue;
+
+		sysfs_path(path, sizeof(path), THERMAL_DIR "/thermal_zone%d/type", zone);
+		if (wakeup_read(path, type, sizeof(type)) == -1)
+			continue;
+
+		for (i = 0; i < sizeof(wakeup_zone_types) / sizeof(wakeup_zone_types[0]); i++) {
+			if (!strcmp(type, wakeup_zone_types[i]))
+				break;
+		}
+		if (i == sizeof(wakeup_zone_types) / sizeof(wakeup_zone_types[0]))
+			continue;
+
+		for (point = 0; ; point++) {
+			sysfs_path(path, sizeof(path), THERMAL_DIR
+					"/thermal_zone%d/trip_point_%d_type", zone, point);
+			if (wakeup_read(path, type, sizeof(type)) == -1)
+				break;
+
+			sysfs_path(path, sizeof(path), THERMAL_DIR
+					"/thermal_zone%d/trip_point_%d_temp", zone, point);
+			if (strcmp(type, "passive") || (access(path, W_OK) == -1))
+				continue;
+
+			trip = realloc(trips, (num_trips + 1) * sizeof(struct wakeup_trip));
+			if (!trip)
+				break;
+			trips = trip;
+			trip = &trips[num_trips];
+
+			if (actuator_open(&trip->temp, path) == -1) {
+				sysfs_node_close(&trip->temp.node);
+				continue;
+			}
+			trip->zone = zone;
+			trip->orig_temp = trip->temp.value;
+			num_trips++;
+			break;
+		}
+	}
+	closedir(dir);
+}
+
+/* Append the attribute type holding len bytes of data to msg.
+ *
+ * @return: the new length of msg. */
+static size_t wakeup_put_attr(struct nlmsghdr *msg, int type,
+		const void *data, size_t len)
+{
+	struct nlattr *attr;
+
+	attr = (struct nlattr *)((char *)msg + NLMSG_ALIGN(msg->nlmsg_len));
+	attr->nla_type = type;
+	attr->nla_len = NLA_HDRLEN + len;
+	memcpy((char *)attr + NLA_HDRLEN, data, len);
+
+	msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + NLA_ALIGN(attr->nla_len);
+	return msg->nlmsg_len;
+}
+
+/* Returns the id of the multicast group called name in the
+ * CTRL_ATTR_MCAST_GROUPS attribute groups, 0 if it is not there. */
+static int wakeup_find_group(struct nlattr *groups, const char *name)
+{
+	struct nlattr *group, *attr;
+	int remaining, left, id;
+	const char *found;
+
+	group = (struct nlattr *)((char *)groups + NLA_HDRLEN);
+	remaining = groups->nla_len - NLA_HDRLEN;
+
+	for (; remaining >= NLA_HDRLEN; remaining -= NLA_ALIGN(group->nla_len),
+			group = (struct nlattr *)((char *)group + NLA_ALIGN(group->nla_len))) {
+		found = NULL;
+		id = 0;
+
+		attr = (struct nlattr *)((char *)group + NLA_HDRLEN);
+		left = group->nla_len - NLA_HDRLEN;
+
+		for (; left >= NLA_HDRLEN; left -= NLA_ALIGN(attr->nla_len),
+				attr = (struct nlattr *)((char *)attr + NLA_ALIGN(attr->nla_len))) {
+			if (attr->nla_type == CTRL_ATTR_MCAST_GRP_NAME)
+				found = (const char *)attr + NLA_HDRLEN;
+			else if (attr->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+				id = *(uint32_t *)((char *)attr + NLA_HDRLEN);
+		}
+
+		if (found && !strcmp(found, name))
+			return id;
+	}
+	return 0;
+}
+
+/* Subscribe to the thermal netlink event group, which reports
+ * trip point crossings of every thermal zone.
+ *
+ * @return: 0 if succesful, -1 otherwise. */
+static int wakeup_open_netlink(void)
+{
+	struct {
+		struct nlmsghdr msg;
+		struct genlmsghdr genl;
+		char attrs[MIN_BUF_SIZE];
+	} request;
+	char reply[MAX_BUF_SIZE * 4];
+	struct nlmsghdr *msg = (struct nlmsghdr *)reply;
+	struct nlattr *attr;
+	int remaining, group = 0;
+	ssize_t len;
+
+	if ((netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+					NETLINK_GENERIC)) == -1)
+		return -1;
+
+	/* resolve the family and its groups by name */
+	memset(&request, 0, sizeof(request));
+	request.msg.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	request.msg.nlmsg_type = GENL_ID_CTRL;
+	request.msg.nlmsg_flags = NLM_F_REQUEST;
+	request.genl.cmd = CTRL_CMD_GETFAMILY;
+	request.genl.version = 1;
+	wakeup_put_attr(&request.msg, CTRL_ATTR_FAMILY_NAME,
+			THERMAL_GENL_NAME, sizeof(THERMAL_GENL_NAME));
+
+	if ((send(netlink_fd, &request, request.msg.nlmsg_len, 0) == -1) ||
+			((len = recv(netlink_fd, reply, sizeof(reply), 0)) <= 0) ||
+			!NLMSG_OK(msg, len) || (msg->nlmsg_type == NLMSG_ERROR))
+		goto fail;
+
+	attr = (struct nlattr *)((char *)NLMSG_DATA(msg) + GENL_HDRLEN);
+	remaining = msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+	for (; remaining >= NLA_HDRLEN; remaining -= NLA_ALIGN(attr->nla_len),
+			attr = (struct nlattr *)((char *)attr + NLA_ALIGN(attr->nla_len))) {
+		if ((attr->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_MCAST_GROUPS)
+			group = wakeup_find_group(attr, THERMAL_GENL_EVENTS);
+	}
+
+	if (!group || (setsockopt(netlink_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+					&group, sizeof(group)) == -1) ||
+			(engine_add_fd(netlink_fd, EPOLLIN, wakeup_event) == -1))
+		goto fail;
+
+	return 0;
+
+fail:
+	close(netlink_fd);
+	netlink_fd = -1;
+	return -1;
+}
+
+/* Find the alarms and trip points the engine can sleep on, and
+ * subscribe to thermal events. Must be called after engine_init.
+ *
+ * @return: the number of alarms and trip points found. */
+int wakeup_open(void)
+{
+	wakeup_open_alarms();
+	wakeup_open_trips();
+
+	/* trip points are only heard of through netlink */
+	if ((wakeup_open_netlink() == -1) && num_trips) {
+		LOGW("\tCould not subscribe to thermal events, "
+				"not using trip points.\n");
+		wakeup_disarm();
+		while (num_trips)
+			sysfs_node_close(&trips[--num_trips].temp.node);
+	}
+
+	return num_alarms + num_trips;
+}
+
+/* Program every alarm and trip point at temp, in mC.
+ *
+ * @return: 0 if at least one is set and none has fired yet,
+ * -1 otherwise. */
+int wakeup_arm(int temp)
+{
+	int i, count = 0;
+
+	for (i = 0; i < num_alarms; i++) {
+		if (actuator_set(&alarms[i].max, temp) == 0)
+			count++;
+	}
+
+	for (i = 0; i < num_trips; i++) {
+		if (actuator_set(&trips[i].temp, temp) == 0)
+			count++;
+	}
+	armed = 1;
+
+	/* the temperature may have crossed before we got here */
+	for (i = 0; i < num_alarms; i++) {
+		if (sysfs_node_read(&alarms[i].alarm) > 0)
+			return -1;
+	}
+
+	return count ? 0 : -1;
+}
+
+/* Put every alarm and trip point back where it was found. */
+void wakeup_disarm(void)
+{
+	int i;
+
+	if (!armed)
+		return;
+
+	for (i = 0; i < num_alarms; i++) {
+		actuator_set(&alarms[i].max, alarms[i].orig_max);
+	}
+
+	for (i = 0; i < num_trips; i++) {
+		actuator_set(&trips[i].temp, trips[i].orig_temp);
+	}
+	armed = 0;
+}
+
+/* Disarm and close everything opened by wakeup_open. */
+void wakeup_close(void)
+{
+	int i;
+
+	wakeup_disarm();
+
+	for (i = 0; i < num_alarms; i++) {
+		engine_remove_fd(alarms[i].alarm.fd);
+		sysfs_node_close(&alarms[i].alarm);
+		sysfs_node_close(&alarms[i].max.node);
+	}
+	free(alarms);
+	alarms = NULL;
+	num_alarms = 0;
+
+	for (i = 0; i < num_trips; i++) {
+		sysfs_node_close(&trips[i].temp.node);
+	}
+	free(trips);
+	trips = NULL;
+	num_trips = 0;
+
+	if (netlink_fd != -1) {
+		engine_remove_fd(netlink_fd);
+		close(netlink_fd);
+		netlink_fd = -1;
+	}
+}